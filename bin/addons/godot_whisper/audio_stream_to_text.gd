@@ -12,7 +12,7 @@ extends SpeechToText
 @export var audio_stream: AudioStreamWAV:
 	set(value):
 		audio_stream = value
-		text = get_text()
+		_transcribe_async()
 	get:
 		return audio_stream
 
@@ -22,18 +22,52 @@ extends SpeechToText
 ## Flag to start transcription
 @export var start_transcribe := false:
 	set(value):
-		text = get_text()
+		_transcribe_async()
 	get:
 		return false
 
+var _job_id := 0
+var _start_time := 0
 
-## Get the transcribed text from the audio stream
+
+## Connect the native transcription signals
+func _init() -> void:
+	transcription_completed.connect(_on_transcription_completed)
+
+
+## Get the transcribed text from the audio stream, blocking until it is done
 func get_text() -> String:
 	# Return early if audio stream is null
 	if audio_stream == null:
 		return ""
 
 	var start_time := Time.get_ticks_msec()
+	var tokens := transcribe(_get_audio_data(), initial_prompt, 0)
+	print("Transcribe: " + str((Time.get_ticks_msec() - start_time) / 1000.0))
+	return _get_text_from_tokens(tokens)
+
+
+## Queue the audio stream on the native worker, text is set when it completes
+func _transcribe_async() -> void:
+	if audio_stream == null:
+		return
+	if _job_id != 0:
+		cancel_transcription(_job_id)
+	_start_time = Time.get_ticks_msec()
+	_job_id = transcribe_async(_get_audio_data(), initial_prompt, 0)
+
+
+## Handle a finished transcribe_async job
+func _on_transcription_completed(job_id: int, result: Array) -> void:
+	if job_id != _job_id:
+		return
+	_job_id = 0
+	print("Transcribe: " + str((Time.get_ticks_msec() - _start_time) / 1000.0))
+	text = _get_text_from_tokens(result)
+
+
+## Decode the audio stream into float samples
+func _get_audio_data() -> PackedFloat32Array:
 	var data := audio_stream.data
 	var data_float: PackedFloat32Array
 
@@ -44,8 +78,11 @@ func get_text() -> String:
 		AudioStreamWAV.FORMAT_16_BITS:
 			for i in range(data.size() / 2):
 				data_float.append(data.decode_s16(i * 2) / 32768.0)
+	return data_float
+
 
-	var tokens := transcribe(data_float, initial_prompt, 0)
+## Build the text from the transcribe result
+func _get_text_from_tokens(tokens: Array) -> String:
 	if tokens.is_empty():
 		return ""
 
@@ -57,7 +94,6 @@ func get_text() -> String:
 		text += token["text"]
 	text = full_text
 
-	print("Transcribe: " + str((Time.get_ticks_msec() - start_time) / 1000.0))
 	print(text)
 	return _remove_special_characters(text)
 
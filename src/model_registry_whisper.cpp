@@ -0,0 +1,101 @@
+#include "model_registry_whisper.h"
+
+#include <godot_cpp/classes/file_access.hpp>
+#include <godot_cpp/classes/project_settings.hpp>
+
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+namespace {
+
+struct RegistryEntry {
+	String key;
+	// nullptr while the model is being loaded.
+	whisper_context *context = nullptr;
+	int reference_count = 0;
+};
+
+std::mutex registry_mutex;
+// Signaled when a model finished loading, successfully or not.
+std::condition_variable registry_condition;
+std::vector<RegistryEntry> registry_entries;
+
+std::vector<RegistryEntry>::iterator _find_entry(const String &p_key) {
+	for (auto it = registry_entries.begin(); it != registry_entries.end(); ++it) {
+		if (it->key == p_key) {
+			return it;
+		}
+	}
+	return registry_entries.end();
+}
+
+whisper_context *_load_model(const Ref<WhisperResource> &p_model, const whisper_context_params &p_params) {
+	// Map the file when it exists on disk, models packed in a .pck are read into memory instead.
+	// whisper.cpp already reads a file it cannot map, so a failure here is not retried from the buffer.
+	const String global_path = ProjectSettings::get_singleton()->globalize_path(p_model->get_file());
+	if (p_params.use_mmap && FileAccess::file_exists(global_path)) {
+		return whisper_init_from_file_with_params_no_state(global_path.utf8().get_data(), p_params);
+	}
+	PackedByteArray data = p_model->get_content();
+	if (data.is_empty()) {
+		return nullptr;
+	}
+	return whisper_init_from_buffer_with_params_no_state((void *)(data.ptr()), data.size(), p_params);
+}
+
+} // namespace
+
+whisper_context *WhisperModelRegistry::acquire(const Ref<WhisperResource> &p_model, const whisper_context_params &p_params) {
+	if (p_model.is_null()) {
+		return nullptr;
+	}
+	// A resource built in memory has no file, it can only be shared with itself.
+	String key = p_model->get_file();
+	if (key.is_empty()) {
+		key = "#" + String::num_uint64(p_model->get_instance_id());
+	}
+	// A GPU and a CPU context of the same file are different models, and so are contexts with other KV cache types.
+	key += String(p_params.use_gpu ? "|gpu" : "|cpu") + "|" + ggml_type_name(p_params.type_kv);
+	std::unique_lock<std::mutex> lock(registry_mutex);
+	for (auto it = _find_entry(key); it != registry_entries.end(); it = _find_entry(key)) {
+		if (it->context) {
+			it->reference_count++;
+			return it->context;
+		}
+		// Another node is loading the same model, it is shared once that is done.
+		registry_condition.wait(lock);
+	}
+	RegistryEntry entry;
+	entry.key = key;
+	registry_entries.push_back(entry);
+	// Loading can take seconds, other models are acquired and released in the meantime.
+	lock.unlock();
+	whisper_context *context = _load_model(p_model, p_params);
+	lock.lock();
+	auto it = _find_entry(key);
+	if (!context) {
+		registry_entries.erase(it);
+	} else {
+		it->context = context;
+		it->reference_count = 1;
+	}
+	registry_condition.notify_all();
+	return context;
+}
+
+void WhisperModelRegistry::release(whisper_context *p_context) {
+	if (!p_context) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock(registry_mutex);
+	for (auto it = registry_entries.begin(); it != registry_entries.end(); ++it) {
+		if (it->context == p_context) {
+			if (--it->reference_count == 0) {
+				whisper_free(it->context);
+				registry_entries.erase(it);
+			}
+			return;
+		}
+	}
+}
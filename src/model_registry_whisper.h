@@ -0,0 +1,22 @@
+#ifndef WHISPER_MODEL_REGISTRY_H
+#define WHISPER_MODEL_REGISTRY_H
+
+#include "resource_whisper.h"
+
+#include <whisper.cpp/whisper.h>
+
+using namespace godot;
+
+// Process-wide cache of loaded models, keyed by the WhisperResource path.
+// Every SpeechToText node that uses the same model shares one context without state and creates
+// only its own whisper_state, so the weights are loaded once no matter how many nodes there are.
+class WhisperModelRegistry {
+public:
+	// Returns the shared context for the model, loading it on first use, or nullptr on failure.
+	// Every successful acquire() has to be paired with a release().
+	static whisper_context *acquire(const Ref<WhisperResource> &p_model, const whisper_context_params &p_params);
+	// Drops one reference, the model is freed with the last one.
+	static void release(whisper_context *p_context);
+};
+
+#endif // WHISPER_MODEL_REGISTRY_H
@@ -1,14 +1,20 @@
 #include "register_types.h"
 
+#include "resampler_whisper.h"
 #include "resource_loader_whisper.h"
 #include "resource_whisper.h"
+#include "result_whisper.h"
+#include "server_whisper.h"
 #include "speech_to_text.h"
+#include "vad_whisper.h"
 
+#include <godot_cpp/classes/engine.hpp>
 #include <godot_cpp/classes/project_settings.hpp>
 #include <godot_cpp/classes/resource_loader.hpp>
 #include <godot_cpp/variant/utility_functions.hpp>
 
 static Ref<ResourceFormatLoaderWhisper> whisper_loader;
+static WhisperServer *whisper_server = nullptr;
 
 void register_setting(
 		const String &p_name,
@@ -54,19 +60,39 @@ void initialize_whisper_module(ModuleInitializationLevel p_level) {
 	}
 	GDREGISTER_CLASS(SpeechToText);
 	GDREGISTER_CLASS(WhisperResource);
+	GDREGISTER_CLASS(WhisperResult);
+	GDREGISTER_CLASS(WhisperResampler);
+	GDREGISTER_CLASS(WhisperVAD);
+	GDREGISTER_CLASS(WhisperServer);
 	GDREGISTER_CLASS(ResourceFormatLoaderWhisper);
 	whisper_log_set(whisper_callback, nullptr);
 
 	whisper_loader.instantiate();
 	ResourceLoader::get_singleton()->add_resource_format_loader(whisper_loader);
 
+	whisper_server = memnew(WhisperServer);
+	Engine::get_singleton()->register_singleton("WhisperServer", whisper_server);
+
 	// register settings
 	register_setting("audio/input/transcribe/entropy_treshold", 2.8, PROPERTY_HINT_NONE, {});
 	register_setting("audio/input/transcribe/freq_treshold", 200.0, PROPERTY_HINT_NONE, {});
 	register_setting("audio/input/transcribe/max_tokens", 16, PROPERTY_HINT_NONE, {});
 	register_setting("audio/input/transcribe/vad_treshold", 2.0, PROPERTY_HINT_NONE, {});
+	register_setting("audio/input/transcribe/vad_backend", 0, PROPERTY_HINT_ENUM, "Energy,Neural");
+	register_setting("audio/input/transcribe/vad_model", "", PROPERTY_HINT_FILE, "*.bin");
+	register_setting("audio/input/transcribe/vad_speech_threshold", 0.5, PROPERTY_HINT_RANGE, "0,1,0.01");
 	register_setting("audio/input/transcribe/use_gpu", true, PROPERTY_HINT_NONE, {});
+	register_setting("audio/input/transcribe/use_mmap", true, PROPERTY_HINT_NONE, {});
 	register_setting("audio/input/transcribe/speed_up_2x", false, PROPERTY_HINT_NONE, {});
+	register_setting("audio/input/transcribe/use_thread_pool", true, PROPERTY_HINT_NONE, {});
+	register_setting("audio/input/transcribe/thread_pool_spin_us", 200, PROPERTY_HINT_RANGE, "0,10000,1,suffix:us");
+	register_setting("audio/input/transcribe/n_threads", 0, PROPERTY_HINT_RANGE, "0,256,1");
+	register_setting("audio/input/transcribe/thread_affinity_mask", 0, PROPERTY_HINT_NONE, {});
+	register_setting("audio/input/transcribe/background_priority", false, PROPERTY_HINT_NONE, {});
+	register_setting("audio/input/transcribe/core_budget", 0, PROPERTY_HINT_RANGE, "0,256,1");
+	register_setting("audio/input/transcribe/encoder_cache_mb", 0, PROPERTY_HINT_RANGE, "0,4096,1,suffix:MB");
+	register_setting("audio/input/transcribe/kv_cache_type", 0, PROPERTY_HINT_ENUM, "F16,Q8_0,Q4_0");
+	register_setting("audio/input/transcribe/best_of", 5, PROPERTY_HINT_RANGE, "1,8,1");
 }
 
 void uninitialize_whisper_module(ModuleInitializationLevel p_level) {
@@ -76,6 +102,10 @@ void uninitialize_whisper_module(ModuleInitializationLevel p_level) {
 
 	ResourceLoader::get_singleton()->remove_resource_format_loader(whisper_loader);
 	whisper_loader.unref();
+	Engine::get_singleton()->unregister_singleton("WhisperServer");
+	memdelete(whisper_server);
+	whisper_server = nullptr;
+	ggml_threadpool_shutdown();
 }
 
 extern "C" {
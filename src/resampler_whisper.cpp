@@ -0,0 +1,313 @@
+#include "resampler_whisper.h"
+
+#include <godot_cpp/classes/audio_server.hpp>
+#include <godot_cpp/core/error_macros.hpp>
+#include <godot_cpp/core/math.hpp>
+
+#include <whisper.cpp/whisper.h>
+
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define WHISPER_DECIMATOR_SSE
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define WHISPER_DECIMATOR_NEON
+#endif
+
+namespace {
+
+// Upper edge of the passband, the stopband starts a little above the 8 kHz Nyquist rate of the output.
+const double DECIMATOR_CUTOFF = 7600.0;
+// Kaiser window shape, about 70 dB of stopband attenuation.
+const double DECIMATOR_BETA = 7.0;
+
+// Zeroth order modified Bessel function of the first kind, for the Kaiser window.
+double _bessel_i0(double p_x) {
+	double sum = 1.0;
+	double term = 1.0;
+	for (int k = 1; k < 32; k++) {
+		term *= (p_x / (2.0 * k)) * (p_x / (2.0 * k));
+		sum += term;
+		if (term < sum * 1e-12) {
+			break;
+		}
+	}
+	return sum;
+}
+
+float _dot(const float *p_a, const float *p_b, int p_size) {
+	int i = 0;
+	float sum = 0.0f;
+#if defined(WHISPER_DECIMATOR_SSE)
+	__m128 sum0 = _mm_setzero_ps();
+	__m128 sum1 = _mm_setzero_ps();
+	for (; i + 8 <= p_size; i += 8) {
+		sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(p_a + i), _mm_loadu_ps(p_b + i)));
+		sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(p_a + i + 4), _mm_loadu_ps(p_b + i + 4)));
+	}
+	sum0 = _mm_add_ps(sum0, sum1);
+	float lanes[4];
+	_mm_storeu_ps(lanes, sum0);
+	sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#elif defined(WHISPER_DECIMATOR_NEON)
+	float32x4_t sum0 = vdupq_n_f32(0.0f);
+	float32x4_t sum1 = vdupq_n_f32(0.0f);
+	for (; i + 8 <= p_size; i += 8) {
+		sum0 = vmlaq_f32(sum0, vld1q_f32(p_a + i), vld1q_f32(p_b + i));
+		sum1 = vmlaq_f32(sum1, vld1q_f32(p_a + i + 4), vld1q_f32(p_b + i + 4));
+	}
+	sum0 = vaddq_f32(sum0, sum1);
+	float lanes[4];
+	vst1q_f32(lanes, sum0);
+	sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#endif
+	for (; i < p_size; i++) {
+		sum += p_a[i] * p_b[i];
+	}
+	return sum;
+}
+
+} // namespace
+
+bool WhisperPolyphaseDecimator::setup(int p_source_rate) {
+	if (p_source_rate == 48000) {
+		up = 1;
+		down = 3;
+	} else if (p_source_rate == 44100) {
+		up = 160;
+		down = 441;
+	} else {
+		return false;
+	}
+	// Kaiser windowed sinc low pass at the upsampled rate, split into up phases of TAPS taps.
+	// The last tap is left at zero so the center of the filter falls on a sample and the output is not shifted.
+	const int length = up * TAPS;
+	const int center = (length - 2) / 2;
+	const double cutoff = DECIMATOR_CUTOFF / (double(up) * p_source_rate);
+	const double window_scale = 1.0 / _bessel_i0(DECIMATOR_BETA);
+	std::vector<double> prototype(length, 0.0);
+	for (int j = 0; j < length - 1; j++) {
+		const double t = j - center;
+		const double x = 2.0 * cutoff * t;
+		const double sinc = j == center ? 1.0 : sin(Math_PI * x) / (Math_PI * x);
+		const double w = t / center;
+		prototype[j] = sinc * _bessel_i0(DECIMATOR_BETA * sqrt(MAX(0.0, 1.0 - w * w))) * window_scale;
+	}
+	taps.resize(length);
+	for (int p = 0; p < up; p++) {
+		// Each phase gets unity gain at DC, so a constant input stays constant whatever the phase.
+		double sum = 0.0;
+		for (int m = 0; m < TAPS; m++) {
+			sum += prototype[p + m * up];
+		}
+		for (int k = 0; k < TAPS; k++) {
+			taps[p * TAPS + k] = float(prototype[p + (TAPS - 1 - k) * up] / sum);
+		}
+	}
+	delay = center;
+	reset();
+	return true;
+}
+
+void WhisperPolyphaseDecimator::reset() {
+	// The stream starts with silence, the first output is centered on the first input sample.
+	history.assign(TAPS - 1, 0.0f);
+	position = TAPS - 1 + delay / up;
+	phase = delay % up;
+	n_input = 0;
+	n_output = 0;
+}
+
+int WhisperPolyphaseDecimator::_run(std::vector<float> &r_output, int p_written, uint64_t p_max_output) {
+	const int64_t available = int64_t(history.size()) - position;
+	if (available > 0) {
+		r_output.resize(MAX(r_output.size(), size_t(p_written + (available * up) / down + 2)));
+	}
+	float *output = r_output.data();
+	const float *input = history.data();
+	while (position < int64_t(history.size()) && n_output < p_max_output) {
+		output[p_written++] = _dot(taps.data() + phase * TAPS, input + position - (TAPS - 1), TAPS);
+		n_output++;
+		phase += down;
+		position += phase / up;
+		phase %= up;
+	}
+	// Only keep the samples the next outputs still need.
+	const int64_t consumed = MIN(position - (TAPS - 1), int64_t(history.size()));
+	if (consumed > 0) {
+		history.erase(history.begin(), history.begin() + consumed);
+		position -= consumed;
+	}
+	return p_written;
+}
+
+int WhisperPolyphaseDecimator::process(const Vector2 *p_frames, int p_count, bool p_end_of_input, std::vector<float> &r_output) {
+	const size_t offset = history.size();
+	history.resize(offset + p_count);
+	float *mono = history.data() + offset;
+	for (int i = 0; i < p_count; i++) {
+		mono[i] = (p_frames[i].x + p_frames[i].y) * 0.5f;
+	}
+	n_input += p_count;
+	if (!p_end_of_input) {
+		return _run(r_output, 0, UINT64_MAX);
+	}
+	// Pad with silence until the outputs up to the end of the input are computed, and not further.
+	const uint64_t n_total = (n_input * up + down - 1) / down;
+	history.resize(history.size() + delay / up + 1, 0.0f);
+	const int n_written = _run(r_output, 0, n_total);
+	reset();
+	return n_written;
+}
+
+WhisperResampler::~WhisperResampler() {
+	if (state) {
+		src_delete(state);
+		state = nullptr;
+	}
+}
+
+void WhisperResampler::set_interpolator(int p_interpolator) {
+	interpolator = p_interpolator;
+	dirty = true;
+}
+
+void WhisperResampler::set_source_rate(double p_rate) {
+	source_rate = p_rate;
+	dirty = true;
+}
+
+bool WhisperResampler::_update_state() {
+	if (!dirty) {
+		return true;
+	}
+	if (state) {
+		src_delete(state);
+		state = nullptr;
+	}
+	const double rate = source_rate > 0.0 ? source_rate : double(AudioServer::get_singleton()->get_mix_rate());
+	ratio = double(WHISPER_SAMPLE_RATE) / rate;
+	use_decimator = false;
+	int converter = interpolator;
+	if (interpolator == POLYPHASE_DECIMATOR) {
+		if (rate == double(int(rate)) && decimator.setup(int(rate))) {
+			use_decimator = true;
+		} else {
+			WARN_PRINT("The polyphase decimator only converts 48000 Hz and 44100 Hz, using Sinc Fastest.");
+			converter = SRC_SINC_FASTEST;
+		}
+	}
+	if (ratio != 1.0 && !use_decimator) {
+		int error = 0;
+		state = src_new(converter, 1, &error);
+		if (!state) {
+			ERR_PRINT(String(src_strerror(error)));
+			return false;
+		}
+	}
+	dirty = false;
+	return true;
+}
+
+void WhisperResampler::reset() {
+	if (state) {
+		src_reset(state);
+	}
+	if (use_decimator) {
+		decimator.reset();
+	}
+}
+
+int WhisperResampler::process(const Vector2 *p_frames, int p_count, bool p_end_of_input, const float **r_samples) {
+	*r_samples = output.data();
+	if (!_update_state()) {
+		return 0;
+	}
+	if (use_decimator) {
+		const int n_output = decimator.process(p_frames, p_count, p_end_of_input, output);
+		*r_samples = output.data();
+		return n_output;
+	}
+	mono.resize(p_count);
+	for (int i = 0; i < p_count; i++) {
+		mono[i] = (p_frames[i].x + p_frames[i].y) / 2.0;
+	}
+	if (!state) {
+		output.swap(mono);
+		*r_samples = output.data();
+		return p_count;
+	}
+	// The converter may hold back a few samples of its filter delay, which the next call or the flush returns.
+	output.resize(MAX(output.size(), size_t(p_count * ratio) + 64));
+	SRC_DATA src_data;
+	src_data.data_in = mono.data();
+	src_data.input_frames = p_count;
+	src_data.src_ratio = ratio;
+	src_data.end_of_input = p_end_of_input ? 1 : 0;
+	int n_output = 0;
+	while (true) {
+		src_data.data_out = output.data() + n_output;
+		src_data.output_frames = output.size() - n_output;
+		int error = src_process(state, &src_data);
+		if (error != 0) {
+			ERR_PRINT(String(src_strerror(error)));
+			break;
+		}
+		n_output += src_data.output_frames_gen;
+		src_data.data_in += src_data.input_frames_used;
+		src_data.input_frames -= src_data.input_frames_used;
+		if (src_data.input_frames_used == 0 && src_data.output_frames_gen == 0) {
+			break;
+		}
+		if (src_data.input_frames == 0 && !p_end_of_input) {
+			break;
+		}
+		if (n_output == int(output.size())) {
+			output.resize(output.size() * 2);
+		}
+	}
+	if (p_end_of_input) {
+		// The next call starts a new stream.
+		src_reset(state);
+	}
+	*r_samples = output.data();
+	return n_output;
+}
+
+PackedFloat32Array WhisperResampler::push(PackedVector2Array frames) {
+	const float *samples = nullptr;
+	const int n_samples = process(frames.ptr(), frames.size(), false, &samples);
+	PackedFloat32Array result;
+	result.resize(n_samples);
+	if (n_samples > 0) {
+		std::memcpy(result.ptrw(), samples, n_samples * sizeof(float));
+	}
+	return result;
+}
+
+PackedFloat32Array WhisperResampler::flush() {
+	const float *samples = nullptr;
+	const int n_samples = process(nullptr, 0, true, &samples);
+	PackedFloat32Array result;
+	result.resize(n_samples);
+	if (n_samples > 0) {
+		std::memcpy(result.ptrw(), samples, n_samples * sizeof(float));
+	}
+	return result;
+}
+
+void WhisperResampler::_bind_methods() {
+	ClassDB::bind_method(D_METHOD("push", "frames"), &WhisperResampler::push);
+	ClassDB::bind_method(D_METHOD("flush"), &WhisperResampler::flush);
+	ClassDB::bind_method(D_METHOD("reset"), &WhisperResampler::reset);
+	ClassDB::bind_method(D_METHOD("set_interpolator", "interpolator"), &WhisperResampler::set_interpolator);
+	ClassDB::bind_method(D_METHOD("get_interpolator"), &WhisperResampler::get_interpolator);
+	ClassDB::bind_method(D_METHOD("set_source_rate", "rate"), &WhisperResampler::set_source_rate);
+	ClassDB::bind_method(D_METHOD("get_source_rate"), &WhisperResampler::get_source_rate);
+
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "interpolator", PROPERTY_HINT_ENUM, "Sinc Best Quality,Sinc Medium Quality,Sinc Fastest,Zero Order Hold,Linear,Polyphase Decimator"), "set_interpolator", "get_interpolator");
+	ADD_PROPERTY(PropertyInfo(Variant::FLOAT, "source_rate", PROPERTY_HINT_NONE, "suffix:Hz"), "set_source_rate", "get_source_rate");
+}
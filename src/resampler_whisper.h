@@ -0,0 +1,93 @@
+#ifndef WHISPER_RESAMPLER_H
+#define WHISPER_RESAMPLER_H
+
+#include <godot_cpp/classes/ref_counted.hpp>
+#include <godot_cpp/variant/packed_float32_array.hpp>
+#include <godot_cpp/variant/packed_vector2_array.hpp>
+
+#include <libsamplerate/src/samplerate.h>
+
+#include <cstdint>
+#include <vector>
+
+using namespace godot;
+
+// Polyphase FIR resampler for the two mix rates Godot runs at, 48 kHz (3:1) and 44.1 kHz (441:160) to 16 kHz.
+// The taps are computed once in setup(), every output sample is a single dot product of one phase with the
+// input history. Stereo frames are averaged to mono while they are appended to the history.
+class WhisperPolyphaseDecimator {
+	// Taps per phase.
+	static const int TAPS = 96;
+
+	int up = 1;
+	int down = 1;
+	// Offset of the first output in the upsampled signal, the group delay of the filter.
+	int delay = 0;
+	// up phases of TAPS taps, each stored in the order of the input samples it multiplies.
+	std::vector<float> taps;
+	// Mono input, the last TAPS - 1 samples before position followed by the samples not used yet.
+	std::vector<float> history;
+	// Index in history of the newest input sample of the next output, and the phase of that output.
+	int64_t position = 0;
+	int phase = 0;
+	uint64_t n_input = 0;
+	uint64_t n_output = 0;
+
+	int _run(std::vector<float> &r_output, int p_written, uint64_t p_max_output);
+
+public:
+	// Returns false when the rate is not one of the supported ones.
+	bool setup(int p_source_rate);
+	void reset();
+	// Resamples the next frames into r_output, returns the number of samples written.
+	// With p_end_of_input the remaining input is flushed and the next call starts a new stream.
+	int process(const Vector2 *p_frames, int p_count, bool p_end_of_input, std::vector<float> &r_output);
+};
+
+// Converts captured stereo frames to the 16 kHz mono PCM whisper expects.
+// The libsamplerate converter keeps its filter state between calls, so a stream is resampled chunk by chunk
+// without edge artifacts and every call only costs the frames it is given. The scratch buffers are reused.
+class WhisperResampler : public RefCounted {
+	GDCLASS(WhisperResampler, RefCounted);
+
+	SRC_STATE *state = nullptr;
+	WhisperPolyphaseDecimator decimator;
+	bool use_decimator = false;
+	// Converter type, one of SpeechToText.InterpolatorType.
+	int interpolator = SRC_SINC_FASTEST;
+	// Rate of the input frames, 0 uses the mix rate of the AudioServer.
+	double source_rate = 0.0;
+	double ratio = 1.0;
+	bool dirty = true;
+	std::vector<float> mono;
+	std::vector<float> output;
+
+	bool _update_state();
+
+protected:
+	static void _bind_methods();
+
+public:
+	// Converter types on top of the libsamplerate ones.
+	enum {
+		POLYPHASE_DECIMATOR = SRC_LINEAR + 1,
+	};
+
+	// Resamples the next frames of the stream. With p_end_of_input the converter is flushed, so the output
+	// also contains the samples it was holding back. The returned samples stay valid until the next call.
+	int process(const Vector2 *p_frames, int p_count, bool p_end_of_input, const float **r_samples);
+
+	PackedFloat32Array push(PackedVector2Array frames);
+	PackedFloat32Array flush();
+	void reset();
+
+	void set_interpolator(int p_interpolator);
+	int get_interpolator() const { return interpolator; }
+	void set_source_rate(double p_rate);
+	double get_source_rate() const { return source_rate; }
+
+	WhisperResampler() {}
+	~WhisperResampler();
+};
+
+#endif // WHISPER_RESAMPLER_H
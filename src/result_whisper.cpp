@@ -0,0 +1,68 @@
+#include "result_whisper.h"
+
+void WhisperResult::set_from_context(whisper_context *p_context, whisper_state *p_state) {
+	const int n_segments = whisper_full_n_segments_from_state(p_state);
+	int n_tokens = 0;
+	for (int i = 0; i < n_segments; ++i) {
+		n_tokens += whisper_full_n_tokens_from_state(p_state, i);
+	}
+	// Same sized resizes keep the buffers, so a reused result does not allocate for the numeric arrays.
+	token_ids.resize(n_tokens);
+	token_p.resize(n_tokens);
+	token_plog.resize(n_tokens);
+	token_t0.resize(n_tokens);
+	token_t1.resize(n_tokens);
+	token_texts.resize(n_tokens);
+	int32_t *ids = token_ids.ptrw();
+	float *p = token_p.ptrw();
+	float *plog = token_plog.ptrw();
+	int64_t *t0 = token_t0.ptrw();
+	int64_t *t1 = token_t1.ptrw();
+	String *texts = token_texts.ptrw();
+
+	text = String();
+	int k = 0;
+	for (int i = 0; i < n_segments; ++i) {
+		text += String::utf8(whisper_full_get_segment_text_from_state(p_state, i));
+		const int n_segment_tokens = whisper_full_n_tokens_from_state(p_state, i);
+		for (int j = 0; j < n_segment_tokens; ++j, ++k) {
+			const whisper_token_data token = whisper_full_get_token_data_from_state(p_state, i, j);
+			ids[k] = token.id;
+			p[k] = token.p;
+			plog[k] = token.plog;
+			t0[k] = token.t0;
+			t1[k] = token.t1;
+			texts[k] = String::utf8(whisper_full_get_token_text_from_state(p_context, p_state, i, j));
+		}
+	}
+}
+
+void WhisperResult::clear() {
+	text = String();
+	token_ids.clear();
+	token_p.clear();
+	token_plog.clear();
+	token_t0.clear();
+	token_t1.clear();
+	token_texts.clear();
+}
+
+void WhisperResult::_bind_methods() {
+	ClassDB::bind_method(D_METHOD("clear"), &WhisperResult::clear);
+	ClassDB::bind_method(D_METHOD("get_text"), &WhisperResult::get_text);
+	ClassDB::bind_method(D_METHOD("get_token_ids"), &WhisperResult::get_token_ids);
+	ClassDB::bind_method(D_METHOD("get_token_p"), &WhisperResult::get_token_p);
+	ClassDB::bind_method(D_METHOD("get_token_plog"), &WhisperResult::get_token_plog);
+	ClassDB::bind_method(D_METHOD("get_token_t0"), &WhisperResult::get_token_t0);
+	ClassDB::bind_method(D_METHOD("get_token_t1"), &WhisperResult::get_token_t1);
+	ClassDB::bind_method(D_METHOD("get_token_texts"), &WhisperResult::get_token_texts);
+	ClassDB::bind_method(D_METHOD("get_token_count"), &WhisperResult::get_token_count);
+
+	ADD_PROPERTY(PropertyInfo(Variant::STRING, "text"), "", "get_text");
+	ADD_PROPERTY(PropertyInfo(Variant::PACKED_INT32_ARRAY, "token_ids"), "", "get_token_ids");
+	ADD_PROPERTY(PropertyInfo(Variant::PACKED_FLOAT32_ARRAY, "token_p"), "", "get_token_p");
+	ADD_PROPERTY(PropertyInfo(Variant::PACKED_FLOAT32_ARRAY, "token_plog"), "", "get_token_plog");
+	ADD_PROPERTY(PropertyInfo(Variant::PACKED_INT64_ARRAY, "token_t0"), "", "get_token_t0");
+	ADD_PROPERTY(PropertyInfo(Variant::PACKED_INT64_ARRAY, "token_t1"), "", "get_token_t1");
+	ADD_PROPERTY(PropertyInfo(Variant::PACKED_STRING_ARRAY, "token_texts"), "", "get_token_texts");
+}
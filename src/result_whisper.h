@@ -0,0 +1,45 @@
+#ifndef WHISPER_RESULT_H
+#define WHISPER_RESULT_H
+
+#include <godot_cpp/classes/ref_counted.hpp>
+#include <godot_cpp/variant/packed_float32_array.hpp>
+#include <godot_cpp/variant/packed_int32_array.hpp>
+#include <godot_cpp/variant/packed_int64_array.hpp>
+#include <godot_cpp/variant/packed_string_array.hpp>
+
+#include <whisper.cpp/whisper.h>
+
+using namespace godot;
+
+// Tokens of one transcription as parallel packed arrays, index i of every array is token i.
+// The object can be passed to SpeechToText::transcribe_to_result() again, the arrays are refilled in place.
+class WhisperResult : public RefCounted {
+	GDCLASS(WhisperResult, RefCounted);
+
+protected:
+	static void _bind_methods();
+	String text;
+	PackedInt32Array token_ids;
+	PackedFloat32Array token_p;
+	PackedFloat32Array token_plog;
+	PackedInt64Array token_t0;
+	PackedInt64Array token_t1;
+	PackedStringArray token_texts;
+
+public:
+	void set_from_context(whisper_context *p_context, whisper_state *p_state);
+	void clear();
+
+	String get_text() const { return text; }
+	PackedInt32Array get_token_ids() const { return token_ids; }
+	PackedFloat32Array get_token_p() const { return token_p; }
+	PackedFloat32Array get_token_plog() const { return token_plog; }
+	PackedInt64Array get_token_t0() const { return token_t0; }
+	PackedInt64Array get_token_t1() const { return token_t1; }
+	PackedStringArray get_token_texts() const { return token_texts; }
+	int get_token_count() const { return token_ids.size(); }
+
+	WhisperResult() {}
+	~WhisperResult() {}
+};
+#endif // WHISPER_RESULT_H
@@ -0,0 +1,121 @@
+#include "server_whisper.h"
+
+#include <godot_cpp/classes/os.hpp>
+#include <godot_cpp/classes/project_settings.hpp>
+#include <godot_cpp/classes/time.hpp>
+#include <godot_cpp/core/math.hpp>
+
+WhisperServer *WhisperServer::singleton = nullptr;
+
+WhisperServer::WhisperServer() {
+	singleton = this;
+}
+
+WhisperServer::~WhisperServer() {
+	if (singleton == this) {
+		singleton = nullptr;
+	}
+}
+
+int WhisperServer::_get_core_budget() {
+	const int budget = ProjectSettings::get_singleton()->get("audio/input/transcribe/core_budget");
+	if (budget > 0) {
+		return budget;
+	}
+	return MAX(1, OS::get_singleton()->get_processor_count());
+}
+
+int WhisperServer::_next_request() const {
+	int best = -1;
+	for (int i = 0; i < int(queue.size()); i++) {
+		if (best == -1 || queue[i].priority > queue[best].priority ||
+				(queue[i].priority == queue[best].priority && queue[i].deadline_usec < queue[best].deadline_usec)) {
+			best = i;
+		}
+	}
+	return best;
+}
+
+int WhisperServer::acquire(Priority p_priority, uint64_t p_deadline_usec, int p_n_threads) {
+	// The priority indexes the stats, a request always has to be served so an invalid one runs as normal.
+	if (p_priority < PRIORITY_BACKGROUND || p_priority > PRIORITY_INTERACTIVE) {
+		ERR_PRINT("Invalid WhisperServer priority " + String::num_int64(p_priority) + ", using normal");
+		p_priority = PRIORITY_NORMAL;
+	}
+	const uint64_t start_usec = Time::get_singleton()->get_ticks_usec();
+	std::unique_lock<std::mutex> lock(mutex);
+	Request request;
+	request.id = next_id++;
+	request.priority = p_priority;
+	request.deadline_usec = p_deadline_usec;
+	// A request never waits for more threads than the whole budget.
+	request.n_threads = CLAMP(p_n_threads, 1, _get_core_budget());
+	queue.push_back(request);
+	// Only the first request in line may start, so a large request is not overtaken forever by smaller ones.
+	// With nothing running it always starts, even if the budget was lowered in the meantime.
+	condition.wait(lock, [&]() {
+		const int next = _next_request();
+		return queue[next].id == request.id && (used_threads == 0 || used_threads + request.n_threads <= _get_core_budget());
+	});
+	queue.erase(queue.begin() + _next_request());
+	used_threads += request.n_threads;
+	running_jobs++;
+	started_jobs[p_priority]++;
+	wait_usec[p_priority] += Time::get_singleton()->get_ticks_usec() - start_usec;
+	// The next request may fit in what is left.
+	condition.notify_all();
+	return request.n_threads;
+}
+
+void WhisperServer::release(int p_n_threads) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		used_threads -= p_n_threads;
+		running_jobs--;
+	}
+	condition.notify_all();
+}
+
+int WhisperServer::get_core_budget() {
+	return _get_core_budget();
+}
+
+int WhisperServer::get_used_threads() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return used_threads;
+}
+
+int WhisperServer::get_running_jobs() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return running_jobs;
+}
+
+int WhisperServer::get_queued_jobs() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return queue.size();
+}
+
+Dictionary WhisperServer::get_stats() {
+	static const char *names[] = { "background", "normal", "interactive" };
+	std::lock_guard<std::mutex> lock(mutex);
+	Dictionary stats;
+	for (int i = PRIORITY_BACKGROUND; i <= PRIORITY_INTERACTIVE; i++) {
+		Dictionary priority;
+		priority["jobs"] = int64_t(started_jobs[i]);
+		priority["mean_wait_ms"] = started_jobs[i] > 0 ? double(wait_usec[i]) / started_jobs[i] / 1000.0 : 0.0;
+		stats[names[i]] = priority;
+	}
+	return stats;
+}
+
+void WhisperServer::_bind_methods() {
+	ClassDB::bind_method(D_METHOD("get_core_budget"), &WhisperServer::get_core_budget);
+	ClassDB::bind_method(D_METHOD("get_used_threads"), &WhisperServer::get_used_threads);
+	ClassDB::bind_method(D_METHOD("get_running_jobs"), &WhisperServer::get_running_jobs);
+	ClassDB::bind_method(D_METHOD("get_queued_jobs"), &WhisperServer::get_queued_jobs);
+	ClassDB::bind_method(D_METHOD("get_stats"), &WhisperServer::get_stats);
+
+	BIND_ENUM_CONSTANT(PRIORITY_BACKGROUND);
+	BIND_ENUM_CONSTANT(PRIORITY_NORMAL);
+	BIND_ENUM_CONSTANT(PRIORITY_INTERACTIVE);
+}
@@ -0,0 +1,96 @@
+#ifndef WHISPER_SERVER_H
+#define WHISPER_SERVER_H
+
+#include <godot_cpp/classes/object.hpp>
+#include <godot_cpp/core/class_db.hpp>
+#include <godot_cpp/variant/dictionary.hpp>
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+using namespace godot;
+
+// Process-wide scheduler of the transcriptions of every SpeechToText node, exposed as the WhisperServer singleton.
+// Each whisper_full() asks for its threads first and gives them back when it is done, so all nodes together never
+// use more than audio/input/transcribe/core_budget threads. Waiting requests are served by priority, then by
+// deadline, so an interactive caption runs before queued background work. Models are shared per WhisperResource
+// by WhisperModelRegistry. Requests are not batched: each one encodes and decodes its own audio, the server only
+// decides when it runs and with how many threads.
+class WhisperServer : public Object {
+	GDCLASS(WhisperServer, Object);
+
+public:
+	enum Priority {
+		PRIORITY_BACKGROUND = 0,
+		PRIORITY_NORMAL = 1,
+		PRIORITY_INTERACTIVE = 2,
+	};
+
+private:
+	static WhisperServer *singleton;
+
+	struct Request {
+		uint64_t id = 0;
+		Priority priority = PRIORITY_NORMAL;
+		uint64_t deadline_usec = 0;
+		int n_threads = 1;
+	};
+
+	std::mutex mutex;
+	std::condition_variable condition;
+	// Waiting requests, in arrival order.
+	std::vector<Request> queue;
+	uint64_t next_id = 1;
+	int used_threads = 0;
+	int running_jobs = 0;
+	uint64_t started_jobs[PRIORITY_INTERACTIVE + 1] = {};
+	uint64_t wait_usec[PRIORITY_INTERACTIVE + 1] = {};
+
+	int _get_core_budget();
+	// Index in queue of the request to serve next.
+	int _next_request() const;
+
+protected:
+	static void _bind_methods();
+
+public:
+	static WhisperServer *get_singleton() { return singleton; }
+
+	// Blocks until the request is first in line and its threads are free, returns the number of threads granted.
+	// p_deadline_usec is the Time.get_ticks_usec() by which the caller wants the result, earlier ones go first.
+	int acquire(Priority p_priority, uint64_t p_deadline_usec, int p_n_threads);
+	// Gives back the threads of an acquire().
+	void release(int p_n_threads);
+
+	int get_core_budget();
+	int get_used_threads();
+	int get_running_jobs();
+	int get_queued_jobs();
+	// Jobs run and mean wait in the queue in milliseconds, per priority.
+	Dictionary get_stats();
+
+	WhisperServer();
+	~WhisperServer();
+};
+
+VARIANT_ENUM_CAST(WhisperServer::Priority);
+
+// Holds threads of the WhisperServer for the lifetime of the object, like MutexLock holds a mutex.
+class WhisperServerLock {
+	int n_threads = 0;
+
+public:
+	_FORCE_INLINE_ WhisperServerLock(WhisperServer::Priority p_priority, uint64_t p_deadline_usec, int p_n_threads) {
+		n_threads = WhisperServer::get_singleton() ? WhisperServer::get_singleton()->acquire(p_priority, p_deadline_usec, p_n_threads) : p_n_threads;
+	}
+	_FORCE_INLINE_ ~WhisperServerLock() {
+		if (WhisperServer::get_singleton()) {
+			WhisperServer::get_singleton()->release(n_threads);
+		}
+	}
+	_FORCE_INLINE_ int get_n_threads() const { return n_threads; }
+};
+
+#endif // WHISPER_SERVER_H
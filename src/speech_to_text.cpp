@@ -1,71 +1,32 @@
 #include "speech_to_text.h"
+#include "model_registry_whisper.h"
 #include <libsamplerate/src/samplerate.h>
 #include <atomic>
 #include <cmath>
-#include <godot_cpp/classes/audio_server.hpp>
 #include <godot_cpp/classes/project_settings.hpp>
 #include <godot_cpp/classes/time.hpp>
 #include <godot_cpp/core/error_macros.hpp>
-#include <godot_cpp/core/memory.hpp>
 #include <godot_cpp/variant/array.hpp>
 #include <godot_cpp/variant/packed_vector2_array.hpp>
 #include <godot_cpp/variant/utility_functions.hpp>
 #include <string>
 #include <vector>
 
-uint32_t _resample_audio_buffer(
-		const float *p_src, const uint32_t p_src_frame_count,
-		const uint32_t p_src_samplerate, const uint32_t p_target_samplerate,
-		float *p_dst,
-		SpeechToText::InterpolatorType interpolator_type) {
-	if (p_src_samplerate != p_target_samplerate) {
-		SRC_DATA src_data;
-
-		src_data.data_in = p_src;
-		src_data.data_out = p_dst;
-
-		src_data.input_frames = p_src_frame_count;
-		src_data.src_ratio = (double)p_target_samplerate / (double)p_src_samplerate;
-		src_data.output_frames = int(p_src_frame_count * src_data.src_ratio);
-
-		src_data.end_of_input = 0;
-		int error = src_simple(&src_data, interpolator_type, 1);
-		if (error != 0) {
-			ERR_PRINT(String(src_strerror(error)));
-			return 0;
-		}
-		return src_data.output_frames_gen;
-	} else {
-		memcpy(p_dst, p_src,
-				static_cast<size_t>(p_src_frame_count) * sizeof(float));
-		return p_src_frame_count;
-	}
-}
-
-void _vector2_array_to_float_array(const uint32_t &p_mix_frame_count,
-		const Vector2 *p_process_buffer_in,
-		float *p_process_buffer_out) {
-	for (size_t i = 0; i < p_mix_frame_count; i++) {
-		p_process_buffer_out[i] = (p_process_buffer_in[i].x + p_process_buffer_in[i].y) / 2.0;
-	}
-}
-
-void _high_pass_filter(PackedFloat32Array &data, float cutoff, float sample_rate) {
+void _high_pass_filter(float *data, int n_samples, float cutoff, float sample_rate) {
 	const float rc = 1.0f / (2.0f * Math_PI * cutoff);
 	const float dt = 1.0f / sample_rate;
 	const float alpha = dt / (rc + dt);
 
 	float y = data[0];
 
-	for (size_t i = 1; i < data.size(); i++) {
+	for (int i = 1; i < n_samples; i++) {
 		y = alpha * (y + data[i] - data[i - 1]);
 		data[i] = y;
 	}
 }
 
 /** Check if speech is ending. */
-bool _vad_simple(PackedFloat32Array &pcmf32, int sample_rate, int last_ms, float vad_thold, float freq_thold, bool verbose) {
-	const int n_samples = pcmf32.size();
+bool _vad_simple(float *pcmf32, int n_samples, int sample_rate, int last_ms, float vad_thold, float freq_thold, bool verbose) {
 	const int n_samples_last = (sample_rate * last_ms) / 1000;
 
 	if (n_samples_last >= n_samples) {
@@ -74,7 +35,7 @@ bool _vad_simple(PackedFloat32Array &pcmf32, int sample_rate, int last_ms, float
 	}
 
 	if (freq_thold > 0.0f) {
-		_high_pass_filter(pcmf32, freq_thold, sample_rate);
+		_high_pass_filter(pcmf32, n_samples, freq_thold, sample_rate);
 	}
 
 	float energy_all = 0.0f;
@@ -103,7 +64,49 @@ bool _vad_simple(PackedFloat32Array &pcmf32, int sample_rate, int last_ms, float
 	return true;
 }
 
+/** Remove bracketed annotations such as [BLANK_AUDIO] and known hallucinations. */
+String _remove_special_characters(String p_message) {
+	const char32_t special_characters[][2] = { { U'[', U']' }, { U'<', U'>' }, { U'♪', U'♪' } };
+	for (const auto &special_character : special_characters) {
+		const String start = String::chr(special_character[0]);
+		const String end = String::chr(special_character[1]);
+		int64_t begin_character = p_message.find(start);
+		while (begin_character != -1) {
+			const int64_t end_character = p_message.find(end, begin_character + 1);
+			if (end_character == -1) {
+				break;
+			}
+			p_message = p_message.substr(0, begin_character) + p_message.substr(end_character + 1);
+			begin_character = p_message.find(start);
+		}
+	}
+	const String hallucinatory_character = ". you.";
+	int64_t begin_character = p_message.find(hallucinatory_character);
+	while (begin_character != -1) {
+		p_message = p_message.substr(0, begin_character) + p_message.substr(begin_character + hallucinatory_character.length() + 1);
+		begin_character = p_message.find(hallucinatory_character);
+	}
+	return p_message;
+}
+
+bool _has_terminating_characters(const String &p_message, const String &p_characters) {
+	for (int64_t i = 0; i < p_characters.length(); i++) {
+		if (p_message.find(p_characters.substr(i, 1)) != -1) {
+			return true;
+		}
+	}
+	return false;
+}
+
 SpeechToText::SpeechToText() {
+	whisper_mutex.instantiate();
+	stream_mutex.instantiate();
+	job_mutex.instantiate();
+	job_semaphore.instantiate();
+	vad_mutex.instantiate();
+	vad.instantiate();
+	resample_mutex.instantiate();
+	resample_resampler.instantiate();
 }
 
 void SpeechToText::set_language(int p_language) {
@@ -329,53 +332,70 @@ void SpeechToText::set_language_model(Ref<WhisperResource> p_model) {
 }
 
 void SpeechToText::_load_model() {
-	whisper_free(context_instance);
-	context_instance = nullptr;
+	MutexLock lock(*whisper_mutex.ptr());
+	_free_model();
+	context_version++;
 	UtilityFunctions::print(whisper_print_system_info());
 	if (model.is_null()) {
 		return;
 	}
-	PackedByteArray data = model->get_content();
-	if (data.is_empty()) {
+	whisper_context_params context_params = whisper_context_default_params();
+	context_params.use_gpu = _is_use_gpu();
+	context_params.use_mmap = _is_use_mmap();
+	static const ggml_type kv_types[] = { GGML_TYPE_F16, GGML_TYPE_Q8_0, GGML_TYPE_Q4_0 };
+	context_params.type_kv = kv_types[CLAMP(_get_kv_cache_type(), 0, 2)];
+	context_instance = WhisperModelRegistry::acquire(model, context_params);
+	if (!context_instance) {
 		return;
 	}
-	const whisper_context_params context_params{
-		_is_use_gpu()
-	};
-	context_instance = whisper_init_from_buffer_with_params((void *)(data.ptr()), data.size(), context_params);
+	// The weights are shared with every node using the same model, the state holding the buffers and results is ours.
+	// Its caches are sized for the greedy decoders of _whisper_full instead of beam search.
+	state_best_of = CLAMP(_get_best_of(), 1, 8);
+	whisper_state_params state_params = whisper_state_default_params();
+	state_params.n_max_decoders = state_best_of;
+	state_instance = whisper_init_state_with_params(context_instance, state_params);
+	if (!state_instance) {
+		ERR_PRINT("Failed to create the whisper state");
+		_free_model();
+	}
 }
 
-SpeechToText::~SpeechToText() {
-	whisper_free(context_instance);
+void SpeechToText::_free_model() {
+	if (state_instance) {
+		whisper_free_state(state_instance);
+		state_instance = nullptr;
+	}
+	WhisperModelRegistry::release(context_instance);
 	context_instance = nullptr;
 }
 
+SpeechToText::~SpeechToText() {
+	stop_stream();
+	_stop_jobs();
+	_free_model();
+}
+
 PackedFloat32Array SpeechToText::resample(PackedVector2Array buffer, SpeechToText::InterpolatorType interpolator_type) {
-	int64_t buffer_len = buffer.size();
-	float *buffer_float = (float *)memalloc(sizeof(float) * buffer_len);
-	uint32_t expected_size = buffer_len * WHISPER_SAMPLE_RATE / AudioServer::get_singleton()->get_mix_rate();
-	float *resampled_float = (float *)memalloc(sizeof(float) * expected_size);
-	_vector2_array_to_float_array(buffer_len, buffer.ptr(), buffer_float);
-	// Speaker frame.
-	uint32_t result_size = _resample_audio_buffer(
-			buffer_float, // Pointer to source buffer
-			buffer_len, // Size of source buffer * sizeof(float)
-			AudioServer::get_singleton()->get_mix_rate(), // Source sample rate
-			WHISPER_SAMPLE_RATE, // Target sample rate
-			resampled_float,
-			interpolator_type);
-	if (result_size != expected_size) {
-		ERR_PRINT("size differ exp: " + rtos(expected_size) + " res: " + rtos(result_size));
+	MutexLock lock(*resample_mutex.ptr());
+	// The buffer is a complete clip, so the converter is flushed at its end.
+	if (resample_resampler->get_interpolator() != interpolator_type) {
+		resample_resampler->set_interpolator(interpolator_type);
 	}
+	const float *samples = nullptr;
+	const int n_samples = resample_resampler->process(buffer.ptr(), buffer.size(), true, &samples);
 	PackedFloat32Array array;
-	array.resize(result_size);
-	std::memcpy(array.ptrw(), resampled_float, result_size * sizeof(float));
-	memfree(buffer_float);
-	memfree(resampled_float);
+	array.resize(n_samples);
+	if (n_samples > 0) {
+		std::memcpy(array.ptrw(), samples, n_samples * sizeof(float));
+	}
 	return array;
 }
 
 bool SpeechToText::voice_activity_detection(PackedFloat32Array buffer) {
+	return _voice_activity_detection(buffer.ptr(), buffer.size());
+}
+
+bool SpeechToText::_voice_activity_detection(const float *p_buffer, int p_size) {
 	/* VAD parameters */
 	// The most recent 3s.
 	const int vad_window_s = 3;
@@ -388,48 +408,141 @@ bool SpeechToText::voice_activity_detection(PackedFloat32Array buffer) {
 	 * Simple VAD from the "stream" example in whisper.cpp
 	 * https://github.com/ggerganov/whisper.cpp/blob/231bebca7deaf32d268a8b207d15aa859e52dbbe/examples/stream/stream.cpp#L378
 	 */
+	if (_get_vad_backend() == WhisperVAD::BACKEND_NEURAL) {
+		MutexLock lock(*vad_mutex.ptr());
+		vad->set_backend(WhisperVAD::BACKEND_NEURAL);
+		if (vad->load_model()) {
+			if (p_size < WHISPER_VAD_WINDOW) {
+				return false;
+			}
+			// Silence when no window of the last 500ms looks like speech.
+			const int n_samples = MIN(p_size, n_samples_vad_window);
+			return !vad->push_samples(p_buffer + p_size - n_samples, n_samples);
+		}
+		// Without a usable model fall back to the energy detector below.
+	}
 	/* Need enough accumulated audio to do VAD. */
-	if ((int)buffer.size() >= n_samples_vad_window) {
-		PackedFloat32Array pcmf32_window;
-		pcmf32_window.resize(n_samples_vad_window);
-		std::memcpy(pcmf32_window.ptrw(), buffer.ptr() + buffer.size() - n_samples_vad_window, n_samples_vad_window * sizeof(float));
-		return _vad_simple(pcmf32_window, WHISPER_SAMPLE_RATE, vad_last_ms, vad_thold, freq_thold, false);
+	if (p_size >= n_samples_vad_window) {
+		std::vector<float> pcmf32_window(p_buffer + p_size - n_samples_vad_window, p_buffer + p_size);
+		return _vad_simple(pcmf32_window.data(), n_samples_vad_window, WHISPER_SAMPLE_RATE, vad_last_ms, vad_thold, freq_thold, false);
 	}
 	return false;
 }
 
-Array SpeechToText::transcribe(PackedFloat32Array buffer, String initial_prompt, int audio_ctx) {
-	Array return_value;
+PackedFloat32Array SpeechToText::get_speech_probabilities(PackedFloat32Array buffer) {
+	MutexLock lock(*vad_mutex.ptr());
+	// Each call looks at its own audio, so the detector starts from a fresh state.
+	vad->set_backend(WhisperVAD::BACKEND_NEURAL);
+	if (!vad->load_model()) {
+		return PackedFloat32Array();
+	}
+	vad->push_samples(buffer.ptr(), buffer.size());
+	return vad->get_probabilities();
+}
+
+int SpeechToText::_get_n_threads() {
+	const int n_threads = ProjectSettings::get_singleton()->get("audio/input/transcribe/n_threads");
+	if (n_threads > 0) {
+		return n_threads;
+	}
+	// Same default as whisper_full_default_params.
+	return MIN(4, OS::get_singleton()->get_processor_count());
+}
+
+void SpeechToText::_apply_thread_settings() {
+	ggml_threadpool_set_params(_is_use_thread_pool(), _get_thread_pool_spin_us());
+	ggml_threadpool_set_attr(_get_thread_affinity_mask(), _is_background_priority());
+}
+
+int SpeechToText::_whisper_full(const float *p_samples, int p_n_samples, const CharString &p_initial_prompt, int p_audio_ctx, int p_n_threads, bool p_is_job) {
+	_apply_thread_settings();
+	// The cache belongs to the shared model, so every node using it sees the same windows.
+	whisper_set_encoder_cache_size(context_instance, size_t(MAX(0, _get_encoder_cache_mb())) << 20);
 	whisper_full_params whisper_params = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+	whisper_params.greedy.best_of = state_best_of;
+	whisper_params.n_threads = p_n_threads;
 	whisper_params.language = _language_to_code(language);
-	whisper_params.audio_ctx = audio_ctx;
-	whisper_params.speed_up = _get_speed_up();
+	whisper_params.audio_ctx = p_audio_ctx;
+	// The stream passes no samples and reuses its cached mel frames, which are not time compressed.
+	whisper_params.speed_up = _get_speed_up() && p_n_samples > 0;
 	whisper_params.split_on_word = true;
 	whisper_params.token_timestamps = true;
 	whisper_params.suppress_non_speech_tokens = true;
 	whisper_params.single_segment = true;
 	whisper_params.max_tokens = _get_max_tokens();
 	whisper_params.entropy_thold = _get_entropy_threshold();
-	whisper_params.initial_prompt = initial_prompt.utf8().get_data();
+	whisper_params.initial_prompt = p_initial_prompt.get_data();
+	if (p_is_job) {
+		whisper_params.progress_callback = _job_progress_callback;
+		whisper_params.progress_callback_user_data = this;
+		whisper_params.abort_callback = _job_abort_callback;
+		whisper_params.abort_callback_user_data = this;
+	}
+	return whisper_full_with_state(context_instance, state_instance, whisper_params, p_samples, p_n_samples);
+}
 
+void SpeechToText::_job_progress_callback(whisper_context *p_ctx, whisper_state *p_state, int p_progress, void *p_user_data) {
+	SpeechToText *self = (SpeechToText *)p_user_data;
+	self->call_deferred("emit_signal", "transcription_progress", self->job_current_id.load(), p_progress);
+}
+
+bool SpeechToText::_job_abort_callback(void *p_user_data) {
+	return ((SpeechToText *)p_user_data)->job_abort;
+}
+
+Array SpeechToText::transcribe(PackedFloat32Array buffer, String initial_prompt, int audio_ctx) {
+	MutexLock lock(*whisper_mutex.ptr());
 	if (!context_instance) {
 		ERR_PRINT("Context instance is null");
 		return Array();
 	}
-	int ret = whisper_full(context_instance, whisper_params, buffer.ptr(), buffer.size());
+	// The caller is blocked on the result, so it is due now.
+	WhisperServerLock server_lock(priority, Time::get_singleton()->get_ticks_usec(), _get_n_threads());
+	int ret = _whisper_full(buffer.ptr(), buffer.size(), initial_prompt.utf8(), audio_ctx, server_lock.get_n_threads());
 	if (ret != 0) {
 		ERR_PRINT("Failed to process audio, returned " + rtos(ret));
 		return Array();
 	}
-	const int n_segments = whisper_full_n_segments(context_instance);
+	return _get_result();
+}
+
+bool SpeechToText::transcribe_to_result(PackedFloat32Array buffer, String initial_prompt, int audio_ctx, Ref<WhisperResult> result) {
+	ERR_FAIL_COND_V_MSG(result.is_null(), false, "Result is null");
+	MutexLock lock(*whisper_mutex.ptr());
+	if (!context_instance) {
+		ERR_PRINT("Context instance is null");
+		result->clear();
+		return false;
+	}
+	WhisperServerLock server_lock(priority, Time::get_singleton()->get_ticks_usec(), _get_n_threads());
+	int ret = _whisper_full(buffer.ptr(), buffer.size(), initial_prompt.utf8(), audio_ctx, server_lock.get_n_threads());
+	if (ret != 0) {
+		ERR_PRINT("Failed to process audio, returned " + rtos(ret));
+		result->clear();
+		return false;
+	}
+	result->set_from_context(context_instance, state_instance);
+	return true;
+}
+
+Array SpeechToText::_get_result() {
+	Array return_value;
+	const int n_segments = whisper_full_n_segments_from_state(state_instance);
+	int n_result_tokens = 0;
+	for (int i = 0; i < n_segments; ++i) {
+		n_result_tokens += whisper_full_n_tokens_from_state(state_instance, i);
+	}
+	// The full text goes first, sized up front instead of pushed to the front at the end.
+	return_value.resize(n_result_tokens + 1);
+	int k = 1;
 	String full_text;
 	for (int i = 0; i < n_segments; ++i) {
-		const int n_tokens = whisper_full_n_tokens(context_instance, i);
-		auto segment_text = whisper_full_get_segment_text(context_instance, i);
+		const int n_tokens = whisper_full_n_tokens_from_state(state_instance, i);
+		auto segment_text = whisper_full_get_segment_text_from_state(state_instance, i);
 		full_text += String::utf8(segment_text);
 		for (int j = 0; j < n_tokens; j++) {
-			auto token = whisper_full_get_token_data(context_instance, i, j);
-			auto text = whisper_full_get_token_text(context_instance, i, j);
+			auto token = whisper_full_get_token_data_from_state(state_instance, i, j);
+			auto text = whisper_full_get_token_text_from_state(context_instance, state_instance, i, j);
 			Dictionary dict;
 			dict["text"] = String::utf8(text);
 			dict["id"] = token.id;
@@ -441,28 +554,353 @@ Array SpeechToText::transcribe(PackedFloat32Array buffer, String initial_prompt,
 			dict["t1"] = token.t1;
 			dict["tid"] = token.tid;
 			dict["vlen"] = token.vlen;
-			return_value.push_back(dict);
+			return_value[k++] = dict;
 		}
 	}
-	return_value.push_front(full_text);
+	return_value[0] = full_text;
 
 	return return_value;
 }
 
+Dictionary SpeechToText::get_cache_stats() {
+	MutexLock lock(*whisper_mutex.ptr());
+	Dictionary stats;
+	stats["prompt_tokens_reused"] = state_instance ? whisper_n_prompt_reused_from_state(state_instance) : 0;
+	stats["prompt_tokens_computed"] = state_instance ? whisper_n_prompt_computed_from_state(state_instance) : 0;
+	stats["encoder_cache_hits"] = state_instance ? whisper_n_encoder_cache_hit_from_state(state_instance) : 0;
+	stats["encoder_cache_misses"] = state_instance ? whisper_n_encoder_cache_miss_from_state(state_instance) : 0;
+	stats["encoder_buffer_audio_ctx"] = state_instance ? whisper_n_audio_ctx_alloc_from_state(state_instance) : 0;
+	return stats;
+}
+
+int SpeechToText::transcribe_async(PackedFloat32Array buffer, String initial_prompt, int audio_ctx) {
+	MutexLock lock(*job_mutex.ptr());
+	if (!job_thread_running) {
+		job_thread_running = true;
+		job_thread.instantiate();
+		job_thread->start(Callable(this, "_job_thread_func"), _is_background_priority() ? Thread::PRIORITY_LOW : Thread::PRIORITY_NORMAL);
+	}
+	TranscribeJob job;
+	job.id = job_next_id++;
+	job.buffer = buffer;
+	job.initial_prompt = initial_prompt.utf8();
+	job.audio_ctx = audio_ctx;
+	job.deadline_usec = Time::get_singleton()->get_ticks_usec();
+	job_queue.push_back(job);
+	job_semaphore->post();
+	return job.id;
+}
+
+void SpeechToText::cancel_transcription(int job_id) {
+	MutexLock lock(*job_mutex.ptr());
+	if (job_current_id == job_id) {
+		// Makes whisper_full() return at the next graph computation.
+		job_abort = true;
+		return;
+	}
+	for (auto it = job_queue.begin(); it != job_queue.end(); ++it) {
+		if (it->id == job_id) {
+			job_queue.erase(it);
+			call_deferred("emit_signal", "transcription_completed", job_id, Array());
+			return;
+		}
+	}
+}
+
+void SpeechToText::_job_thread_func() {
+	while (true) {
+		job_semaphore->wait();
+		TranscribeJob job;
+		{
+			MutexLock lock(*job_mutex.ptr());
+			if (!job_thread_running) {
+				break;
+			}
+			if (job_queue.empty()) {
+				// The job was cancelled before it started.
+				continue;
+			}
+			job = job_queue.front();
+			job_queue.pop_front();
+			job_current_id = job.id;
+			job_abort = false;
+		}
+		Array result;
+		{
+			MutexLock lock(*whisper_mutex.ptr());
+			if (!context_instance) {
+				ERR_PRINT("Context instance is null");
+			} else {
+				WhisperServerLock server_lock(priority, job.deadline_usec, _get_n_threads());
+				int ret = _whisper_full(job.buffer.ptr(), job.buffer.size(), job.initial_prompt, job.audio_ctx, server_lock.get_n_threads(), true);
+				if (ret == 0) {
+					result = _get_result();
+				} else if (!job_abort) {
+					ERR_PRINT("Failed to process audio, returned " + rtos(ret));
+				}
+			}
+		}
+		{
+			MutexLock lock(*job_mutex.ptr());
+			job_current_id = 0;
+		}
+		call_deferred("emit_signal", "transcription_completed", job.id, result);
+	}
+}
+
+void SpeechToText::_stop_jobs() {
+	{
+		MutexLock lock(*job_mutex.ptr());
+		if (!job_thread_running) {
+			return;
+		}
+		job_thread_running = false;
+		job_queue.clear();
+		job_abort = true;
+	}
+	job_semaphore->post();
+	job_thread->wait_to_finish();
+	job_thread.unref();
+}
+
+void SpeechToText::start_stream(String initial_prompt) {
+	stop_stream();
+	stream_resampler.instantiate();
+	stream_resampler->set_interpolator(interpolator);
+	stream_prompt = initial_prompt.utf8();
+	stream_vad.instantiate();
+	{
+		MutexLock lock(*stream_mutex.ptr());
+		// Holds one whisper window of audio that the worker has not consumed yet.
+		stream_ring.resize(WHISPER_SAMPLE_RATE * WHISPER_CHUNK_SIZE);
+		stream_ring_read = 0;
+		stream_ring_write = 0;
+	}
+	stream_running = true;
+	stream_thread.instantiate();
+	// The stream thread runs the first slice of every parallel job, so it follows the pool priority.
+	stream_thread->start(Callable(this, "_stream_thread_func"), _is_background_priority() ? Thread::PRIORITY_LOW : Thread::PRIORITY_NORMAL);
+}
+
+void SpeechToText::stop_stream() {
+	stream_running = false;
+	if (stream_thread.is_valid()) {
+		stream_thread->wait_to_finish();
+		stream_thread.unref();
+	}
+	stream_resampler.unref();
+}
+
+bool SpeechToText::is_streaming() const {
+	return stream_running;
+}
+
+void SpeechToText::push_audio(PackedVector2Array frames) {
+	const int64_t frame_count = frames.size();
+	if (!stream_running || frame_count == 0) {
+		return;
+	}
+	// Only the newly captured frames are resampled, the converter keeps its filter state between calls.
+	const float *samples = nullptr;
+	const int n_samples = stream_resampler->process(frames.ptr(), frame_count, false, &samples);
+	_stream_push_samples(samples, n_samples);
+}
+
+void SpeechToText::_stream_push_samples(const float *p_samples, int p_size) {
+	MutexLock lock(*stream_mutex.ptr());
+	const uint64_t capacity = stream_ring.size();
+	for (int i = 0; i < p_size; i++) {
+		stream_ring[(stream_ring_write + i) % capacity] = p_samples[i];
+	}
+	stream_ring_write += p_size;
+	if (stream_ring_write - stream_ring_read > capacity) {
+		// The worker fell behind, drop the oldest audio.
+		stream_ring_read = stream_ring_write - capacity;
+	}
+}
+
+int SpeechToText::_stream_pop_samples(std::vector<float> &r_samples) {
+	MutexLock lock(*stream_mutex.ptr());
+	const uint64_t capacity = stream_ring.size();
+	const int n_samples = stream_ring_write - stream_ring_read;
+	r_samples.reserve(r_samples.size() + n_samples);
+	for (uint64_t i = stream_ring_read; i < stream_ring_write; i++) {
+		r_samples.push_back(stream_ring[i % capacity]);
+	}
+	stream_ring_read = stream_ring_write;
+	return n_samples;
+}
+
+void SpeechToText::_stream_thread_func() {
+	// Audio of the sentence that is currently being transcribed.
+	std::vector<float> sentence;
+	sentence.reserve(WHISPER_SAMPLE_RATE * WHISPER_CHUNK_SIZE);
+	String last_text;
+	int last_token_count = 0;
+	// Samples of the sentence whose mel frames are already cached in the whisper state, 0 after the sentence was trimmed.
+	size_t n_mel_samples = 0;
+	uint64_t mel_context_version = 0;
+	while (stream_running) {
+		const uint64_t start_time = Time::get_singleton()->get_ticks_msec();
+		// The result of this tick is wanted before the next one.
+		const uint64_t deadline_usec = Time::get_singleton()->get_ticks_usec() + uint64_t(transcribe_interval * 1000000);
+		const size_t n_old = sentence.size();
+		_stream_pop_samples(sentence);
+		// Only the new audio goes through the detector, it keeps its own history.
+		stream_vad->push_samples(sentence.data() + n_old, sentence.size() - n_old);
+		for (const WhisperVAD::Event &event : stream_vad->get_events()) {
+			call_deferred("emit_signal", event.is_speech ? "speech_started" : "speech_ended", event.time);
+		}
+		const float total_time = float(sentence.size()) / WHISPER_SAMPLE_RATE;
+		// Audio kept from a finished sentence, so the next one does not start mid word.
+		const size_t n_keep = std::min(sentence.size(), size_t(0.2 * WHISPER_SAMPLE_RATE));
+		if (sentence.empty()) {
+			// Nothing captured yet.
+		} else if (!stream_vad->is_speech()) {
+			// Silence, commit what was said so far instead of transcribing the silence again.
+			if (!last_text.is_empty()) {
+				call_deferred("emit_signal", "transcribed_msg", true, last_text);
+				last_text = String();
+				last_token_count = 0;
+				sentence.erase(sentence.begin(), sentence.end() - n_keep);
+				n_mel_samples = 0;
+			} else if (total_time > maximum_sentence_time) {
+				sentence.erase(sentence.begin(), sentence.end() - n_keep);
+				n_mel_samples = 0;
+			}
+		} else {
+			String full_text;
+			int n_tokens = 0;
+			int ret = -1;
+			bool has_context = false;
+			{
+				MutexLock lock(*whisper_mutex.ptr());
+				if (context_instance) {
+					has_context = true;
+					int audio_ctx = 0;
+					if (use_dynamic_audio_context) {
+						audio_ctx = MIN(int(total_time * 1500 / 30 + 128), whisper_n_audio_ctx(context_instance));
+					}
+					// Only the newly captured audio is converted to mel frames, the sentence prefix is reused.
+					if (n_mel_samples == 0 || mel_context_version != context_version) {
+						whisper_mel_cache_reset_with_state(state_instance);
+						n_mel_samples = 0;
+						mel_context_version = context_version;
+					}
+					WhisperServerLock server_lock(priority, deadline_usec, _get_n_threads());
+					_apply_thread_settings();
+					ret = whisper_pcm_to_mel_append_with_state(context_instance, state_instance, sentence.data() + n_mel_samples, sentence.size() - n_mel_samples, server_lock.get_n_threads());
+					n_mel_samples = sentence.size();
+					// Keeps the encoder keys and values of the sentence prefix while the chunk does not change.
+					if (whisper_set_incremental_encoder_with_state(context_instance, state_instance, incremental_encoder_chunk) != 0) {
+						WARN_PRINT("The incremental encoder is not supported by this backend, disabling it.");
+						incremental_encoder_chunk = 0;
+					}
+					if (ret == 0) {
+						ret = _whisper_full(nullptr, 0, stream_prompt, audio_ctx, server_lock.get_n_threads());
+					}
+					if (ret == 0) {
+						const int n_segments = whisper_full_n_segments_from_state(state_instance);
+						for (int i = 0; i < n_segments; ++i) {
+							full_text += String::utf8(whisper_full_get_segment_text_from_state(state_instance, i));
+							n_tokens += whisper_full_n_tokens_from_state(state_instance, i);
+						}
+					}
+				}
+			}
+			if (ret != 0) {
+				// Without a model there is nothing to report, the audio is only kept to the maximum sentence time.
+				if (has_context) {
+					ERR_PRINT("Failed to process audio, returned " + rtos(ret));
+				}
+				if (total_time > maximum_sentence_time) {
+					if (!last_text.is_empty()) {
+						call_deferred("emit_signal", "transcribed_msg", true, last_text);
+						last_text = String();
+					}
+					last_token_count = 0;
+					sentence.erase(sentence.begin(), sentence.end() - n_keep);
+					n_mel_samples = 0;
+				}
+			} else {
+				const String text = _remove_special_characters(full_text);
+				bool finish_sentence = _has_terminating_characters(text, punctuation_characters);
+				if (total_time < minimum_sentence_time || ABS(n_tokens - last_token_count) > hallucinating_count) {
+					finish_sentence = false;
+				}
+				if (total_time > maximum_sentence_time) {
+					finish_sentence = true;
+				}
+				if (finish_sentence) {
+					sentence.erase(sentence.begin(), sentence.end() - n_keep);
+					n_mel_samples = 0;
+					last_text = String();
+				} else {
+					last_text = full_text;
+				}
+				call_deferred("emit_signal", "transcribed_msg", finish_sentence, full_text);
+				last_token_count = n_tokens;
+			}
+		}
+		const int64_t time_processing = Time::get_singleton()->get_ticks_msec() - start_time;
+		const int64_t interval_sleep = int64_t(transcribe_interval * 1000) - time_processing;
+		if (interval_sleep > 0 && stream_running) {
+			OS::get_singleton()->delay_msec(interval_sleep);
+		}
+	}
+}
+
 void SpeechToText::_bind_methods() {
 	ClassDB::bind_method(D_METHOD("get_language"), &SpeechToText::get_language);
 	ClassDB::bind_method(D_METHOD("set_language", "language"), &SpeechToText::set_language);
 	ClassDB::bind_method(D_METHOD("get_language_model"), &SpeechToText::get_language_model);
 	ClassDB::bind_method(D_METHOD("set_language_model", "model"), &SpeechToText::set_language_model);
 	ClassDB::bind_method(D_METHOD("transcribe", "buffer", "initial_prompt", "audio_ctx"), &SpeechToText::transcribe);
+	ClassDB::bind_method(D_METHOD("transcribe_to_result", "buffer", "initial_prompt", "audio_ctx", "result"), &SpeechToText::transcribe_to_result);
+	ClassDB::bind_method(D_METHOD("transcribe_async", "buffer", "initial_prompt", "audio_ctx"), &SpeechToText::transcribe_async);
+	ClassDB::bind_method(D_METHOD("cancel_transcription", "job_id"), &SpeechToText::cancel_transcription);
+	ClassDB::bind_method(D_METHOD("get_cache_stats"), &SpeechToText::get_cache_stats);
+	ClassDB::bind_method(D_METHOD("_job_thread_func"), &SpeechToText::_job_thread_func);
 	ClassDB::bind_method(D_METHOD("voice_activity_detection", "buffer"), &SpeechToText::voice_activity_detection);
+	ClassDB::bind_method(D_METHOD("get_speech_probabilities", "buffer"), &SpeechToText::get_speech_probabilities);
 	ClassDB::bind_method(D_METHOD("resample", "buffer"), &SpeechToText::resample);
+	ClassDB::bind_method(D_METHOD("start_stream", "initial_prompt"), &SpeechToText::start_stream);
+	ClassDB::bind_method(D_METHOD("stop_stream"), &SpeechToText::stop_stream);
+	ClassDB::bind_method(D_METHOD("is_streaming"), &SpeechToText::is_streaming);
+	ClassDB::bind_method(D_METHOD("push_audio", "frames"), &SpeechToText::push_audio);
+	ClassDB::bind_method(D_METHOD("_stream_thread_func"), &SpeechToText::_stream_thread_func);
+
+	ClassDB::bind_method(D_METHOD("get_transcribe_interval"), &SpeechToText::get_transcribe_interval);
+	ClassDB::bind_method(D_METHOD("set_transcribe_interval", "interval"), &SpeechToText::set_transcribe_interval);
+	ClassDB::bind_method(D_METHOD("get_use_dynamic_audio_context"), &SpeechToText::get_use_dynamic_audio_context);
+	ClassDB::bind_method(D_METHOD("set_use_dynamic_audio_context", "enable"), &SpeechToText::set_use_dynamic_audio_context);
+	ClassDB::bind_method(D_METHOD("get_incremental_encoder_chunk"), &SpeechToText::get_incremental_encoder_chunk);
+	ClassDB::bind_method(D_METHOD("set_incremental_encoder_chunk", "chunk"), &SpeechToText::set_incremental_encoder_chunk);
+	ClassDB::bind_method(D_METHOD("get_minimum_sentence_time"), &SpeechToText::get_minimum_sentence_time);
+	ClassDB::bind_method(D_METHOD("set_minimum_sentence_time", "time"), &SpeechToText::set_minimum_sentence_time);
+	ClassDB::bind_method(D_METHOD("get_maximum_sentence_time"), &SpeechToText::get_maximum_sentence_time);
+	ClassDB::bind_method(D_METHOD("set_maximum_sentence_time", "time"), &SpeechToText::set_maximum_sentence_time);
+	ClassDB::bind_method(D_METHOD("get_hallucinating_count"), &SpeechToText::get_hallucinating_count);
+	ClassDB::bind_method(D_METHOD("set_hallucinating_count", "count"), &SpeechToText::set_hallucinating_count);
+	ClassDB::bind_method(D_METHOD("get_punctuation_characters"), &SpeechToText::get_punctuation_characters);
+	ClassDB::bind_method(D_METHOD("set_punctuation_characters", "characters"), &SpeechToText::set_punctuation_characters);
+	ClassDB::bind_method(D_METHOD("get_interpolator"), &SpeechToText::get_interpolator);
+	ClassDB::bind_method(D_METHOD("set_interpolator", "interpolator"), &SpeechToText::set_interpolator);
+	ClassDB::bind_method(D_METHOD("get_priority"), &SpeechToText::get_priority);
+	ClassDB::bind_method(D_METHOD("set_priority", "priority"), &SpeechToText::set_priority);
+
+	ADD_SIGNAL(MethodInfo("transcribed_msg", PropertyInfo(Variant::BOOL, "is_partial"), PropertyInfo(Variant::STRING, "new_text")));
+	ADD_SIGNAL(MethodInfo("transcription_completed", PropertyInfo(Variant::INT, "job_id"), PropertyInfo(Variant::ARRAY, "result")));
+	ADD_SIGNAL(MethodInfo("speech_started", PropertyInfo(Variant::FLOAT, "time")));
+	ADD_SIGNAL(MethodInfo("speech_ended", PropertyInfo(Variant::FLOAT, "time")));
+	ADD_SIGNAL(MethodInfo("transcription_progress", PropertyInfo(Variant::INT, "job_id"), PropertyInfo(Variant::INT, "percent")));
 
 	BIND_ENUM_CONSTANT(SRC_SINC_BEST_QUALITY);
 	BIND_ENUM_CONSTANT(SRC_SINC_MEDIUM_QUALITY);
 	BIND_ENUM_CONSTANT(SRC_SINC_FASTEST);
 	BIND_ENUM_CONSTANT(SRC_ZERO_ORDER_HOLD);
 	BIND_ENUM_CONSTANT(SRC_LINEAR);
+	BIND_ENUM_CONSTANT(POLYPHASE_DECIMATOR);
 
 	BIND_ENUM_CONSTANT(Auto);
 	BIND_ENUM_CONSTANT(English);
@@ -570,4 +1008,15 @@ void SpeechToText::_bind_methods() {
 
 	ADD_PROPERTY(PropertyInfo(Variant::INT, "language", PROPERTY_HINT_ENUM, "Auto,English,Chinese,German,Spanish,Russian,Korean,French,Japanese,Portuguese,Turkish,Polish,Catalan,Dutch,Arabic,Swedish,Italian,Indonesian,Hindi,Finnish,Vietnamese,Hebrew,Ukrainian,Greek,Malay,Czech,Romanian,Danish,Hungarian,Tamil,Norwegian,Thai,Urdu,Croatian,Bulgarian,Lithuanian,Latin,Maori,Malayalam,Welsh,Slovak,Telugu,Persian,Latvian,Bengali,Serbian,Azerbaijani,Slovenian,Kannada,Estonian,Macedonian,Breton,Basque,Icelandic,Armenian,Nepali,Mongolian,Bosnian,Kazakh,Albanian,Swahili,Galician,Marathi,Punjabi,Sinhala,Khmer,Shona,Yoruba,Somali,Afrikaans,Occitan,Georgian,Belarusian,Tajik,Sindhi,Gujarati,Amharic,Yiddish,Lao,Uzbek,Faroese,Haitian_Creole,Pashto,Turkmen,Nynorsk,Maltese,Sanskrit,Luxembourgish,Myanmar,Tibetan,Tagalog,Malagasy,Assamese,Tatar,Hawaiian,Lingala,Hausa,Bashkir,Javanese,Sundanese,Cantonese"), "set_language", "get_language");
 	ADD_PROPERTY(PropertyInfo(Variant::OBJECT, "language_model", PROPERTY_HINT_RESOURCE_TYPE, "WhisperResource"), "set_language_model", "get_language_model");
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "priority", PROPERTY_HINT_ENUM, "Background,Normal,Interactive"), "set_priority", "get_priority");
+
+	ADD_GROUP("Stream", "");
+	ADD_PROPERTY(PropertyInfo(Variant::FLOAT, "transcribe_interval"), "set_transcribe_interval", "get_transcribe_interval");
+	ADD_PROPERTY(PropertyInfo(Variant::BOOL, "use_dynamic_audio_context"), "set_use_dynamic_audio_context", "get_use_dynamic_audio_context");
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "incremental_encoder_chunk", PROPERTY_HINT_RANGE, "0,1500,1"), "set_incremental_encoder_chunk", "get_incremental_encoder_chunk");
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "minimum_sentence_time"), "set_minimum_sentence_time", "get_minimum_sentence_time");
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "maximum_sentence_time"), "set_maximum_sentence_time", "get_maximum_sentence_time");
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "hallucinating_count"), "set_hallucinating_count", "get_hallucinating_count");
+	ADD_PROPERTY(PropertyInfo(Variant::STRING, "punctuation_characters"), "set_punctuation_characters", "get_punctuation_characters");
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "interpolator", PROPERTY_HINT_ENUM, "Sinc Best Quality,Sinc Medium Quality,Sinc Fastest,Zero Order Hold,Linear,Polyphase Decimator"), "set_interpolator", "get_interpolator");
 }
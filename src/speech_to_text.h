@@ -2,10 +2,15 @@
 #define SPEECH_TO_TEXT_H
 
 #include "resource_whisper.h"
+#include "resampler_whisper.h"
+#include "result_whisper.h"
+#include "server_whisper.h"
+#include "vad_whisper.h"
 
 #include <godot_cpp/classes/mutex.hpp>
 #include <godot_cpp/classes/node.hpp>
 #include <godot_cpp/classes/os.hpp>
+#include <godot_cpp/classes/semaphore.hpp>
 #include <godot_cpp/classes/thread.hpp>
 #include <godot_cpp/core/mutex_lock.hpp>
 #include <godot_cpp/templates/vector.hpp>
@@ -17,6 +22,7 @@
 #include <godot_cpp/classes/project_settings.hpp>
 
 #include <atomic>
+#include <deque>
 #include <string>
 #include <vector>
 
@@ -128,43 +134,162 @@ public:
 		Cantonese
 	};
 
+	enum InterpolatorType {
+		SRC_SINC_BEST_QUALITY = 0,
+		SRC_SINC_MEDIUM_QUALITY = 1,
+		SRC_SINC_FASTEST = 2,
+		SRC_ZERO_ORDER_HOLD = 3,
+		SRC_LINEAR = 4,
+		POLYPHASE_DECIMATOR = 5,
+	};
+	enum SpeechSamplingRate {
+		SPEECH_SETTING_SAMPLE_RATE = WHISPER_SAMPLE_RATE
+	};
+
 private:
 	GDCLASS(SpeechToText, Node);
 	Language language = English;
 	Ref<WhisperResource> model;
+	// Shared with every node using the same model, see WhisperModelRegistry.
 	whisper_context *context_instance = nullptr;
+	// Buffers and results of this node, created for context_instance.
+	whisper_state *state_instance = nullptr;
+	// Candidates sampled by the temperature fallback, state_instance is sized for them.
+	int state_best_of = 5;
+	// Bumped every time state_instance is recreated, so cached per state data can be invalidated.
+	uint64_t context_version = 0;
+	// Serializes every use of state_instance between the caller and the worker threads.
+	Ref<Mutex> whisper_mutex;
+
+	// Converter of resample(), kept so its buffers are reused.
+	Ref<WhisperResampler> resample_resampler;
+	Ref<Mutex> resample_mutex;
+	// Detector of voice_activity_detection() and get_speech_probabilities(), reset on every call.
+	Ref<WhisperVAD> vad;
+	Ref<Mutex> vad_mutex;
+
+	// Streaming session, see start_stream().
+	Ref<Thread> stream_thread;
+	Ref<Mutex> stream_mutex;
+	std::atomic<bool> stream_running{ false };
+	// Converts the pushed frames to 16 kHz mono, keeps its filter state for the whole session.
+	Ref<WhisperResampler> stream_resampler;
+	// Fed with the new samples of every stream tick, only used by the stream thread.
+	Ref<WhisperVAD> stream_vad;
+	// Ring buffer of 16 kHz mono PCM, filled by push_audio() and drained by the worker.
+	std::vector<float> stream_ring;
+	uint64_t stream_ring_read = 0;
+	uint64_t stream_ring_write = 0;
+	CharString stream_prompt;
+
+	// Request queued by transcribe_async().
+	struct TranscribeJob {
+		int id = 0;
+		PackedFloat32Array buffer;
+		CharString initial_prompt;
+		int audio_ctx = 0;
+		// Submission time, the deadline of the job in the WhisperServer queue.
+		uint64_t deadline_usec = 0;
+	};
+	// Asynchronous transcription worker, started by the first transcribe_async() call.
+	Ref<Thread> job_thread;
+	Ref<Mutex> job_mutex;
+	Ref<Semaphore> job_semaphore;
+	std::deque<TranscribeJob> job_queue;
+	bool job_thread_running = false;
+	int job_next_id = 1;
+	// Job that is being transcribed, 0 when idle. Written under job_mutex.
+	std::atomic<int> job_current_id{ 0 };
+	std::atomic<bool> job_abort{ false };
+
+	float transcribe_interval = 0.3;
+	bool use_dynamic_audio_context = true;
+	// Encoder frames per chunk of the experimental incremental encoder, 0 encodes every window in full.
+	int incremental_encoder_chunk = 0;
+	int minimum_sentence_time = 3;
+	int maximum_sentence_time = 15;
+	int hallucinating_count = 1;
+	String punctuation_characters = String::utf8(".!?;。；？！");
+	InterpolatorType interpolator = SRC_SINC_FASTEST;
+	// Set on the main thread, read by the job and stream threads.
+	std::atomic<WhisperServer::Priority> priority{ WhisperServer::PRIORITY_NORMAL };
 
 	_FORCE_INLINE_ bool _is_use_gpu() { return ProjectSettings::get_singleton()->get("audio/input/transcribe/use_gpu"); }
 	_FORCE_INLINE_ float _get_entropy_threshold() { return ProjectSettings::get_singleton()->get("audio/input/transcribe/entropy_treshold"); }
 	_FORCE_INLINE_ float _get_freq_thold() { return ProjectSettings::get_singleton()->get("audio/input/transcribe/freq_treshold"); }
 	_FORCE_INLINE_ float _get_vad_thold() { return ProjectSettings::get_singleton()->get("audio/input/transcribe/vad_treshold"); }
+	_FORCE_INLINE_ WhisperVAD::Backend _get_vad_backend() { return WhisperVAD::Backend(int(ProjectSettings::get_singleton()->get("audio/input/transcribe/vad_backend"))); }
 	_FORCE_INLINE_ int _get_max_tokens() { return ProjectSettings::get_singleton()->get("audio/input/transcribe/max_tokens"); }
+	_FORCE_INLINE_ bool _is_use_mmap() { return ProjectSettings::get_singleton()->get("audio/input/transcribe/use_mmap"); }
 	_FORCE_INLINE_ bool _get_speed_up() { return ProjectSettings::get_singleton()->get("audio/input/transcribe/speed_up_2x"); }
+	_FORCE_INLINE_ int _get_encoder_cache_mb() { return ProjectSettings::get_singleton()->get("audio/input/transcribe/encoder_cache_mb"); }
+	_FORCE_INLINE_ int _get_kv_cache_type() { return ProjectSettings::get_singleton()->get("audio/input/transcribe/kv_cache_type"); }
+	_FORCE_INLINE_ int _get_best_of() { return ProjectSettings::get_singleton()->get("audio/input/transcribe/best_of"); }
+	_FORCE_INLINE_ bool _is_use_thread_pool() { return ProjectSettings::get_singleton()->get("audio/input/transcribe/use_thread_pool"); }
+	_FORCE_INLINE_ int _get_thread_pool_spin_us() { return ProjectSettings::get_singleton()->get("audio/input/transcribe/thread_pool_spin_us"); }
+	_FORCE_INLINE_ uint64_t _get_thread_affinity_mask() { return int64_t(ProjectSettings::get_singleton()->get("audio/input/transcribe/thread_affinity_mask")); }
+	_FORCE_INLINE_ bool _is_background_priority() { return ProjectSettings::get_singleton()->get("audio/input/transcribe/background_priority"); }
+	int _get_n_threads();
+	void _apply_thread_settings();
 	void _load_model();
-	std::vector<float> _add_audio_buffer(PackedVector2Array buffer);
+	void _free_model();
 	const char *_language_to_code(Language language);
+	int _whisper_full(const float *p_samples, int p_n_samples, const CharString &p_initial_prompt, int p_audio_ctx, int p_n_threads, bool p_is_job = false);
+	Array _get_result();
+	void _job_thread_func();
+	void _stop_jobs();
+	static void _job_progress_callback(whisper_context *p_ctx, whisper_state *p_state, int p_progress, void *p_user_data);
+	static bool _job_abort_callback(void *p_user_data);
+	bool _voice_activity_detection(const float *p_buffer, int p_size);
+	void _stream_thread_func();
+	void _stream_push_samples(const float *p_samples, int p_size);
+	int _stream_pop_samples(std::vector<float> &r_samples);
 
 protected:
 	static void _bind_methods();
 
 public:
-	enum InterpolatorType {
-		SRC_SINC_BEST_QUALITY = 0,
-		SRC_SINC_MEDIUM_QUALITY = 1,
-		SRC_SINC_FASTEST = 2,
-		SRC_ZERO_ORDER_HOLD = 3,
-		SRC_LINEAR = 4,
-	};
-	enum SpeechSamplingRate {
-		SPEECH_SETTING_SAMPLE_RATE = WHISPER_SAMPLE_RATE
-	};
 	bool voice_activity_detection(PackedFloat32Array buffer);
+	PackedFloat32Array get_speech_probabilities(PackedFloat32Array buffer);
 	PackedFloat32Array resample(PackedVector2Array buffer, SpeechToText::InterpolatorType interpolator_type);
 	Array transcribe(PackedFloat32Array buffer, String initial_prompt, int audio_ctx);
+	bool transcribe_to_result(PackedFloat32Array buffer, String initial_prompt, int audio_ctx, Ref<WhisperResult> result);
+	int transcribe_async(PackedFloat32Array buffer, String initial_prompt, int audio_ctx);
+	void cancel_transcription(int job_id);
+	// Counters of the decoding state: prompt tokens whose decoding was reused or recomputed, and windows whose
+	// encoding was found in or missing from the encoder cache.
+	Dictionary get_cache_stats();
 	void set_language(int p_language);
 	int get_language();
 	void set_language_model(Ref<WhisperResource> p_model);
 	_FORCE_INLINE_ Ref<WhisperResource> get_language_model() { return model; }
+
+	void start_stream(String initial_prompt);
+	void stop_stream();
+	bool is_streaming() const;
+	void push_audio(PackedVector2Array frames);
+
+	void set_transcribe_interval(float p_interval) { transcribe_interval = p_interval; }
+	float get_transcribe_interval() const { return transcribe_interval; }
+	void set_use_dynamic_audio_context(bool p_enable) { use_dynamic_audio_context = p_enable; }
+	bool get_use_dynamic_audio_context() const { return use_dynamic_audio_context; }
+	void set_incremental_encoder_chunk(int p_chunk) { incremental_encoder_chunk = MAX(0, p_chunk); }
+	int get_incremental_encoder_chunk() const { return incremental_encoder_chunk; }
+	void set_minimum_sentence_time(int p_time) { minimum_sentence_time = p_time; }
+	int get_minimum_sentence_time() const { return minimum_sentence_time; }
+	void set_maximum_sentence_time(int p_time) { maximum_sentence_time = p_time; }
+	int get_maximum_sentence_time() const { return maximum_sentence_time; }
+	void set_hallucinating_count(int p_count) { hallucinating_count = p_count; }
+	int get_hallucinating_count() const { return hallucinating_count; }
+	void set_punctuation_characters(const String &p_characters) { punctuation_characters = p_characters; }
+	String get_punctuation_characters() const { return punctuation_characters; }
+	void set_interpolator(InterpolatorType p_interpolator) { interpolator = p_interpolator; }
+	InterpolatorType get_interpolator() const { return interpolator; }
+	void set_priority(WhisperServer::Priority p_priority) {
+		ERR_FAIL_INDEX(p_priority, WhisperServer::PRIORITY_INTERACTIVE + 1);
+		priority = p_priority;
+	}
+	WhisperServer::Priority get_priority() const { return priority; }
 	SpeechToText();
 	~SpeechToText();
 };
@@ -0,0 +1,220 @@
+#include "vad_whisper.h"
+
+#include <godot_cpp/classes/file_access.hpp>
+#include <godot_cpp/classes/project_settings.hpp>
+#include <godot_cpp/core/error_macros.hpp>
+#include <godot_cpp/core/math.hpp>
+
+#include <cmath>
+#include <cstring>
+
+namespace {
+
+// Energy is accumulated in blocks of 10 ms.
+const int VAD_BLOCK_SAMPLES = WHISPER_SAMPLE_RATE / 100;
+// Compare the energy of the last 500ms to that of the last 3 s.
+const int VAD_WINDOW_BLOCKS = 300;
+const int VAD_LAST_BLOCKS = 50;
+const int VAD_LAST_MS = 500;
+
+} // namespace
+
+WhisperVAD::WhisperVAD() {
+	backend = Backend(int(ProjectSettings::get_singleton()->get("audio/input/transcribe/vad_backend")));
+	reset();
+}
+
+WhisperVAD::~WhisperVAD() {
+	if (vad_context) {
+		whisper_vad_free(vad_context);
+		vad_context = nullptr;
+	}
+}
+
+void WhisperVAD::set_backend(Backend p_backend) {
+	backend = p_backend;
+	reset();
+}
+
+void WhisperVAD::reset() {
+	ProjectSettings *project_settings = ProjectSettings::get_singleton();
+	vad_thold = project_settings->get("audio/input/transcribe/vad_treshold");
+	freq_thold = project_settings->get("audio/input/transcribe/freq_treshold");
+	speech_thold = project_settings->get("audio/input/transcribe/vad_speech_threshold");
+
+	// Same one pole high pass filter as the energy check of SpeechToText.voice_activity_detection().
+	if (freq_thold > 0.0f) {
+		const float rc = 1.0f / (2.0f * Math_PI * freq_thold);
+		const float dt = 1.0f / WHISPER_SAMPLE_RATE;
+		filter_alpha = dt / (rc + dt);
+	}
+	filter_x = 0.0f;
+	filter_y = 0.0f;
+	block_sum = 0.0f;
+	block_fill = 0;
+	blocks.assign(VAD_WINDOW_BLOCKS, 0.0f);
+	n_blocks = 0;
+	energy_all = 0.0;
+	energy_last = 0.0;
+
+	if (vad_context) {
+		whisper_vad_reset_state(vad_context);
+	}
+	n_windows = 0;
+	n_silent_windows = 0;
+	probabilities.clear();
+
+	speech = false;
+	n_samples = 0;
+	events.clear();
+}
+
+bool WhisperVAD::load_model() {
+	const String path = ProjectSettings::get_singleton()->get("audio/input/transcribe/vad_model");
+	if (vad_model_load_attempted && path == vad_model_path) {
+		return vad_context != nullptr;
+	}
+	if (vad_context) {
+		whisper_vad_free(vad_context);
+		vad_context = nullptr;
+	}
+	// Remember the path even if loading fails, so a broken model is reported once and not reloaded on every push.
+	vad_model_path = path;
+	vad_model_load_attempted = true;
+	if (path.is_empty()) {
+		ERR_PRINT("audio/input/transcribe/vad_model is not set, using the energy VAD");
+		return false;
+	}
+	PackedByteArray data = FileAccess::get_file_as_bytes(path);
+	if (data.is_empty()) {
+		ERR_PRINT("Failed to read the VAD model " + path);
+		return false;
+	}
+	vad_context = whisper_vad_init_from_buffer((void *)(data.ptr()), data.size());
+	if (!vad_context) {
+		ERR_PRINT("Failed to load the VAD model " + path);
+		return false;
+	}
+	return true;
+}
+
+void WhisperVAD::_set_speech(bool p_speech, uint64_t p_sample) {
+	if (speech == p_speech) {
+		return;
+	}
+	speech = p_speech;
+	Event event;
+	event.is_speech = p_speech;
+	event.time = double(p_sample) / WHISPER_SAMPLE_RATE;
+	events.push_back(event);
+}
+
+void WhisperVAD::_push_energy(const float *p_samples, int p_size) {
+	for (int i = 0; i < p_size; i++) {
+		float y = p_samples[i];
+		if (freq_thold > 0.0f) {
+			if (n_samples > 0) {
+				filter_y = filter_alpha * (filter_y + p_samples[i] - filter_x);
+				y = filter_y;
+			} else {
+				filter_y = y;
+			}
+			filter_x = p_samples[i];
+		}
+		n_samples++;
+		block_sum += fabsf(y);
+		if (++block_fill < VAD_BLOCK_SAMPLES) {
+			continue;
+		}
+
+		// Slide both windows by one block.
+		if (n_blocks >= VAD_WINDOW_BLOCKS) {
+			energy_all -= blocks[n_blocks % VAD_WINDOW_BLOCKS];
+		}
+		if (n_blocks >= VAD_LAST_BLOCKS) {
+			energy_last -= blocks[(n_blocks - VAD_LAST_BLOCKS) % VAD_WINDOW_BLOCKS];
+		}
+		blocks[n_blocks % VAD_WINDOW_BLOCKS] = block_sum;
+		energy_all += block_sum;
+		energy_last += block_sum;
+		n_blocks++;
+		block_sum = 0.0f;
+		block_fill = 0;
+
+		// Not enough samples yet, keep the current state.
+		if (n_blocks <= VAD_LAST_BLOCKS) {
+			continue;
+		}
+		const double mean_all = energy_all / (MIN(n_blocks, uint64_t(VAD_WINDOW_BLOCKS)) * VAD_BLOCK_SAMPLES);
+		const double mean_last = energy_last / (VAD_LAST_BLOCKS * VAD_BLOCK_SAMPLES);
+		const bool silence = mean_all < 0.0001 && mean_last < 0.0001 && !(mean_last > vad_thold * mean_all);
+		_set_speech(!silence, n_samples);
+	}
+}
+
+void WhisperVAD::_push_neural(const float *p_samples, int p_size) {
+	// Speech ends after 500ms of windows below the threshold.
+	const int n_silent_end = (VAD_LAST_MS * WHISPER_SAMPLE_RATE / 1000 + WHISPER_VAD_WINDOW - 1) / WHISPER_VAD_WINDOW;
+	const int n_probs = whisper_vad_push(vad_context, p_samples, p_size);
+	const float *probs = whisper_vad_probs(vad_context);
+	for (int i = 0; i < n_probs; i++) {
+		n_windows++;
+		probabilities.push_back(probs[i]);
+		if (probs[i] >= speech_thold) {
+			n_silent_windows = 0;
+			_set_speech(true, n_windows * WHISPER_VAD_WINDOW);
+		} else if (++n_silent_windows >= n_silent_end) {
+			_set_speech(false, n_windows * WHISPER_VAD_WINDOW);
+		}
+	}
+	n_samples += p_size;
+}
+
+bool WhisperVAD::push_samples(const float *p_samples, int p_size) {
+	events.clear();
+	probabilities.clear();
+	if (p_size <= 0) {
+		return speech;
+	}
+	if (backend == BACKEND_NEURAL && load_model()) {
+		_push_neural(p_samples, p_size);
+	} else {
+		_push_energy(p_samples, p_size);
+	}
+	return speech;
+}
+
+bool WhisperVAD::push(PackedFloat32Array buffer) {
+	push_samples(buffer.ptr(), buffer.size());
+	for (const Event &event : events) {
+		emit_signal(event.is_speech ? "speech_started" : "speech_ended", event.time);
+	}
+	return speech;
+}
+
+PackedFloat32Array WhisperVAD::get_probabilities() const {
+	PackedFloat32Array result;
+	result.resize(probabilities.size());
+	if (!probabilities.empty()) {
+		std::memcpy(result.ptrw(), probabilities.data(), probabilities.size() * sizeof(float));
+	}
+	return result;
+}
+
+void WhisperVAD::_bind_methods() {
+	ClassDB::bind_method(D_METHOD("push", "buffer"), &WhisperVAD::push);
+	ClassDB::bind_method(D_METHOD("reset"), &WhisperVAD::reset);
+	ClassDB::bind_method(D_METHOD("is_speech"), &WhisperVAD::is_speech);
+	ClassDB::bind_method(D_METHOD("get_time"), &WhisperVAD::get_time);
+	ClassDB::bind_method(D_METHOD("get_probabilities"), &WhisperVAD::get_probabilities);
+	ClassDB::bind_method(D_METHOD("set_backend", "backend"), &WhisperVAD::set_backend);
+	ClassDB::bind_method(D_METHOD("get_backend"), &WhisperVAD::get_backend);
+
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "backend", PROPERTY_HINT_ENUM, "Energy,Neural"), "set_backend", "get_backend");
+
+	ADD_SIGNAL(MethodInfo("speech_started", PropertyInfo(Variant::FLOAT, "time")));
+	ADD_SIGNAL(MethodInfo("speech_ended", PropertyInfo(Variant::FLOAT, "time")));
+
+	BIND_ENUM_CONSTANT(BACKEND_ENERGY);
+	BIND_ENUM_CONSTANT(BACKEND_NEURAL);
+}
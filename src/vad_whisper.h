@@ -0,0 +1,92 @@
+#ifndef WHISPER_VAD_H
+#define WHISPER_VAD_H
+
+#include <godot_cpp/classes/ref_counted.hpp>
+#include <godot_cpp/variant/packed_float32_array.hpp>
+
+#include <whisper.cpp/whisper.h>
+
+#include <cstdint>
+#include <vector>
+
+using namespace godot;
+
+// Streaming voice activity detector for 16 kHz mono PCM.
+// Only the new samples are pushed, the filter, energy sums and model state are kept between pushes,
+// so the cost of a push is proportional to the audio it adds and not to the length of the analysis window.
+class WhisperVAD : public RefCounted {
+	GDCLASS(WhisperVAD, RefCounted);
+
+public:
+	enum Backend {
+		BACKEND_ENERGY = 0,
+		BACKEND_NEURAL = 1,
+	};
+
+	struct Event {
+		bool is_speech = false;
+		// Seconds of audio pushed since the last reset() when the change was detected.
+		double time = 0.0;
+	};
+
+private:
+	Backend backend = BACKEND_ENERGY;
+	float vad_thold = 2.0f;
+	float freq_thold = 200.0f;
+	float speech_thold = 0.5f;
+
+	// Energy backend, the absolute filtered signal is summed over blocks of 10 ms.
+	// energy_all covers the last 3 s, energy_last the last 500 ms of completed blocks.
+	float filter_alpha = 0.0f;
+	float filter_x = 0.0f;
+	float filter_y = 0.0f;
+	float block_sum = 0.0f;
+	int block_fill = 0;
+	std::vector<float> blocks;
+	uint64_t n_blocks = 0;
+	double energy_all = 0.0;
+	double energy_last = 0.0;
+
+	// Neural backend.
+	whisper_vad_context *vad_context = nullptr;
+	String vad_model_path;
+	bool vad_model_load_attempted = false;
+	uint64_t n_windows = 0;
+	int n_silent_windows = 0;
+	std::vector<float> probabilities;
+
+	bool speech = false;
+	uint64_t n_samples = 0;
+	std::vector<Event> events;
+
+	void _set_speech(bool p_speech, uint64_t p_sample);
+	void _push_energy(const float *p_samples, int p_size);
+	void _push_neural(const float *p_samples, int p_size);
+
+protected:
+	static void _bind_methods();
+
+public:
+	// Feeds new samples, returns whether the end of the audio is speech.
+	// The speech start and end events detected while doing so are available from get_events().
+	bool push_samples(const float *p_samples, int p_size);
+	const std::vector<Event> &get_events() const { return events; }
+
+	// Loads audio/input/transcribe/vad_model if it changed, returns whether the neural backend can run.
+	bool load_model();
+
+	bool push(PackedFloat32Array buffer);
+	void reset();
+	bool is_speech() const { return speech; }
+	double get_time() const { return double(n_samples) / WHISPER_SAMPLE_RATE; }
+	PackedFloat32Array get_probabilities() const;
+	void set_backend(Backend p_backend);
+	Backend get_backend() const { return backend; }
+
+	WhisperVAD();
+	~WhisperVAD();
+};
+
+VARIANT_ENUM_CAST(WhisperVAD::Backend);
+
+#endif // WHISPER_VAD_H
@@ -14,6 +14,25 @@
 #include "src_config.h"
 #include "common.h"
 
+/*
+** The mono converter has SIMD versions of calc_output_single, selected at
+** runtime when the CPU supports them. Set the LIBSAMPLERATE_NO_SIMD
+** environment variable before src_new () to force the scalar code.
+*/
+#if (defined (__x86_64__) || defined (__i386__)) && (defined (__GNUC__) || defined (__clang__))
+#define SRC_SINC_AVX2	1
+#include <immintrin.h>
+#define SRC_SINC_AVX2_TARGET	__attribute__ ((target ("avx2")))
+#elif (defined (_M_X64) || defined (_M_IX86)) && defined (_MSC_VER)
+#define SRC_SINC_AVX2	1
+#include <immintrin.h>
+#include <intrin.h>
+#define SRC_SINC_AVX2_TARGET
+#elif defined (__aarch64__) || defined (_M_ARM64)
+#define SRC_SINC_NEON	1
+#include <arm_neon.h>
+#endif
+
 #define	SINC_MAGIC_MARKER	MAKE_MAGIC (' ', 's', 'i', 'n', 'c', ' ')
 
 /*========================================================================================
@@ -48,6 +67,9 @@ typedef struct
 
 	coeff_t const	*coeffs ;
 
+	/* Non zero when calc_output_single may use the SIMD code. */
+	int		simd ;
+
 	int		b_current, b_end, b_real_end, b_len ;
 
 	/* Sure hope noone does more than 128 channels at once. */
@@ -66,6 +88,9 @@ static int sinc_mono_vari_process (SRC_PRIVATE *psrc, SRC_DATA *data) ;
 static int prepare_data (SINC_FILTER *filter, SRC_DATA *data, int half_filter_chan_len) WARN_UNUSED ;
 
 static void sinc_reset (SRC_PRIVATE *psrc) ;
+#if SRC_SINC_AVX2 || SRC_SINC_NEON
+static int sinc_cpu_has_simd (void) ;
+#endif
 static int sinc_copy (SRC_PRIVATE *from, SRC_PRIVATE *to) ;
 
 static inline increment_t
@@ -161,6 +186,9 @@ sinc_set_converter (SRC_PRIVATE *psrc, int src_enum)
 	else if (psrc->channels == 1)
 	{	psrc->const_process = sinc_mono_vari_process ;
 		psrc->vari_process = sinc_mono_vari_process ;
+#if SRC_SINC_AVX2 || SRC_SINC_NEON
+		temp_filter.simd = getenv ("LIBSAMPLERATE_NO_SIMD") == NULL && sinc_cpu_has_simd () ;
+#endif
 		}
 	else
 	if (psrc->channels == 2)
@@ -333,6 +361,251 @@ calc_output_single (SINC_FILTER *filter, increment_t increment, increment_t star
 	return (left + right) ;
 } /* calc_output_single */
 
+/*
+** The SIMD versions compute the same terms as calc_output_single, in the same
+** precision, several filter taps at a time. Only the order of the additions
+** differs. The coefficients are gathered from the table, the input samples are
+** contiguous (read backwards for the right half of the filter).
+*/
+
+#if SRC_SINC_AVX2
+
+static int
+sinc_cpu_has_simd (void)
+{
+#if defined (_MSC_VER) && !defined (__clang__)
+	int info [4] ;
+
+	__cpuid (info, 0) ;
+	if (info [0] < 7)
+		return 0 ;
+
+	/* OSXSAVE and AVX, then the OS saves the YMM registers, then AVX2. */
+	__cpuid (info, 1) ;
+	if ((info [2] & (1 << 27)) == 0 || (info [2] & (1 << 28)) == 0)
+		return 0 ;
+	if ((_xgetbv (0) & 6) != 6)
+		return 0 ;
+
+	__cpuidex (info, 7, 0) ;
+	return (info [1] & (1 << 5)) != 0 ;
+#else
+	__builtin_cpu_init () ;
+	return __builtin_cpu_supports ("avx2") ;
+#endif
+} /* sinc_cpu_has_simd */
+
+/* Interpolated coefficients of 4 taps times 4 input samples, in double precision. */
+SRC_SINC_AVX2_TARGET static inline __m256d
+sinc_avx2_taps (const coeff_t *coeffs, __m128i filter_index, __m128 data)
+{	const __m128i fraction_mask = _mm_set1_epi32 ((1 << SHIFT_BITS) - 1) ;
+	__m128i indx ;
+	__m128 c0, c1 ;
+	__m256d fraction, icoeff ;
+
+	indx = _mm_srai_epi32 (filter_index, SHIFT_BITS) ;
+	c0 = _mm_i32gather_ps (coeffs, indx, 4) ;
+	c1 = _mm_i32gather_ps (coeffs + 1, indx, 4) ;
+
+	fraction = _mm256_mul_pd (_mm256_cvtepi32_pd (_mm_and_si128 (filter_index, fraction_mask)), _mm256_set1_pd (INV_FP_ONE)) ;
+	icoeff = _mm256_add_pd (_mm256_cvtps_pd (c0), _mm256_mul_pd (fraction, _mm256_cvtps_pd (_mm_sub_ps (c1, c0)))) ;
+
+	return _mm256_mul_pd (icoeff, _mm256_cvtps_pd (data)) ;
+} /* sinc_avx2_taps */
+
+SRC_SINC_AVX2_TARGET static double
+calc_output_single_simd (SINC_FILTER *filter, increment_t increment, increment_t start_filter_index)
+{	double		fraction, left, right, icoeff, sum [4] ;
+	increment_t	filter_index, max_filter_index ;
+	int			data_index, coeff_count, indx, k, n_taps ;
+	__m256d		acc0, acc1 ;
+	__m128i		step, step4, filter_index4 ;
+	__m128		data ;
+
+	max_filter_index = int_to_fp (filter->coeff_half_len) ;
+	step = _mm_setr_epi32 (0, increment, 2 * increment, 3 * increment) ;
+	step4 = _mm_set1_epi32 (4 * increment) ;
+
+	/* Left half, the input samples go forwards. */
+	filter_index = start_filter_index ;
+	coeff_count = (max_filter_index - filter_index) / increment ;
+	filter_index = filter_index + coeff_count * increment ;
+	data_index = filter->b_current - coeff_count ;
+
+	/* Taps before the start of the buffer are skipped, like in the scalar code. */
+	n_taps = filter_index / increment + 1 ;
+	if (data_index < 0)
+	{	k = MIN (-data_index, n_taps) ;
+		filter_index -= k * increment ;
+		data_index += k ;
+		n_taps -= k ;
+		} ;
+
+	acc0 = acc1 = _mm256_setzero_pd () ;
+	for (k = 0 ; k + 8 <= n_taps ; k += 8)
+	{	filter_index4 = _mm_sub_epi32 (_mm_set1_epi32 (filter_index - k * increment), step) ;
+		acc0 = _mm256_add_pd (acc0, sinc_avx2_taps (filter->coeffs, filter_index4, _mm_loadu_ps (filter->buffer + data_index + k))) ;
+		filter_index4 = _mm_sub_epi32 (filter_index4, step4) ;
+		acc1 = _mm256_add_pd (acc1, sinc_avx2_taps (filter->coeffs, filter_index4, _mm_loadu_ps (filter->buffer + data_index + k + 4))) ;
+		} ;
+
+	_mm256_storeu_pd (sum, _mm256_add_pd (acc0, acc1)) ;
+	left = (sum [0] + sum [1]) + (sum [2] + sum [3]) ;
+
+	for ( ; k < n_taps ; k++)
+	{	fraction = fp_to_double (filter_index - k * increment) ;
+		indx = fp_to_int (filter_index - k * increment) ;
+
+		icoeff = filter->coeffs [indx] + fraction * (filter->coeffs [indx + 1] - filter->coeffs [indx]) ;
+
+		left += icoeff * filter->buffer [data_index + k] ;
+		} ;
+
+	/* Right half, the input samples go backwards. */
+	filter_index = increment - start_filter_index ;
+	coeff_count = (max_filter_index - filter_index) / increment ;
+	filter_index = filter_index + coeff_count * increment ;
+	data_index = filter->b_current + 1 + coeff_count ;
+
+	n_taps = filter_index > 0 ? (filter_index - 1) / increment + 1 : 1 ;
+
+	acc0 = acc1 = _mm256_setzero_pd () ;
+	for (k = 0 ; k + 8 <= n_taps ; k += 8)
+	{	filter_index4 = _mm_sub_epi32 (_mm_set1_epi32 (filter_index - k * increment), step) ;
+		data = _mm_loadu_ps (filter->buffer + data_index - k - 3) ;
+		acc0 = _mm256_add_pd (acc0, sinc_avx2_taps (filter->coeffs, filter_index4, _mm_shuffle_ps (data, data, _MM_SHUFFLE (0, 1, 2, 3)))) ;
+		filter_index4 = _mm_sub_epi32 (filter_index4, step4) ;
+		data = _mm_loadu_ps (filter->buffer + data_index - k - 7) ;
+		acc1 = _mm256_add_pd (acc1, sinc_avx2_taps (filter->coeffs, filter_index4, _mm_shuffle_ps (data, data, _MM_SHUFFLE (0, 1, 2, 3)))) ;
+		} ;
+
+	_mm256_storeu_pd (sum, _mm256_add_pd (acc0, acc1)) ;
+	right = (sum [0] + sum [1]) + (sum [2] + sum [3]) ;
+
+	for ( ; k < n_taps ; k++)
+	{	fraction = fp_to_double (filter_index - k * increment) ;
+		indx = fp_to_int (filter_index - k * increment) ;
+
+		icoeff = filter->coeffs [indx] + fraction * (filter->coeffs [indx + 1] - filter->coeffs [indx]) ;
+
+		right += icoeff * filter->buffer [data_index - k] ;
+		} ;
+
+	return (left + right) ;
+} /* calc_output_single_simd */
+
+#elif SRC_SINC_NEON
+
+static int
+sinc_cpu_has_simd (void)
+{	/* Advanced SIMD is part of every AArch64 CPU. */
+	return 1 ;
+} /* sinc_cpu_has_simd */
+
+/* Interpolated coefficients of 2 taps times 2 input samples, in double precision. */
+static inline float64x2_t
+sinc_neon_taps (const coeff_t *coeffs, increment_t filter_index0, increment_t filter_index1, float data0, float data1)
+{	const int indx0 = fp_to_int (filter_index0), indx1 = fp_to_int (filter_index1) ;
+	float32x2_t c0, c1 ;
+	float64x2_t fraction, icoeff, data ;
+
+	c0 = vset_lane_f32 (coeffs [indx1], vdup_n_f32 (coeffs [indx0]), 1) ;
+	c1 = vset_lane_f32 (coeffs [indx1 + 1], vdup_n_f32 (coeffs [indx0 + 1]), 1) ;
+
+	fraction = vsetq_lane_f64 (fp_to_double (filter_index1), vdupq_n_f64 (fp_to_double (filter_index0)), 1) ;
+	icoeff = vaddq_f64 (vcvt_f64_f32 (c0), vmulq_f64 (fraction, vcvt_f64_f32 (vsub_f32 (c1, c0)))) ;
+	data = vsetq_lane_f64 (data1, vdupq_n_f64 (data0), 1) ;
+
+	return vmulq_f64 (icoeff, data) ;
+} /* sinc_neon_taps */
+
+static double
+calc_output_single_simd (SINC_FILTER *filter, increment_t increment, increment_t start_filter_index)
+{	double		fraction, left, right, icoeff ;
+	increment_t	filter_index, max_filter_index ;
+	int			data_index, coeff_count, indx, k, n_taps ;
+	float64x2_t	acc0, acc1 ;
+
+	max_filter_index = int_to_fp (filter->coeff_half_len) ;
+
+	/* Left half, the input samples go forwards. */
+	filter_index = start_filter_index ;
+	coeff_count = (max_filter_index - filter_index) / increment ;
+	filter_index = filter_index + coeff_count * increment ;
+	data_index = filter->b_current - coeff_count ;
+
+	/* Taps before the start of the buffer are skipped, like in the scalar code. */
+	n_taps = filter_index / increment + 1 ;
+	if (data_index < 0)
+	{	k = MIN (-data_index, n_taps) ;
+		filter_index -= k * increment ;
+		data_index += k ;
+		n_taps -= k ;
+		} ;
+
+	acc0 = acc1 = vdupq_n_f64 (0.0) ;
+	for (k = 0 ; k + 4 <= n_taps ; k += 4)
+	{	const float *data = filter->buffer + data_index + k ;
+		const increment_t fi = filter_index - k * increment ;
+
+		acc0 = vaddq_f64 (acc0, sinc_neon_taps (filter->coeffs, fi, fi - increment, data [0], data [1])) ;
+		acc1 = vaddq_f64 (acc1, sinc_neon_taps (filter->coeffs, fi - 2 * increment, fi - 3 * increment, data [2], data [3])) ;
+		} ;
+
+	left = vaddvq_f64 (vaddq_f64 (acc0, acc1)) ;
+
+	for ( ; k < n_taps ; k++)
+	{	fraction = fp_to_double (filter_index - k * increment) ;
+		indx = fp_to_int (filter_index - k * increment) ;
+
+		icoeff = filter->coeffs [indx] + fraction * (filter->coeffs [indx + 1] - filter->coeffs [indx]) ;
+
+		left += icoeff * filter->buffer [data_index + k] ;
+		} ;
+
+	/* Right half, the input samples go backwards. */
+	filter_index = increment - start_filter_index ;
+	coeff_count = (max_filter_index - filter_index) / increment ;
+	filter_index = filter_index + coeff_count * increment ;
+	data_index = filter->b_current + 1 + coeff_count ;
+
+	n_taps = filter_index > 0 ? (filter_index - 1) / increment + 1 : 1 ;
+
+	acc0 = acc1 = vdupq_n_f64 (0.0) ;
+	for (k = 0 ; k + 4 <= n_taps ; k += 4)
+	{	const float *data = filter->buffer + data_index - k ;
+		const increment_t fi = filter_index - k * increment ;
+
+		acc0 = vaddq_f64 (acc0, sinc_neon_taps (filter->coeffs, fi, fi - increment, data [0], data [-1])) ;
+		acc1 = vaddq_f64 (acc1, sinc_neon_taps (filter->coeffs, fi - 2 * increment, fi - 3 * increment, data [-2], data [-3])) ;
+		} ;
+
+	right = vaddvq_f64 (vaddq_f64 (acc0, acc1)) ;
+
+	for ( ; k < n_taps ; k++)
+	{	fraction = fp_to_double (filter_index - k * increment) ;
+		indx = fp_to_int (filter_index - k * increment) ;
+
+		icoeff = filter->coeffs [indx] + fraction * (filter->coeffs [indx + 1] - filter->coeffs [indx]) ;
+
+		right += icoeff * filter->buffer [data_index - k] ;
+		} ;
+
+	return (left + right) ;
+} /* calc_output_single_simd */
+
+#endif
+
+static inline double
+calc_output_single_dispatch (SINC_FILTER *filter, increment_t increment, increment_t start_filter_index)
+{
+#if SRC_SINC_AVX2 || SRC_SINC_NEON
+	if (filter->simd)
+		return calc_output_single_simd (filter, increment, start_filter_index) ;
+#endif
+	return calc_output_single (filter, increment, start_filter_index) ;
+} /* calc_output_single_dispatch */
+
 static int
 sinc_mono_vari_process (SRC_PRIVATE *psrc, SRC_DATA *data)
 {	SINC_FILTER *filter ;
@@ -404,7 +677,7 @@ sinc_mono_vari_process (SRC_PRIVATE *psrc, SRC_DATA *data)
 		start_filter_index = double_to_fp (input_index * float_increment) ;
 
 		data->data_out [filter->out_gen] = (float) ((float_increment / filter->index_inc) *
-										calc_output_single (filter, increment, start_filter_index)) ;
+										calc_output_single_dispatch (filter, increment, start_filter_index)) ;
 		filter->out_gen ++ ;
 
 		/* Figure out the next index. */
@@ -0,0 +1,139 @@
+/*
+** Copyright (c) 2004-2016, Erik de Castro Lopo <erikd@mega-nerd.com>
+** All rights reserved.
+**
+** This code is released under 2-clause BSD license. Please see the
+** file at : https://github.com/erikd/libsamplerate/blob/master/COPYING
+*/
+
+/*
+** Mono throughput of every converter with the SIMD sinc code and with the
+** scalar code (forced with LIBSAMPLERATE_NO_SIMD), at the 48 kHz -> 16 kHz
+** ratio of speech capture and at a ratio close to 1. Also checks that both
+** produce the same output.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+#include <samplerate.h>
+
+#include "src_config.h"
+
+#include "util.h"
+
+#define BUFFER_LEN	(1<<16)
+
+static float input [BUFFER_LEN] ;
+static float output [BUFFER_LEN] ;
+static float scalar_output [BUFFER_LEN] ;
+
+static long
+mono_throughput (int converter, double src_ratio, int simd, long * frames_gen)
+{	SRC_DATA src_data ;
+	clock_t start_time, clock_time ;
+	double duration ;
+	long total_frames = 0 ;
+	int error ;
+
+	if (simd)
+		unsetenv ("LIBSAMPLERATE_NO_SIMD") ;
+	else
+		setenv ("LIBSAMPLERATE_NO_SIMD", "1", 1) ;
+
+	src_data.data_in = input ;
+	src_data.input_frames = ARRAY_LEN (input) ;
+
+	src_data.data_out = output ;
+	src_data.output_frames = ARRAY_LEN (output) ;
+
+	src_data.src_ratio = src_ratio ;
+
+	start_time = clock () ;
+
+	do
+	{
+		if ((error = src_simple (&src_data, converter, 1)) != 0)
+		{	puts (src_strerror (error)) ;
+			exit (1) ;
+			} ;
+
+		total_frames += src_data.output_frames_gen ;
+
+		clock_time = clock () - start_time ;
+		duration = (1.0 * clock_time) / CLOCKS_PER_SEC ;
+	}
+	while (duration < 1.0) ;
+
+	unsetenv ("LIBSAMPLERATE_NO_SIMD") ;
+
+	*frames_gen = src_data.output_frames_gen ;
+
+	return lrint (floor (total_frames / duration)) ;
+} /* mono_throughput */
+
+static void
+compare_run (int converter, double src_ratio)
+{	long scalar, simd, scalar_gen, simd_gen, k ;
+	double max_diff = 0.0 ;
+
+	printf ("    %-30s  %6.4f  ", src_get_name (converter), src_ratio) ;
+	fflush (stdout) ;
+
+	scalar = mono_throughput (converter, src_ratio, 0, &scalar_gen) ;
+	memcpy (scalar_output, output, scalar_gen * sizeof (output [0])) ;
+
+	simd = mono_throughput (converter, src_ratio, 1, &simd_gen) ;
+
+	if (simd_gen != scalar_gen)
+	{	printf ("\n\nLine %d : output length %ld should be %ld\n", __LINE__, simd_gen, scalar_gen) ;
+		exit (1) ;
+		} ;
+
+	for (k = 0 ; k < simd_gen ; k++)
+		max_diff = MAX (max_diff, fabs (output [k] - scalar_output [k])) ;
+
+	/* Only the order of the additions differs, so the results are within float rounding. */
+	if (max_diff > 1e-6)
+	{	printf ("\n\nLine %d : SIMD output differs from scalar output by %g\n", __LINE__, max_diff) ;
+		exit (1) ;
+		} ;
+
+	printf ("%10ld  %10ld  %5.2fx  %8.1e\n", scalar, simd, (1.0 * simd) / scalar, max_diff) ;
+} /* compare_run */
+
+int
+main (void)
+{	static const int converters [] =
+	{	SRC_ZERO_ORDER_HOLD, SRC_LINEAR, SRC_SINC_FASTEST, SRC_SINC_MEDIUM_QUALITY, SRC_SINC_BEST_QUALITY
+		} ;
+	double freq ;
+	int k ;
+
+	memset (input, 0, sizeof (input)) ;
+	freq = 0.01 ;
+	gen_windowed_sines (1, &freq, 1.0, input, BUFFER_LEN) ;
+
+	printf ("\n    CPU name : %s\n", get_cpu_name ()) ;
+
+	puts (
+		"\n"
+		"    Converter                       Ratio      Scalar        SIMD  Speedup  Max diff\n"
+		"    ------------------------------------------------------------------------------"
+		) ;
+
+	for (k = 0 ; k < ARRAY_LEN (converters) ; k++)
+	{	compare_run (converters [k], 1.0 / 3.0) ;
+		compare_run (converters [k], 0.99) ;
+		} ;
+
+	puts (
+		"\n"
+		"            Throughput is in samples/sec (more is better).\n"
+		) ;
+
+	return 0 ;
+} /* main */
@@ -1,18 +1,24 @@
+#define _USE_MATH_DEFINES // for M_PI
+
 #include "whisper.h"
 
+#include <algorithm>
+#include <cmath>
 #include <cstdio>
 #include <cstring>
 #include <string>
 #include <thread>
+#include <vector>
 
 // command-line parameters
 struct whisper_params {
     int32_t n_threads = std::min(4, (int32_t) std::thread::hardware_concurrency());
-    int32_t what = 0; // what to benchmark: 0 - whisper ecoder, 1 - memcpy, 2 - ggml_mul_mat
+    int32_t what = 0; // what to benchmark: 0 - whisper ecoder, 1 - memcpy, 2 - ggml_mul_mat, 3 - log mel spectrogram, 4 - batched states
 
     std::string model = "models/ggml-base.en.bin";
 
-    bool use_gpu = true;
+    bool use_gpu  = true;
+    bool use_mmap = false;
 };
 
 void whisper_print_usage(int argc, char ** argv, const whisper_params & params);
@@ -29,6 +35,7 @@ bool whisper_params_parse(int argc, char ** argv, whisper_params & params) {
         else if (arg == "-m"  || arg == "--model")   { params.model     = argv[++i]; }
         else if (arg == "-w"  || arg == "--what")    { params.what      = atoi(argv[++i]); }
         else if (arg == "-ng" || arg == "--no-gpu")  { params.use_gpu   = false; }
+        else if (arg == "-mm" || arg == "--mmap")    { params.use_mmap  = true; }
         else {
             fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
             whisper_print_usage(argc, argv, params);
@@ -49,17 +56,21 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "  -m FNAME, --model FNAME [%-7s] model path\n",                                  params.model.c_str());
     fprintf(stderr, "  -w N,     --what N      [%-7d] what to benchmark:\n",                          params.what);
     fprintf(stderr, "  -ng,      --no-gpu      [%-7s] disable GPU\n",                                 params.use_gpu ? "false" : "true");
+    fprintf(stderr, "  -mm,      --mmap        [%-7s] map the model file instead of reading it\n",     params.use_mmap ? "true" : "false");
     fprintf(stderr, "                           %-7s  0 - whisper\n",                                 "");
     fprintf(stderr, "                           %-7s  1 - memcpy\n",                                  "");
     fprintf(stderr, "                           %-7s  2 - ggml_mul_mat\n",                            "");
+    fprintf(stderr, "                           %-7s  3 - log mel spectrogram\n",                     "");
+    fprintf(stderr, "                           %-7s  4 - batched encoder and decoder\n",             "");
     fprintf(stderr, "\n");
 }
 
 int whisper_bench_full(const whisper_params & params) {
     // whisper init
 
-    struct whisper_context_params cparams;
-    cparams.use_gpu = params.use_gpu;
+    struct whisper_context_params cparams = whisper_context_default_params();
+    cparams.use_gpu  = params.use_gpu;
+    cparams.use_mmap = params.use_mmap;
 
     struct whisper_context * ctx = whisper_init_from_file_with_params(params.model.c_str(), cparams);
 
@@ -150,6 +161,158 @@ int whisper_bench_full(const whisper_params & params) {
     return 0;
 }
 
+// encode and decode several states with whisper_encode_batch_with_states() / whisper_decode_batch_with_states()
+// and one by one, the logits of both have to be the same
+int whisper_bench_batch(const whisper_params & params) {
+    const int n_states = 3;
+    const int n_prompt = 8;
+
+    struct whisper_context_params cparams = whisper_context_default_params();
+    cparams.use_gpu  = params.use_gpu;
+    cparams.use_mmap = params.use_mmap;
+
+    struct whisper_context * ctx = whisper_init_from_file_with_params_no_state(params.model.c_str(), cparams);
+    if (ctx == nullptr) {
+        fprintf(stderr, "error: failed to initialize whisper context\n");
+        return 2;
+    }
+
+    const int n_vocab = whisper_n_vocab(ctx);
+
+    std::vector<whisper_state *> states_seq;
+    std::vector<whisper_state *> states_batch;
+
+    // a different tone and prompt for every state, so a mix-up between them changes the logits
+    std::vector<std::vector<whisper_token>> prompts(n_states);
+
+    for (int s = 0; s < n_states; ++s) {
+        std::vector<float> pcm(WHISPER_SAMPLE_RATE*10);
+        for (size_t i = 0; i < pcm.size(); ++i) {
+            pcm[i] = 0.2f*sinf(2.0f*float(M_PI)*(220.0f*(s + 1))*i/WHISPER_SAMPLE_RATE);
+        }
+
+        for (auto * states : { &states_seq, &states_batch }) {
+            whisper_state * state = whisper_init_state(ctx);
+            if (state == nullptr || whisper_pcm_to_mel_with_state(ctx, state, pcm.data(), pcm.size(), params.n_threads) != 0) {
+                fprintf(stderr, "error: failed to initialize whisper state\n");
+                return 3;
+            }
+            states->push_back(state);
+        }
+
+        prompts[s].push_back(whisper_token_sot(ctx));
+        for (int i = 1; i < n_prompt - s; ++i) {
+            prompts[s].push_back((1000*(s + 1) + 7*i) % whisper_token_eot(ctx));
+        }
+    }
+
+    std::vector<const whisper_token *> tokens(n_states);
+    std::vector<int> n_tokens(n_states);
+    std::vector<int> n_past(n_states, 0);
+    std::vector<int> offsets(n_states, 0);
+
+    for (int s = 0; s < n_states; ++s) {
+        tokens[s]   = prompts[s].data();
+        n_tokens[s] = prompts[s].size();
+    }
+
+    int64_t t_seq_us   = 0;
+    int64_t t_batch_us = 0;
+
+    // the prompt, then one generated token
+    std::vector<std::vector<float>> logits_seq(n_states);
+
+    {
+        const int64_t t_start_us = ggml_time_us();
+
+        for (int s = 0; s < n_states; ++s) {
+            whisper_state * state = states_seq[s];
+
+            if (whisper_encode_with_state(ctx, state, 0, params.n_threads) != 0 ||
+                whisper_decode_with_state(ctx, state, tokens[s], n_tokens[s], 0, params.n_threads) != 0) {
+                fprintf(stderr, "error: failed to evaluate state %d\n", s);
+                return 4;
+            }
+
+            const float * logits = whisper_get_logits_from_state(state) + (n_tokens[s] - 1)*n_vocab;
+            logits_seq[s].assign(logits, logits + n_vocab);
+
+            if (whisper_decode_with_state(ctx, state, tokens[s] + 1, 1, n_tokens[s], params.n_threads) != 0) {
+                fprintf(stderr, "error: failed to evaluate state %d\n", s);
+                return 4;
+            }
+
+            logits = whisper_get_logits_from_state(state);
+            logits_seq[s].insert(logits_seq[s].end(), logits, logits + n_vocab);
+        }
+
+        t_seq_us = ggml_time_us() - t_start_us;
+    }
+
+    std::vector<std::vector<float>> logits_batch(n_states);
+
+    {
+        const int64_t t_start_us = ggml_time_us();
+
+        if (whisper_encode_batch_with_states(ctx, states_batch.data(), offsets.data(), n_states, 0, params.n_threads) != 0 ||
+            whisper_decode_batch_with_states(ctx, states_batch.data(), tokens.data(), n_tokens.data(), n_past.data(), n_states, params.n_threads) != 0) {
+            fprintf(stderr, "error: failed to evaluate the batch\n");
+            return 4;
+        }
+
+        for (int s = 0; s < n_states; ++s) {
+            const float * logits = whisper_get_logits_from_state(states_batch[s]) + (n_tokens[s] - 1)*n_vocab;
+            logits_batch[s].assign(logits, logits + n_vocab);
+
+            n_past[s]   = n_tokens[s];
+            tokens[s]   = prompts[s].data() + 1;
+            n_tokens[s] = 1;
+        }
+
+        if (whisper_decode_batch_with_states(ctx, states_batch.data(), tokens.data(), n_tokens.data(), n_past.data(), n_states, params.n_threads) != 0) {
+            fprintf(stderr, "error: failed to evaluate the batch\n");
+            return 4;
+        }
+
+        for (int s = 0; s < n_states; ++s) {
+            const float * logits = whisper_get_logits_from_state(states_batch[s]);
+            logits_batch[s].insert(logits_batch[s].end(), logits, logits + n_vocab);
+        }
+
+        t_batch_us = ggml_time_us() - t_start_us;
+    }
+
+    int ret = 0;
+
+    for (int s = 0; s < n_states; ++s) {
+        double max_diff = 0.0;
+        for (size_t i = 0; i < logits_seq[s].size(); ++i) {
+            max_diff = std::max(max_diff, (double) std::fabs(logits_seq[s][i] - logits_batch[s][i]));
+        }
+
+        fprintf(stderr, "%s: state %d: max logit difference = %g\n", __func__, s, max_diff);
+
+        // the batched graphs do the same operations on the same rows, the results are identical
+        if (max_diff != 0.0) {
+            ret = 5;
+        }
+    }
+
+    fprintf(stderr, "%s: %d states one by one: %8.2f ms, batched: %8.2f ms\n", __func__, n_states, t_seq_us/1000.0, t_batch_us/1000.0);
+
+    if (ret != 0) {
+        fprintf(stderr, "error: the batched logits differ from the ones of the states evaluated one by one\n");
+    }
+
+    for (int s = 0; s < n_states; ++s) {
+        whisper_free_state(states_seq[s]);
+        whisper_free_state(states_batch[s]);
+    }
+    whisper_free(ctx);
+
+    return ret;
+}
+
 int main(int argc, char ** argv) {
     whisper_params params;
 
@@ -163,6 +326,8 @@ int main(int argc, char ** argv) {
         case 0: ret = whisper_bench_full(params);                break;
         case 1: ret = whisper_bench_memcpy(params.n_threads);       break;
         case 2: ret = whisper_bench_ggml_mul_mat(params.n_threads); break;
+        case 3: ret = whisper_bench_mel(params.n_threads);          break;
+        case 4: ret = whisper_bench_batch(params);                  break;
         default: fprintf(stderr, "error: unknown benchmark: %d\n", params.what); break;
     }
 
@@ -94,6 +94,13 @@ typedef void * thread_ret_t;
 #include <sys/stat.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#elif defined(__APPLE__)
+#include <pthread/qos.h>
+#endif
+
 #endif
 
 #ifdef GGML_USE_CPU_HBM
@@ -16199,6 +16206,395 @@ static void set_numa_thread_affinity(int thread_n, int n_threads) { UNUSED(threa
 static void clear_numa_thread_affinity(void) {}
 #endif
 
+//
+// persistent worker pool
+//
+// the workers are created on demand and reused by every ggml_parallel_for() call, including
+// ggml_graph_compute(). after a job a worker spins for spin_us microseconds waiting for the next
+// one and then parks on a condition variable. only one job uses the pool at a time, concurrent
+// callers fall back to creating their own threads.
+//
+
+#if defined(_WIN32)
+typedef SRWLOCK            ggml_mutex_t;
+typedef CONDITION_VARIABLE ggml_cond_t;
+
+#define GGML_MUTEX_INITIALIZER SRWLOCK_INIT
+#define GGML_COND_INITIALIZER  CONDITION_VARIABLE_INIT
+
+#define ggml_mutex_lock(m)     AcquireSRWLockExclusive(m)
+#define ggml_mutex_trylock(m)  (TryAcquireSRWLockExclusive(m) != 0)
+#define ggml_mutex_unlock(m)   ReleaseSRWLockExclusive(m)
+#define ggml_cond_wait(c, m)   SleepConditionVariableSRW(c, m, INFINITE, 0)
+#define ggml_cond_broadcast(c) WakeAllConditionVariable(c)
+#else
+typedef pthread_mutex_t ggml_mutex_t;
+typedef pthread_cond_t  ggml_cond_t;
+
+#define GGML_MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#define GGML_COND_INITIALIZER  PTHREAD_COND_INITIALIZER
+
+#define ggml_mutex_lock(m)     pthread_mutex_lock(m)
+#define ggml_mutex_trylock(m)  (pthread_mutex_trylock(m) == 0)
+#define ggml_mutex_unlock(m)   pthread_mutex_unlock(m)
+#define ggml_cond_wait(c, m)   pthread_cond_wait(c, m)
+#define ggml_cond_broadcast(c) pthread_cond_broadcast(c)
+#endif
+
+#if defined(_MSC_VER) && (defined(_M_AMD64) || defined(_M_IX86))
+#define ggml_cpu_relax() _mm_pause()
+#elif defined(__x86_64__) || defined(__i386__)
+#define ggml_cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__) && !defined(_MSC_VER)
+#define ggml_cpu_relax() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define ggml_cpu_relax() ((void) 0)
+#endif
+
+// affinity and priority of the current thread, used for the pool workers
+#if defined(_WIN32)
+static void ggml_thread_set_attr(uint64_t affinity_mask, bool low_priority) {
+    DWORD_PTR mask = (DWORD_PTR) affinity_mask;
+    if (mask == 0) {
+        DWORD_PTR system_mask;
+        GetProcessAffinityMask(GetCurrentProcess(), &mask, &system_mask);
+    }
+    if (SetThreadAffinityMask(GetCurrentThread(), mask) == 0) {
+        fprintf(stderr, "warning: SetThreadAffinityMask() failed: %lu\n", GetLastError());
+    }
+    if (!SetThreadPriority(GetCurrentThread(), low_priority ? THREAD_PRIORITY_BELOW_NORMAL : THREAD_PRIORITY_NORMAL)) {
+        fprintf(stderr, "warning: SetThreadPriority() failed: %lu\n", GetLastError());
+    }
+}
+#elif defined(__linux__)
+// affinity and nice value the process was started with (taskset, a container cpuset, nice), restored when
+// no affinity or priority is requested
+static pthread_once_t ggml_thread_base_attr_once = PTHREAD_ONCE_INIT;
+#if !defined(__BIONIC__)
+static cpu_set_t      ggml_thread_base_cpus;
+#endif
+static int            ggml_thread_base_nice = 0;
+
+static void ggml_thread_base_attr_init(void) {
+#if !defined(__BIONIC__)
+    if (sched_getaffinity(0, sizeof(ggml_thread_base_cpus), &ggml_thread_base_cpus) != 0) {
+        CPU_ZERO(&ggml_thread_base_cpus);
+        for (int i = 0; i < CPU_SETSIZE; ++i) {
+            CPU_SET(i, &ggml_thread_base_cpus);
+        }
+    }
+#endif
+    errno = 0;
+    const int nice_value = getpriority(PRIO_PROCESS, 0);
+    ggml_thread_base_nice = errno == 0 ? nice_value : 0;
+}
+
+static void ggml_thread_set_attr(uint64_t affinity_mask, bool low_priority) {
+    pthread_once(&ggml_thread_base_attr_once, ggml_thread_base_attr_init);
+
+#if !defined(__BIONIC__)
+    cpu_set_t cpus;
+    if (affinity_mask == 0) {
+        cpus = ggml_thread_base_cpus;
+    } else {
+        CPU_ZERO(&cpus);
+        for (int i = 0; i < 64 && i < CPU_SETSIZE; ++i) {
+            if ((affinity_mask >> i) & 1) {
+                CPU_SET(i, &cpus);
+            }
+        }
+    }
+
+    int rv = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (rv) {
+        fprintf(stderr, "warning: pthread_setaffinity_np() failed: %s\n", strerror(rv));
+    }
+#else
+    UNUSED(affinity_mask);
+#endif
+
+    // the nice value is per thread on linux; raising it back may need CAP_SYS_NICE, so it is only set when it
+    // differs and a failure is reported once instead of by every worker on every change
+    static atomic_int warned = 0;
+
+    const id_t tid = (id_t) syscall(SYS_gettid);
+    const int  target = low_priority ? MAX(ggml_thread_base_nice, 10) : ggml_thread_base_nice;
+
+    errno = 0;
+    const int current = getpriority(PRIO_PROCESS, tid);
+    if ((errno != 0 || current != target) && setpriority(PRIO_PROCESS, tid, target) != 0) {
+        if (atomic_exchange(&warned, 1) == 0) {
+            fprintf(stderr, "warning: setpriority() failed: %s\n", strerror(errno));
+        }
+    }
+}
+#elif defined(__APPLE__)
+static void ggml_thread_set_attr(uint64_t affinity_mask, bool low_priority) {
+    // macOS has no thread affinity, only the QoS class can be changed
+    UNUSED(affinity_mask);
+    pthread_set_qos_class_self_np(low_priority ? QOS_CLASS_UTILITY : QOS_CLASS_USER_INITIATED, 0);
+}
+#else
+static void ggml_thread_set_attr(uint64_t affinity_mask, bool low_priority) {
+    UNUSED(affinity_mask);
+    UNUSED(low_priority);
+}
+#endif
+
+#define GGML_THREADPOOL_MAX_WORKERS 256
+#define GGML_THREADPOOL_SPIN_YIELD  64 // spin iterations between sched_yield() calls
+
+struct ggml_threadpool_worker {
+    ggml_thread_t thrd;
+
+    int ith;
+
+    atomic_int gen; // bumped by the caller for every job handed to this worker
+
+    ggml_parallel_fn fn;
+    void * data;
+    int    nth;
+
+    char padding[64];
+};
+
+struct ggml_threadpool {
+    ggml_mutex_t job_mutex;  // held by the caller that currently owns the workers
+    ggml_mutex_t park_mutex;
+    ggml_cond_t  park_cond;
+
+    atomic_int n_pending; // workers that did not finish the current job
+    atomic_int stop;
+
+    atomic_int enabled;
+    atomic_int spin_us;
+
+    // worker attributes, written under park_mutex; attr_gen is bumped on every change
+    atomic_int attr_gen;
+    uint64_t   affinity_mask;
+    bool       low_priority;
+
+    int n_workers;
+
+    struct ggml_threadpool_worker workers[GGML_THREADPOOL_MAX_WORKERS];
+};
+
+static struct ggml_threadpool g_threadpool = {
+    /*.job_mutex  =*/ GGML_MUTEX_INITIALIZER,
+    /*.park_mutex =*/ GGML_MUTEX_INITIALIZER,
+    /*.park_cond  =*/ GGML_COND_INITIALIZER,
+    /*.n_pending  =*/ 0,
+    /*.stop       =*/ 0,
+    /*.enabled    =*/ 1,
+    /*.spin_us    =*/ 200,
+    /*.attr_gen   =*/ 0,
+    /*.affinity_mask =*/ 0,
+    /*.low_priority  =*/ false,
+    /*.n_workers  =*/ 0,
+    /*.workers    =*/ { { 0 } },
+};
+
+// apply the pool attributes to the calling thread if they changed since *attr_gen
+static void ggml_threadpool_update_attr(struct ggml_threadpool * pool, int * attr_gen) {
+    if (atomic_load(&pool->attr_gen) == *attr_gen) {
+        return;
+    }
+
+    ggml_mutex_lock(&pool->park_mutex);
+    *attr_gen = atomic_load(&pool->attr_gen);
+    const uint64_t affinity_mask = pool->affinity_mask;
+    const bool     low_priority  = pool->low_priority;
+    ggml_mutex_unlock(&pool->park_mutex);
+
+    ggml_thread_set_attr(affinity_mask, low_priority);
+}
+
+static thread_ret_t ggml_threadpool_worker_main(void * data) {
+    struct ggml_threadpool_worker * worker = (struct ggml_threadpool_worker *) data;
+    struct ggml_threadpool * pool = &g_threadpool;
+
+    // gen is reset to 0 before the thread is created and may already have been bumped for the
+    // first job by the time the worker gets here
+    int last = 0;
+    int n_spin = 0;
+    int attr_gen = 0;
+
+    while (true) {
+        // spin for a while, then park until the next job
+        const int64_t t_park = ggml_time_us() + atomic_load(&pool->spin_us);
+        while (atomic_load(&worker->gen) == last && !atomic_load(&pool->stop)) {
+            if (ggml_time_us() < t_park) {
+                if (++n_spin % GGML_THREADPOOL_SPIN_YIELD == 0) {
+                    sched_yield();
+                } else {
+                    ggml_cpu_relax();
+                }
+                continue;
+            }
+
+            ggml_mutex_lock(&pool->park_mutex);
+            while (atomic_load(&worker->gen) == last && !atomic_load(&pool->stop)) {
+                ggml_cond_wait(&pool->park_cond, &pool->park_mutex);
+            }
+            ggml_mutex_unlock(&pool->park_mutex);
+        }
+
+        if (atomic_load(&pool->stop)) {
+            break;
+        }
+
+        last = atomic_load(&worker->gen);
+
+        ggml_threadpool_update_attr(pool, &attr_gen);
+
+        worker->fn(worker->data, worker->ith, worker->nth);
+
+        atomic_fetch_sub(&pool->n_pending, 1);
+    }
+
+    return 0;
+}
+
+struct ggml_parallel_task {
+    ggml_thread_t thrd;
+
+    ggml_parallel_fn fn;
+    void * data;
+    int    ith;
+    int    nth;
+};
+
+static thread_ret_t ggml_parallel_task_main(void * data) {
+    struct ggml_parallel_task * task = (struct ggml_parallel_task *) data;
+    int attr_gen = 0;
+    ggml_threadpool_update_attr(&g_threadpool, &attr_gen);
+    task->fn(task->data, task->ith, task->nth);
+    return 0;
+}
+
+// used when the pool is disabled, busy or too small
+static void ggml_parallel_for_threads(int nth, ggml_parallel_fn fn, void * data) {
+    struct ggml_parallel_task * tasks = malloc(sizeof(struct ggml_parallel_task)*nth);
+
+    for (int j = 1; j < nth; ++j) {
+        tasks[j] = (struct ggml_parallel_task) {
+            .thrd = 0,
+            .fn   = fn,
+            .data = data,
+            .ith  = j,
+            .nth  = nth,
+        };
+
+        const int rc = ggml_thread_create(&tasks[j].thrd, NULL, ggml_parallel_task_main, &tasks[j]);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
+
+    fn(data, 0, nth);
+
+    for (int j = 1; j < nth; ++j) {
+        const int rc = ggml_thread_join(tasks[j].thrd, NULL);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
+
+    free(tasks);
+}
+
+void ggml_parallel_for(int nth, ggml_parallel_fn fn, void * data) {
+    struct ggml_threadpool * pool = &g_threadpool;
+
+    if (nth <= 1) {
+        fn(data, 0, 1);
+        return;
+    }
+
+    if (!atomic_load(&pool->enabled) || nth - 1 > GGML_THREADPOOL_MAX_WORKERS || !ggml_mutex_trylock(&pool->job_mutex)) {
+        ggml_parallel_for_threads(nth, fn, data);
+        return;
+    }
+
+    while (pool->n_workers < nth - 1) {
+        struct ggml_threadpool_worker * worker = &pool->workers[pool->n_workers];
+
+        worker->ith = pool->n_workers + 1;
+        atomic_store(&worker->gen, 0);
+
+        const int rc = ggml_thread_create(&worker->thrd, NULL, ggml_threadpool_worker_main, worker);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+
+        pool->n_workers++;
+    }
+
+    atomic_store(&pool->n_pending, nth - 1);
+
+    ggml_mutex_lock(&pool->park_mutex);
+    for (int j = 1; j < nth; ++j) {
+        struct ggml_threadpool_worker * worker = &pool->workers[j - 1];
+
+        worker->fn   = fn;
+        worker->data = data;
+        worker->nth  = nth;
+
+        atomic_fetch_add(&worker->gen, 1);
+    }
+    ggml_cond_broadcast(&pool->park_cond);
+    ggml_mutex_unlock(&pool->park_mutex);
+
+    fn(data, 0, nth);
+
+    // the workers may not be running yet when there are fewer cores than threads
+    for (int n_spin = 1; atomic_load(&pool->n_pending) > 0; ++n_spin) {
+        if (n_spin % GGML_THREADPOOL_SPIN_YIELD == 0) {
+            sched_yield();
+        } else {
+            ggml_cpu_relax();
+        }
+    }
+
+    ggml_mutex_unlock(&pool->job_mutex);
+}
+
+void ggml_threadpool_set_params(bool enabled, int spin_us) {
+    atomic_store(&g_threadpool.enabled, enabled ? 1 : 0);
+    atomic_store(&g_threadpool.spin_us, MAX(0, spin_us));
+}
+
+void ggml_threadpool_set_attr(uint64_t affinity_mask, bool low_priority) {
+    struct ggml_threadpool * pool = &g_threadpool;
+
+    ggml_mutex_lock(&pool->park_mutex);
+    if (pool->affinity_mask != affinity_mask || pool->low_priority != low_priority) {
+        pool->affinity_mask = affinity_mask;
+        pool->low_priority  = low_priority;
+        atomic_fetch_add(&pool->attr_gen, 1);
+    }
+    ggml_mutex_unlock(&pool->park_mutex);
+}
+
+void ggml_threadpool_shutdown(void) {
+    struct ggml_threadpool * pool = &g_threadpool;
+
+    ggml_mutex_lock(&pool->job_mutex);
+
+    ggml_mutex_lock(&pool->park_mutex);
+    atomic_store(&pool->stop, 1);
+    ggml_cond_broadcast(&pool->park_cond);
+    ggml_mutex_unlock(&pool->park_mutex);
+
+    for (int j = 0; j < pool->n_workers; ++j) {
+        const int rc = ggml_thread_join(pool->workers[j].thrd, NULL);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
+
+    pool->n_workers = 0;
+    atomic_store(&pool->stop, 0);
+
+    ggml_mutex_unlock(&pool->job_mutex);
+}
+
 struct ggml_compute_state_shared {
     const struct ggml_cgraph * cgraph;
     const struct ggml_cplan  * cplan;
@@ -16217,8 +16613,8 @@ struct ggml_compute_state_shared {
 };
 
 struct ggml_compute_state {
-    ggml_thread_t thrd;
     int ith;
+    int ret;
     struct ggml_compute_state_shared * shared;
 };
 
@@ -16593,6 +16989,12 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
     return GGML_EXIT_SUCCESS;
 }
 
+static void ggml_graph_compute_task(void * data, int ith, int nth) {
+    struct ggml_compute_state * workers = (struct ggml_compute_state *) data;
+    workers[ith].ret = (int) (size_t) ggml_graph_compute_thread(&workers[ith]);
+    UNUSED(nth);
+}
+
 struct ggml_cplan ggml_graph_plan(struct ggml_cgraph * cgraph, int n_threads) {
     if (n_threads <= 0) {
         n_threads = GGML_DEFAULT_N_THREADS;
@@ -16802,40 +17204,23 @@ int ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
     };
     struct ggml_compute_state * workers = alloca(sizeof(struct ggml_compute_state)*n_threads);
 
-    // create thread pool
-    if (n_threads > 1) {
-        for (int j = 1; j < n_threads; ++j) {
-            workers[j] = (struct ggml_compute_state) {
-                .thrd   = 0,
-                .ith = j,
-                .shared = &state_shared,
-            };
-
-            const int rc = ggml_thread_create(&workers[j].thrd, NULL, ggml_graph_compute_thread, &workers[j]);
-            GGML_ASSERT(rc == 0);
-            UNUSED(rc);
-        }
+    for (int j = 0; j < n_threads; ++j) {
+        workers[j] = (struct ggml_compute_state) {
+            .ith    = j,
+            .shared = &state_shared,
+        };
     }
 
-    workers[0].ith = 0;
-    workers[0].shared = &state_shared;
-
     const int64_t perf_start_cycles  = ggml_perf_cycles();
     const int64_t perf_start_time_us = ggml_perf_time_us();
 
-    // this is a work thread too
-    int compute_status = (size_t) ggml_graph_compute_thread(&workers[0]);
+    // the calling thread is worker 0, the others come from the persistent pool
+    ggml_parallel_for(n_threads, ggml_graph_compute_task, workers);
 
     // don't leave affinity set on the main thread
     clear_numa_thread_affinity();
 
-    // join or kill thread pool
-    if (n_threads > 1) {
-        for (int j = 1; j < n_threads; j++) {
-            const int rc = ggml_thread_join(workers[j].thrd, NULL);
-            GGML_ASSERT(rc == 0);
-        }
-    }
+    int compute_status = workers[0].ret;
 
     // performance stats (graph)
     {
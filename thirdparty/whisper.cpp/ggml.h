@@ -1854,6 +1854,28 @@ extern "C" {
     // note: the drawback of this API is that you must have ensured that the context has enough memory for the work data
     GGML_API void ggml_graph_compute_with_ctx(struct ggml_context * ctx, struct ggml_cgraph * cgraph, int n_threads);
 
+    //
+    // worker pool
+    //
+
+    typedef void (*ggml_parallel_fn)(void * data, int ith, int nth);
+
+    // run fn(data, ith, nth) concurrently for ith = 0 .. nth - 1, ith = 0 runs on the calling thread
+    // the other tasks run on a persistent process-wide worker pool, which is also used by ggml_graph_compute()
+    GGML_API void ggml_parallel_for(int nth, ggml_parallel_fn fn, void * data);
+
+    // enabled: reuse the pool workers instead of creating threads for every call
+    // spin_us: how long an idle worker spins before it parks until the next job
+    GGML_API void ggml_threadpool_set_params(bool enabled, int spin_us);
+
+    // affinity_mask: cpus the pool workers may run on (bit i = cpu i), 0 keeps the affinity of the process
+    // low_priority:  run the pool workers below the normal OS thread priority
+    // the attributes are applied by each worker before its next job
+    GGML_API void ggml_threadpool_set_attr(uint64_t affinity_mask, bool low_priority);
+
+    // join the pool workers, e.g. before unloading the library; new workers are created on demand
+    GGML_API void ggml_threadpool_shutdown(void);
+
     GGML_API struct ggml_tensor * ggml_graph_get_tensor(struct ggml_cgraph * cgraph, const char * name);
 
     GGML_API void                 ggml_graph_export(const struct ggml_cgraph * cgraph, const char * fname);
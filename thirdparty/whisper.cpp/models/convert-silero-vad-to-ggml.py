@@ -0,0 +1,82 @@
+# Convert the Silero VAD v5 model from TorchScript to ggml format
+#
+# Usage: python convert-silero-vad-to-ggml.py ./silero_vad.jit ./models/ggml-silero-vad.bin
+#
+# silero_vad.jit can be downloaded from https://github.com/snakers4/silero-vad (src/silero_vad/data/silero_vad.jit)
+#
+# Only the 16 kHz branch of the model ("_model.*") is converted. The output file contains:
+#
+#  - magic (int, "ggml")
+#  - model variables
+#
+# For each variable, write the following:
+#
+#  - Number of dimensions (int)
+#  - Name length (int)
+#  - Type (int, always 0 = float32)
+#  - Dimensions (int[n_dims])
+#  - Name (char[name_length])
+#  - Data (float[n_dims])
+#
+
+import sys
+import struct
+import torch
+
+if len(sys.argv) < 3:
+    print("Usage: convert-silero-vad-to-ggml.py silero_vad.jit out.bin\n")
+    sys.exit(1)
+
+fname_inp = sys.argv[1]
+fname_out = sys.argv[2]
+
+model = torch.jit.load(fname_inp, map_location="cpu")
+state_dict = model.state_dict()
+
+expected = [
+    "_model.stft.forward_basis_buffer",
+    "_model.encoder.0.reparam_conv.weight",
+    "_model.encoder.0.reparam_conv.bias",
+    "_model.encoder.1.reparam_conv.weight",
+    "_model.encoder.1.reparam_conv.bias",
+    "_model.encoder.2.reparam_conv.weight",
+    "_model.encoder.2.reparam_conv.bias",
+    "_model.encoder.3.reparam_conv.weight",
+    "_model.encoder.3.reparam_conv.bias",
+    "_model.decoder.rnn.weight_ih",
+    "_model.decoder.rnn.weight_hh",
+    "_model.decoder.rnn.bias_ih",
+    "_model.decoder.rnn.bias_hh",
+    "_model.decoder.decoder.2.weight",
+    "_model.decoder.decoder.2.bias",
+]
+
+fout = open(fname_out, "wb")
+
+fout.write(struct.pack("i", 0x67676d6c)) # magic: ggml in hex
+
+for name in expected:
+    if name not in state_dict:
+        print("Missing variable: " + name + ", is this a Silero VAD v5 model?")
+        sys.exit(1)
+
+    data = state_dict[name].squeeze().numpy().astype("float32") if name.endswith("decoder.2.weight") else \
+           state_dict[name].numpy().astype("float32")
+    print("Processing variable: " , name ,  " with shape: ", data.shape)
+
+    n_dims = len(data.shape)
+
+    # header
+    str_ = name.encode('utf-8')
+    fout.write(struct.pack("iii", n_dims, len(str_), 0))
+    for i in range(n_dims):
+        fout.write(struct.pack("i", data.shape[n_dims - 1 - i]))
+    fout.write(str_)
+
+    # data
+    data.tofile(fout)
+
+fout.close()
+
+print("Done. Output file: " , fname_out)
+print("")
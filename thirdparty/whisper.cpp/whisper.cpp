@@ -29,7 +29,9 @@
 #include <cstdarg>
 #include <cstring>
 #include <fstream>
+#include <list>
 #include <map>
+#include <mutex>
 #include <set>
 #include <string>
 #include <thread>
@@ -38,6 +40,29 @@
 #include <random>
 #include <functional>
 
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+#include <arm_neon.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
 #if defined(_MSC_VER)
 #pragma warning(disable: 4244 4267) // possible loss of data
 #endif
@@ -148,10 +173,26 @@ static void whisper_log_callback_default(ggml_log_level level, const char * text
 #define WHISPER_MAX_DECODERS 8
 #define WHISPER_MAX_NODES 4096
 
+// max number of audio windows encoded together by whisper_encode_batch_with_states()
+#define WHISPER_MAX_ENCODE_BATCH 8
+
+// max number of states decoded together by whisper_decode_batch_with_states()
+#define WHISPER_MAX_DECODE_BATCH 8
+
+// the conv, encode and cross compute buffers are sized for a multiple of this audio_ctx (a power of 2)
+#define WHISPER_AUDIO_CTX_TIER 256
+
 //
 // ggml helpers
 //
 
+// run fn(ith) for ith < n_threads on the ggml worker pool, the calling thread takes ith = 0
+static void whisper_parallel_for(int n_threads, const std::function<void(int)> & fn) {
+    ggml_parallel_for(n_threads, [](void * data, int ith, int /*nth*/) {
+        (*(const std::function<void(int)> *) data)(ith);
+    }, const_cast<std::function<void(int)> *>(&fn));
+}
+
 static bool ggml_graph_compute_helper(
           struct ggml_cgraph * graph,
         std::vector<uint8_t> & buf,
@@ -355,13 +396,60 @@ struct whisper_mel {
     std::vector<float> data;
 };
 
+// log mel frames of a growing PCM buffer, see whisper_pcm_to_mel_append()
+// frame i starts at sample offset i*WHISPER_HOP_LENGTH - WHISPER_N_FFT/2 and becomes final
+// once it no longer overlaps the zero padding after the last sample
+struct whisper_mel_cache {
+    int n_mel    = 0;
+    int n_frames = 0; // number of final frames
+
+    float mmax = -1e20f; // largest value of the final frames
+
+    std::vector<float> samples;
+
+    // unnormalized log10 mel power, [n_frames][n_mel]
+    std::vector<float> data;
+
+    // frames that still overlap the padding, recomputed on every append
+    std::vector<float> tail;
+
+    std::vector<float> hann;
+};
+
 struct whisper_filters {
     int32_t n_mel;
     int32_t n_fft;
 
     std::vector<float> data;
+
+    // the non-zero weights of mel bin j are data[j*n_fft + start[j]] .. data[j*n_fft + end[j] - 1]
+    std::vector<int32_t> start;
+    std::vector<int32_t> end;
 };
 
+// most filterbank weights are zero, only the span between the first and the last non-zero weight is used
+static void whisper_filters_init_ranges(whisper_filters & filters) {
+    filters.start.assign(filters.n_mel, 0);
+    filters.end.assign(filters.n_mel, 0);
+
+    for (int j = 0; j < filters.n_mel; j++) {
+        const float * row = filters.data.data() + j*filters.n_fft;
+
+        int k0 = 0;
+        while (k0 < filters.n_fft && row[k0] == 0.0f) {
+            k0++;
+        }
+
+        int k1 = filters.n_fft;
+        while (k1 > k0 && row[k1 - 1] == 0.0f) {
+            k1--;
+        }
+
+        filters.start[j] = k0;
+        filters.end[j]   = k1;
+    }
+}
+
 struct whisper_vocab {
     using id    = int32_t;
     using token = std::string;
@@ -483,13 +571,13 @@ static size_t whisper_allocr_size(struct whisper_allocr & allocr) {
 }
 
 // measure the memory usage of a graph and prepare the allocr's internal data buffer
-static void whisper_allocr_graph_init(struct whisper_allocr & allocr, ggml_backend_t backend, std::function<struct ggml_cgraph *()> && get_graph) {
+static void whisper_allocr_graph_init(struct whisper_allocr & allocr, ggml_backend_t backend, std::function<struct ggml_cgraph *()> && get_graph, int n_nodes = WHISPER_MAX_NODES) {
     auto & alloc = allocr.alloc;
     auto & meta  = allocr.meta;
 
     alloc = ggml_allocr_new_measure_from_backend(backend);
 
-    meta.resize(ggml_tensor_overhead()*WHISPER_MAX_NODES + ggml_graph_overhead());
+    meta.resize(ggml_tensor_overhead()*n_nodes + ggml_graph_overhead_custom(n_nodes, false));
 
     ggml_allocr_alloc_graph(alloc, get_graph());
 }
@@ -655,12 +743,12 @@ struct whisper_kv_cache {
 
     std::vector<whisper_kv_cell> cells;
 
-    struct ggml_tensor * k;
-    struct ggml_tensor * v;
+    struct ggml_tensor * k = nullptr;
+    struct ggml_tensor * v = nullptr;
 
-    struct ggml_context * ctx;
+    struct ggml_context * ctx = nullptr;
 
-    ggml_backend_buffer_t buffer;
+    ggml_backend_buffer_t buffer = nullptr;
 };
 
 struct whisper_model {
@@ -782,6 +870,17 @@ struct whisper_state {
     int32_t n_fail_p = 0; // number of logprob threshold failures
     int32_t n_fail_h = 0; // number of entropy threshold failures
 
+    int32_t n_prompt_reused   = 0; // number of prompt tokens of whisper_full() whose KV cells were kept
+    int32_t n_prompt_computed = 0; // number of prompt tokens of whisper_full() that were decoded
+
+    int32_t n_encoder_cache_hit  = 0; // number of windows whose cross-attention memory came from the encoder cache
+    int32_t n_encoder_cache_miss = 0; // number of windows encoded while the encoder cache was enabled
+
+    // the decoding the buffers are sized for, see whisper_state_params
+    int32_t n_max_decoders  = WHISPER_MAX_DECODERS;
+    int32_t n_max_text_ctx  = 0;
+    int32_t n_max_audio_ctx = 0;
+
     // unified self-attention KV cache for all decoders
     whisper_kv_cache kv_self;
 
@@ -790,6 +889,7 @@ struct whisper_state {
     whisper_kv_cache kv_cross;
 
     whisper_mel mel;
+    whisper_mel_cache mel_cache;
 
     whisper_batch batch;
 
@@ -805,6 +905,44 @@ struct whisper_state {
     whisper_allocr alloc_cross;
     whisper_allocr alloc_decode;
 
+    // audio_ctx alloc_conv, alloc_encode and alloc_cross are measured for, see whisper_alloc_audio_ctx()
+    int32_t n_audio_ctx_alloc = 0;
+
+    // batched encoder, measured for n_batch_alloc windows of n_ctx_batch_alloc frames on first use
+    whisper_allocr alloc_batch;
+    int32_t n_batch_alloc     = 0;
+    int32_t n_ctx_batch_alloc = 0;
+
+    // batched decoder, measured for n_decode_batch_alloc states of up to n_tokens_decode_batch_alloc tokens each
+    whisper_allocr alloc_decode_batch;
+    int32_t n_decode_batch_alloc        = 0;
+    int32_t n_tokens_decode_batch_alloc = 0;
+
+    // window already encoded by whisper_encode_batch_with_states(), -1 if the cross-attention memory is not from one
+    int32_t encoded_seek  = -1;
+    int32_t encoded_n_ctx = 0;
+
+    // prompt of the last whisper_full() iteration, its KV cells are kept in sequence 0 of kv_self.
+    // they depend on the cross-attention memory, so the prompt is cleared by anything that changes kv_cross
+    std::vector<whisper_token> prompt_kv;
+
+    // [EXPERIMENTAL] incremental encoder, see whisper_set_incremental_encoder_with_state()
+    // kv_enc holds the keys and values of the encoder layers and kv_enc_cross the cross-attention memory of the
+    // frames encoded so far, both with a stride of n_audio_ctx. the first n_enc_past frames are still valid
+    int32_t enc_chunk   = 0; // frames per chunk, 0 - disabled
+    int32_t n_enc_past  = 0;
+    int32_t n_mel_final = 0; // mel frames that no longer change when samples are appended
+
+    // the final mel frames are clamped to the largest value of the whole spectrogram minus 8, louder audio appended
+    // later changes them. the kept frames are only valid while the clamp is the one they were encoded with
+    float mel_clamp     = 0.0f;
+    float enc_mel_clamp = 0.0f;
+
+    whisper_kv_cache kv_enc;
+    whisper_kv_cache kv_enc_cross;
+
+    whisper_allocr alloc_enc_inc;
+
     // result of the encoder
     struct ggml_tensor * embd_conv = nullptr;
     struct ggml_tensor * embd_enc  = nullptr;
@@ -843,12 +981,38 @@ struct whisper_state {
     int32_t exp_n_audio_ctx = 0; // 0 - use default
 };
 
+// cross-attention memory of recently encoded windows, shared by all states of a context
+struct whisper_encoder_cache {
+    struct entry {
+        uint64_t hash  = 0;
+        int32_t  n_ctx = 0;
+
+        std::vector<float> mel; // the window given to the encoder, compared on lookup
+
+        std::vector<uint8_t> k; // the first n_text_layer*n_ctx*n_text_state elements of kv_cross
+        std::vector<uint8_t> v;
+
+        size_t size() const {
+            return mel.size()*sizeof(float) + k.size() + v.size();
+        }
+    };
+
+    std::mutex mutex;
+
+    size_t max_size = 0; // in bytes, 0 disables the cache
+    size_t size     = 0;
+
+    // most recently used first
+    std::list<entry> entries;
+};
+
 struct whisper_context {
     int64_t t_load_us  = 0;
     int64_t t_start_us = 0;
 
     ggml_type wtype = ggml_type::GGML_TYPE_F16; // weight type (FP32 / FP16 / QX)
     ggml_type itype = ggml_type::GGML_TYPE_F16; // intermediate type (FP32 or FP16)
+    ggml_type kvtype = ggml_type::GGML_TYPE_F16; // type of the self and cross-attention KV caches (FP16 / Q8_0 / Q4_0)
 
     whisper_context_params params;
 
@@ -860,6 +1024,8 @@ struct whisper_context {
     ggml_backend_t backend = nullptr;
 
     std::string path_model; // populated by whisper_init_from_file_with_params()
+
+    whisper_encoder_cache encoder_cache;
 };
 
 struct whisper_global {
@@ -935,6 +1101,58 @@ static void kv_cache_free(struct whisper_kv_cache & cache) {
     }
 }
 
+// frames per row of the transposed cross-attention values, the rows of a quantized cache hold whole blocks
+static int whisper_kv_cross_v_stride(const struct ggml_tensor * v, int n_ctx) {
+    return GGML_PAD(n_ctx, ggml_blck_size(v->type));
+}
+
+// stores the cross-attention memory of layer il of a window of n_ctx frames
+//
+//   - Kcross: keys,                [n_state, n_ctx]
+//   - Vt:     transposed values,   [n_ctx, n_state]
+//
+// quantized values are padded with zeros to whole blocks per row
+//
+static void whisper_build_cross_store(
+        struct ggml_context * ctx0,
+        struct ggml_cgraph  * gf,
+   struct whisper_kv_cache  & kv_cross,
+        struct ggml_tensor  * Kcross,
+        struct ggml_tensor  * Vt,
+                      int     il,
+                      int     n_ctx) {
+    const int n_state = Kcross->ne[0];
+
+    struct ggml_tensor * k = ggml_view_1d(ctx0, kv_cross.k,
+            n_state*n_ctx,
+            ggml_row_size(kv_cross.k->type, n_state)*(il*n_ctx));
+
+    ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcross, k));
+
+    if (!ggml_is_quantized(kv_cross.v->type)) {
+        struct ggml_tensor * v = ggml_view_2d(ctx0, kv_cross.v, n_ctx, n_state,
+                (   n_ctx)*ggml_element_size(kv_cross.v),
+                (il*n_ctx)*ggml_element_size(kv_cross.v)*n_state);
+
+        ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vt, v));
+        return;
+    }
+
+    const int n_ctx_v = whisper_kv_cross_v_stride(kv_cross.v, n_ctx);
+
+    struct ggml_tensor * cur = ggml_cpy(ctx0, Vt, ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_ctx, n_state));
+
+    if (n_ctx_v != n_ctx) {
+        cur = ggml_pad(ctx0, cur, n_ctx_v - n_ctx, 0, 0, 0);
+    }
+
+    struct ggml_tensor * v = ggml_view_1d(ctx0, kv_cross.v,
+            n_ctx_v*n_state,
+            ggml_row_size(kv_cross.v->type, n_ctx_v)*(il*n_state));
+
+    ggml_build_forward_expand(gf, ggml_cpy(ctx0, cur, v));
+}
+
 static bool whisper_kv_cache_find_slot(
            struct whisper_kv_cache & cache,
         const struct whisper_batch & batch) {
@@ -1035,6 +1253,26 @@ static void whisper_kv_cache_seq_rm(
     if (new_head != cache.size) cache.head = new_head;
 }
 
+static void whisper_kv_cache_seq_keep(
+        struct whisper_kv_cache & cache,
+                 whisper_seq_id   seq_id) {
+    uint32_t new_head = cache.size;
+
+    for (uint32_t i = 0; i < cache.size; ++i) {
+        if (!cache.cells[i].has_seq_id(seq_id)) {
+            cache.cells[i].pos = -1;
+            cache.cells[i].seq_id.clear();
+            if (new_head == cache.size) new_head = i;
+        } else {
+            cache.cells[i].seq_id.clear();
+            cache.cells[i].seq_id.insert(seq_id);
+        }
+    }
+
+    // If we freed up a slot, set head to it so searching can start there.
+    if (new_head != cache.size) cache.head = new_head;
+}
+
 static void whisper_kv_cache_seq_cp(
         struct whisper_kv_cache & cache,
                  whisper_seq_id   seq_id_src,
@@ -1200,6 +1438,8 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         filters.data.resize(filters.n_mel * filters.n_fft);
         loader->read(loader->context, filters.data.data(), filters.data.size() * sizeof(float));
         BYTESWAP_FILTERS(filters);
+
+        whisper_filters_init_ranges(filters);
     }
 
     // load vocab
@@ -1657,6 +1897,26 @@ static bool whisper_encode_external(const whisper_state & wstate) {
     return use_coreml || use_openvino;
 }
 
+// n_frames frames of the mel spectrogram from mel_offset, [n_mel][n_frames], zero padded past the end
+static void whisper_get_mel_window(const whisper_mel & mel, int mel_offset, int n_frames, float * dst) {
+    std::fill(dst, dst + mel.n_mel*n_frames, 0.0f);
+
+    const int i0 = std::min(mel_offset,            mel.n_len);
+    const int i1 = std::min(mel_offset + n_frames, mel.n_len);
+
+    for (int j = 0; j < mel.n_mel; ++j) {
+        for (int i = i0; i < i1; ++i) {
+            dst[j*n_frames + (i - i0)] = mel.data[j*mel.n_len + i];
+        }
+    }
+}
+
+static void whisper_get_mel_window(const whisper_mel & mel, int mel_offset, int n_frames, std::vector<float> & dst) {
+    dst.resize(mel.n_mel*n_frames);
+
+    whisper_get_mel_window(mel, mel_offset, n_frames, dst.data());
+}
+
 static struct ggml_cgraph * whisper_build_graph_conv(
         whisper_context & wctx,
           whisper_state & wstate,
@@ -1689,19 +1949,7 @@ static struct ggml_cgraph * whisper_build_graph_conv(
     if (!ggml_allocr_is_measure(alloc)) {
         assert(mel_inp.n_mel == n_mels);
 
-        wstate.inp_mel.resize(ggml_nelements(mel));
-
-        float * dst = wstate.inp_mel.data();
-        memset(dst, 0, ggml_nbytes(mel));
-
-        const int i0 = std::min(mel_offset,           mel_inp.n_len);
-        const int i1 = std::min(mel_offset + 2*n_ctx, mel_inp.n_len);
-
-        for (int j = 0; j < mel_inp.n_mel; ++j) {
-            for (int i = i0; i < i1; ++i) {
-                dst[j*2*n_ctx + (i - i0)] = mel_inp.data[j*mel_inp.n_len + i];
-            }
-        }
+        whisper_get_mel_window(mel_inp, mel_offset, 2*n_ctx, wstate.inp_mel);
 
         ggml_backend_tensor_set(mel, wstate.inp_mel.data(), 0, ggml_nelements(mel)*sizeof(float));
     }
@@ -1753,37 +2001,26 @@ static struct ggml_cgraph * whisper_build_graph_conv(
     return gf;
 }
 
-static struct ggml_cgraph * whisper_build_graph_encoder(
+// transformer layers of the encoder
+//
+//   - cur:     output of the convolutions, [n_state, n_ctx, n_batch]
+//   - n_batch: number of audio windows encoded together, each attends only to itself
+//
+// returns the encoded features, [n_state, n_ctx, n_batch]
+//
+static struct ggml_tensor * whisper_build_encoder_layers(
+        struct ggml_context * ctx0,
         whisper_context & wctx,
-          whisper_state & wstate) {
+        struct ggml_tensor * cur,
+              const int   n_ctx,
+              const int   n_batch) {
     const auto & model   = wctx.model;
     const auto & hparams = model.hparams;
 
-    const int n_ctx   = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
     const int n_state = hparams.n_audio_state;
     const int n_head  = hparams.n_audio_head;
     const int n_layer = hparams.n_audio_layer;
 
-    struct ggml_init_params params = {
-        /*.mem_size   =*/ wstate.alloc_encode.meta.size(),
-        /*.mem_buffer =*/ wstate.alloc_encode.meta.data(),
-        /*.no_alloc   =*/ true,
-    };
-
-    struct ggml_context * ctx0 = ggml_init(params);
-
-    ggml_cgraph * gf = ggml_new_graph_custom(ctx0, WHISPER_MAX_NODES, false);
-
-    //ggml_allocr * alloc = wstate.alloc_encode.alloc;
-
-    //struct ggml_tensor * cur = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_ctx, n_state);
-    //ggml_allocr_alloc(alloc, cur);
-
-    //if (!ggml_allocr_is_measure(alloc)) {
-    //    ggml_backend_tensor_copy(wstate.embd_conv, cur);
-    //}
-    struct ggml_tensor * cur = ggml_view_tensor(ctx0, wstate.embd_conv);
-
     const float KQscale = 1.0f/sqrtf(float(n_state)/n_head);
 
     // ===================================================================
@@ -1804,7 +2041,7 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
     const size_t e_pe_offset = model.e_pe->ne[0]*ggml_element_size(model.e_pe)*n_ctx*iter;
 
     struct ggml_tensor * e_pe = ggml_view_2d(ctx0, model.e_pe, model.e_pe->ne[0], n_ctx, e_pe_stride, e_pe_offset);
-    cur = ggml_add(ctx0, e_pe, ggml_cont(ctx0, ggml_transpose(ctx0, cur)));
+    cur = ggml_add(ctx0, cur, e_pe);
 
     // ===================================================================
 
@@ -1856,24 +2093,24 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
                 ggml_permute(ctx0,
                         ggml_cpy(ctx0,
                             Qcur,
-                            ggml_new_tensor_3d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx)),
+                            ggml_new_tensor_4d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx, n_batch)),
                         0, 2, 1, 3);
 
             struct ggml_tensor * K =
                 ggml_permute(ctx0,
                         ggml_cpy(ctx0,
                             Kcur,
-                            ggml_new_tensor_3d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx)),
+                            ggml_new_tensor_4d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx, n_batch)),
                         0, 2, 1, 3);
 
             struct ggml_tensor * V =
                 ggml_cpy(ctx0,
                         ggml_permute(ctx0,
-                            ggml_reshape_3d(ctx0,
+                            ggml_reshape_4d(ctx0,
                                 Vcur,
-                                n_state/n_head, n_head, n_ctx),
+                                n_state/n_head, n_head, n_ctx, n_batch),
                             1, 2, 0, 3),
-                        ggml_new_tensor_3d(ctx0, wctx.itype, n_ctx, n_state/n_head, n_head));
+                        ggml_new_tensor_4d(ctx0, wctx.itype, n_ctx, n_state/n_head, n_head, n_batch));
 
             struct ggml_tensor * KQV = ggml_flash_attn(ctx0, Q, K, V, false);
 #else
@@ -1881,14 +2118,14 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
                 ggml_permute(ctx0,
                         ggml_cpy(ctx0,
                             Qcur,
-                            ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_state/n_head, n_head, n_ctx)),
+                            ggml_new_tensor_4d(ctx0, GGML_TYPE_F32, n_state/n_head, n_head, n_ctx, n_batch)),
                         0, 2, 1, 3);
 
             struct ggml_tensor * K =
                 ggml_permute(ctx0,
                         ggml_cpy(ctx0,
                             Kcur,
-                            ggml_new_tensor_3d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx)),
+                            ggml_new_tensor_4d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx, n_batch)),
                         0, 2, 1, 3);
 
             // K * Q
@@ -1901,11 +2138,11 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
             struct ggml_tensor * V =
                 ggml_cpy(ctx0,
                         ggml_permute(ctx0,
-                            ggml_reshape_3d(ctx0,
+                            ggml_reshape_4d(ctx0,
                                 Vcur,
-                                n_state/n_head, n_head, n_ctx),
+                                n_state/n_head, n_head, n_ctx, n_batch),
                             1, 2, 0, 3),
-                        ggml_new_tensor_3d(ctx0, wctx.itype, n_ctx, n_state/n_head, n_head)
+                        ggml_new_tensor_4d(ctx0, wctx.itype, n_ctx, n_state/n_head, n_head, n_batch)
                         );
 
             struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
@@ -1914,7 +2151,7 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
 
             cur = ggml_cpy(ctx0,
                     KQV_merged,
-                    ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_ctx));
+                    ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_state, n_ctx, n_batch));
         }
 
         // projection
@@ -1945,7 +2182,7 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
 
 #ifdef WHISPER_USE_FLASH_FF
             cur = ggml_flash_ff(ctx0,
-                    ggml_cpy(ctx0, cur, ggml_new_tensor_2d(ctx0, wstate.itype, n_state, n_ctx)),
+                    ggml_cpy(ctx0, cur, ggml_new_tensor_3d(ctx0, wctx.itype, n_state, n_ctx, n_batch)),
                     layer.mlp_0_w, layer.mlp_0_b, layer.mlp_1_w, layer.mlp_1_b);
 #else
             // fully connected
@@ -1982,6 +2219,41 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
                 model.e_ln_b);
     }
 
+    return cur;
+}
+
+static struct ggml_cgraph * whisper_build_graph_encoder(
+        whisper_context & wctx,
+          whisper_state & wstate) {
+    const auto & model   = wctx.model;
+    const auto & hparams = model.hparams;
+
+    const int n_ctx   = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ wstate.alloc_encode.meta.size(),
+        /*.mem_buffer =*/ wstate.alloc_encode.meta.data(),
+        /*.no_alloc   =*/ true,
+    };
+
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    ggml_cgraph * gf = ggml_new_graph_custom(ctx0, WHISPER_MAX_NODES, false);
+
+    //ggml_allocr * alloc = wstate.alloc_encode.alloc;
+
+    //struct ggml_tensor * cur = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_ctx, n_state);
+    //ggml_allocr_alloc(alloc, cur);
+
+    //if (!ggml_allocr_is_measure(alloc)) {
+    //    ggml_backend_tensor_copy(wstate.embd_conv, cur);
+    //}
+    struct ggml_tensor * cur = ggml_view_tensor(ctx0, wstate.embd_conv);
+
+    cur = ggml_cont(ctx0, ggml_transpose(ctx0, cur));
+
+    cur = whisper_build_encoder_layers(ctx0, wctx, cur, n_ctx, 1);
+
     ggml_build_forward_expand(gf, cur);
 
     wstate.embd_enc = cur;
@@ -2054,16 +2326,7 @@ static struct ggml_cgraph * whisper_build_graph_cross(
 
         Vcross = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcross, n_state, n_ctx));
 
-        struct ggml_tensor * k = ggml_view_1d(ctx0, wstate.kv_cross.k,
-                n_state*n_ctx,
-                (ggml_element_size(wstate.kv_cross.k)*n_state)*(il*n_ctx));
-
-        struct ggml_tensor * v = ggml_view_2d(ctx0, wstate.kv_cross.v, n_ctx, n_state,
-                (   n_ctx)*ggml_element_size(wstate.kv_cross.v),
-                (il*n_ctx)*ggml_element_size(wstate.kv_cross.v)*n_state);
-
-        ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcross, k));
-        ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcross, v));
+        whisper_build_cross_store(ctx0, gf, wstate.kv_cross, Kcross, Vcross, il, n_ctx);
     }
 
     //ggml_graph_print(gf);
@@ -2073,156 +2336,960 @@ static struct ggml_cgraph * whisper_build_graph_cross(
     return gf;
 }
 
-// evaluate the encoder with the given state
+// 1D convolution with "half" padding of a batch of inputs
 //
-// given audio recording (more specifically, its log mel spectrogram), runs forward pass of the encoder
-// part of the transformer model and returns the encoded features
+// ggml_conv_1d() reshapes the product of the im2col matrix as if the batch was the outer dimension, which it is not
+// for more than one input, so the result is kept in the order of the product instead
 //
-//   - wctx:      the model
-//   - wstate:     the state of the encoder
-//   - n_threads:  number of threads to use
-//   - mel_offset: offset in the mel spectrogram (i.e. audio offset)
+//   - a: kernel, [K, IC, OC]
+//   - b: input,  [L, IC, n_batch]
 //
-static bool whisper_encode_internal(
+// returns [OL, n_batch, OC]
+//
+static struct ggml_tensor * whisper_conv_1d_ph_batch(
+        struct ggml_context * ctx0,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+                        int   s0) {
+    struct ggml_tensor * im2col = ggml_im2col(ctx0, a, b, s0, 0, a->ne[0]/2, 0, 1, 0, false); // [n_batch, OL, IC*K]
+
+    struct ggml_tensor * cur =
+        ggml_mul_mat(ctx0,
+                ggml_reshape_2d(ctx0, im2col, im2col->ne[0], im2col->ne[2]*im2col->ne[1]), // [n_batch*OL, IC*K]
+                ggml_reshape_2d(ctx0, a, a->ne[0]*a->ne[1], a->ne[2]));                     // [OC, IC*K]
+
+    return ggml_reshape_3d(ctx0, cur, im2col->ne[1], im2col->ne[2], a->ne[2]);
+}
+
+// convolutions, encoder and cross-attention memory of several audio windows in one graph
+//
+// the windows are stacked along a batch dimension, so every weight matrix is multiplied once with the columns of
+// all of them. the self-attention stays within each window, and the cross-attention memory of window i is written
+// to the KV cache of wstates[i]
+//
+static struct ggml_cgraph * whisper_build_graph_encoder_batch(
         whisper_context & wctx,
-          whisper_state & wstate,
-              const int   mel_offset,
-              const int   n_threads,
- whisper_abort_callback   abort_callback,
-                   void * abort_callback_data) {
-    const int64_t t_start_us = ggml_time_us();
+          whisper_state ** wstates,
+              const int * mel_offsets,
+              const int   n_batch) {
+    const auto & model   = wctx.model;
+    const auto & hparams = model.hparams;
 
-    // conv
-    {
-        auto & alloc = wstate.alloc_conv.alloc;
+    whisper_state & wstate0 = *wstates[0];
 
-        ggml_allocr_reset(alloc);
+    const int n_ctx   = wstate0.exp_n_audio_ctx > 0 ? wstate0.exp_n_audio_ctx : hparams.n_audio_ctx;
+    const int n_state = hparams.n_audio_state;
+    const int n_head  = hparams.n_audio_head;
+    const int n_mels  = hparams.n_mels;
 
-        ggml_cgraph * gf = whisper_build_graph_conv(wctx, wstate, mel_offset);
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ wstate0.alloc_batch.meta.size(),
+        /*.mem_buffer =*/ wstate0.alloc_batch.meta.data(),
+        /*.no_alloc   =*/ true,
+    };
 
-        ggml_allocr_alloc_graph(alloc, gf);
+    struct ggml_context * ctx0 = ggml_init(params);
 
-        if (!whisper_encode_external(wstate)) {
-            if (!ggml_graph_compute_helper(wstate.backend, gf, n_threads)) {
-                return false;
-            }
-        }
-    }
+    ggml_cgraph * gf = ggml_new_graph_custom(ctx0, WHISPER_MAX_NODES, false);
 
-    // encoder
-    if (!whisper_encode_external(wstate)) {
-        auto & alloc = wstate.alloc_encode.alloc;
+    ggml_allocr * alloc = wstate0.alloc_batch.alloc;
 
-        ggml_allocr_reset(alloc);
+    struct ggml_tensor * mel = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, 2*n_ctx, n_mels, n_batch);
+    ggml_allocr_alloc(alloc, mel);
 
-        ggml_cgraph * gf = whisper_build_graph_encoder(wctx, wstate);
+    if (!ggml_allocr_is_measure(alloc)) {
+        wstate0.inp_mel.resize(ggml_nelements(mel));
 
-        ggml_allocr_alloc_graph(alloc, gf);
+        for (int b = 0; b < n_batch; ++b) {
+            assert(wstates[b]->mel.n_mel == n_mels);
 
-        if (!ggml_graph_compute_helper(wstate.backend, gf, n_threads)) {
-            return false;
+            whisper_get_mel_window(wstates[b]->mel, mel_offsets[b], 2*n_ctx, wstate0.inp_mel.data() + b*2*n_ctx*n_mels);
         }
+
+        ggml_backend_tensor_set(mel, wstate0.inp_mel.data(), 0, ggml_nelements(mel)*sizeof(float));
     }
 
-    // cross
+    struct ggml_tensor * cur = nullptr;
+
+    // convolution + gelu
     {
-        auto & alloc = wstate.alloc_cross.alloc;
+        cur = whisper_conv_1d_ph_batch(ctx0, model.e_conv_1_w, mel, 1);
+        cur = ggml_add(ctx0, cur, ggml_reshape_3d(ctx0, model.e_conv_1_b, 1, 1, n_state));
 
-        ggml_allocr_reset(alloc);
+        cur = ggml_gelu(ctx0, cur);
 
-        ggml_cgraph * gf = whisper_build_graph_cross(wctx, wstate);
+        // [2*n_ctx, n_batch, n_state] -> [2*n_ctx, n_state, n_batch]
+        cur = ggml_cont(ctx0, ggml_permute(ctx0, cur, 0, 2, 1, 3));
 
-        ggml_allocr_alloc_graph(alloc, gf);
+        cur = whisper_conv_1d_ph_batch(ctx0, model.e_conv_2_w, cur, 2);
+        cur = ggml_add(ctx0, cur, ggml_reshape_3d(ctx0, model.e_conv_2_b, 1, 1, n_state));
 
-        if (!ggml_graph_compute_helper(wstate.backend, gf, n_threads)) {
-            return false;
-        }
+        cur = ggml_gelu(ctx0, cur);
     }
 
-    wstate.t_encode_us += ggml_time_us() - t_start_us;
-    wstate.n_encode++;
+    // [n_ctx, n_batch, n_state] -> [n_state, n_ctx, n_batch]
+    cur = ggml_cont(ctx0, ggml_permute(ctx0, cur, 1, 2, 0, 3));
 
-    return !(abort_callback && abort_callback(abort_callback_data));
-}
+    cur = whisper_build_encoder_layers(ctx0, wctx, cur, n_ctx, n_batch);
 
-static struct ggml_cgraph * whisper_build_graph_decoder(
-         whisper_context & wctx,
-         whisper_state   & wstate,
-     const whisper_batch & batch) {
-    const auto & model   = wctx.model;
-    const auto & hparams = model.hparams;
+    // cross-attention memory
+    const float Kscale = pow(float(n_state) / n_head, -0.25);
 
-    auto & kv_self = wstate.kv_self;
+    for (int il = 0; il < hparams.n_text_layer; ++il) {
+        auto & layer = model.layers_decoder[il];
 
-    WHISPER_ASSERT(!!kv_self.ctx);
+        struct ggml_tensor * Kcross = ggml_mul_mat(ctx0,
+                layer.cross_attn_k_w,
+                cur);
 
-    ggml_allocr * alloc = wstate.alloc_decode.alloc;
+        Kcross = ggml_scale(ctx0, Kcross, Kscale);
 
-    const int n_ctx   = kv_self.size;
-    const int n_state = hparams.n_text_state;
-    const int n_head  = hparams.n_text_head;
-    const int n_layer = hparams.n_text_layer;
+        struct ggml_tensor * Vcross = ggml_mul_mat(ctx0,
+                layer.cross_attn_v_w,
+                cur);
 
-    const int n_tokens    = batch.n_tokens;
-    const int n_audio_ctx = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
+        Vcross = ggml_add(ctx0,
+                    Vcross,
+                    layer.cross_attn_v_b);
 
-    const int32_t n_kv     = ggml_allocr_is_measure(alloc) ? n_ctx            : kv_self.n;
-    const int32_t kv_head  = ggml_allocr_is_measure(alloc) ? n_ctx - n_tokens : kv_self.head;
+        for (int b = 0; b < n_batch; ++b) {
+            whisper_state & wstate = *wstates[b];
 
-    //WHISPER_LOG_DEBUG("%s: n_past = %d, n_tokens = %d, n_audio_ctx = %d, n_ctx = %d\n", __func__, n_past, n_tokens, n_audio_ctx, n_ctx);
+            struct ggml_tensor * Kcross_b = ggml_view_2d(ctx0, Kcross, n_state, n_ctx, Kcross->nb[1], b*Kcross->nb[2]);
+            struct ggml_tensor * Vcross_b = ggml_transpose(ctx0,
+                    ggml_view_2d(ctx0, Vcross, n_state, n_ctx, Vcross->nb[1], b*Vcross->nb[2]));
 
-    struct ggml_init_params params = {
-        /*.mem_size   =*/ wstate.alloc_decode.meta.size(),
-        /*.mem_buffer =*/ wstate.alloc_decode.meta.data(),
-        /*.no_alloc   =*/ true,
-    };
+            whisper_build_cross_store(ctx0, gf, wstate.kv_cross, Kcross_b, Vcross_b, il, n_ctx);
+        }
+    }
 
-    struct ggml_context * ctx0 = ggml_init(params);
+    ggml_free(ctx0);
 
-    ggml_cgraph * gf = ggml_new_graph_custom(ctx0, WHISPER_MAX_NODES, false);
+    return gf;
+}
 
-    struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+// [EXPERIMENTAL] convolutions, encoder and cross-attention memory of the frames [n_past, n_ctx) of the window at
+// offset 0, see whisper_set_incremental_encoder_with_state()
+//
+// the frames are split in chunks of wstate.enc_chunk frames and a frame attends to all frames up to the end of its
+// chunk, so the output of a frame does not depend on the frames after its chunk. the keys and values of the frames
+// before n_past are read from wstate.kv_enc and the new ones are written to it
+//
+static struct ggml_cgraph * whisper_build_graph_encoder_incremental(
+        whisper_context & wctx,
+          whisper_state & wstate,
+              const int   n_past,
+              const int   n_ctx) {
+    const auto & model   = wctx.model;
+    const auto & hparams = model.hparams;
+
+    const int n_state = hparams.n_audio_state;
+    const int n_head  = hparams.n_audio_head;
+    const int n_layer = hparams.n_audio_layer;
+    const int n_mels  = hparams.n_mels;
+    const int n_new   = n_ctx - n_past;
+    const int n_chunk = wstate.enc_chunk;
+
+    auto & kv_enc       = wstate.kv_enc;
+    auto & kv_enc_cross = wstate.kv_enc_cross;
+
+    const int n_kv_ctx = kv_enc.size;
+
+    // the first output of the convolutions is the frame before n_past, it sees the zero padding and is dropped
+    const int mel_offset = n_past > 0 ? 2*n_past - 2 : 0;
+    const int n_frames   = 2*n_ctx - mel_offset;
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ wstate.alloc_enc_inc.meta.size(),
+        /*.mem_buffer =*/ wstate.alloc_enc_inc.meta.data(),
+        /*.no_alloc   =*/ true,
+    };
+
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    ggml_cgraph * gf = ggml_new_graph_custom(ctx0, WHISPER_MAX_NODES, false);
+
+    ggml_allocr * alloc = wstate.alloc_enc_inc.alloc;
+
+    struct ggml_tensor * mel = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_frames, n_mels);
+    ggml_allocr_alloc(alloc, mel);
+
+    if (!ggml_allocr_is_measure(alloc)) {
+        whisper_get_mel_window(wstate.mel, mel_offset, n_frames, wstate.inp_mel);
+
+        ggml_backend_tensor_set(mel, wstate.inp_mel.data(), 0, ggml_nelements(mel)*sizeof(float));
+    }
+
+    struct ggml_tensor * KQ_mask = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_ctx, n_new, 1);
+    ggml_allocr_alloc(alloc, KQ_mask);
+
+    if (!ggml_allocr_is_measure(alloc)) {
+        wstate.inp_mask.resize(n_ctx*n_new);
+
+        float * data = wstate.inp_mask.data();
+
+        for (int j = 0; j < n_new; ++j) {
+            const int i1 = std::min(n_ctx, ((n_past + j)/n_chunk + 1)*n_chunk);
+
+            for (int i = 0; i < n_ctx; ++i) {
+                data[j*n_ctx + i] = i < i1 ? 0.0f : -INFINITY;
+            }
+        }
+
+        ggml_backend_tensor_set(KQ_mask, wstate.inp_mask.data(), 0, ggml_nelements(KQ_mask)*sizeof(float));
+    }
+
+    // convolution + gelu
+    struct ggml_tensor * cur = ggml_conv_1d_ph(ctx0, model.e_conv_1_w, mel, 1, 1);
+    cur = ggml_add(ctx0, cur, model.e_conv_1_b);
+
+    cur = ggml_gelu(ctx0, cur);
+
+    cur = ggml_conv_1d_ph(ctx0, model.e_conv_2_w, cur, 2, 1);
+    cur = ggml_add(ctx0, cur, model.e_conv_2_b);
+
+    cur = ggml_gelu(ctx0, cur);
+
+    cur = ggml_cont(ctx0, ggml_transpose(ctx0, cur));
+
+    if (n_past > 0) {
+        cur = ggml_view_2d(ctx0, cur, n_state, n_new, cur->nb[1], cur->nb[1]);
+    }
+
+    const float KQscale = 1.0f/sqrtf(float(n_state)/n_head);
+
+    struct ggml_tensor * e_pe = ggml_view_2d(ctx0, model.e_pe, model.e_pe->ne[0], n_new, model.e_pe->nb[1], n_past*model.e_pe->nb[1]);
+    cur = ggml_add(ctx0, cur, e_pe);
+
+    struct ggml_tensor * inpL = cur;
+
+    for (int il = 0; il < n_layer; ++il) {
+        const auto & layer = model.layers_encoder[il];
+
+        // norm
+        {
+            cur = ggml_norm(ctx0, inpL, hparams.eps);
+
+            // cur = ln_0_w*cur + ln_0_b
+            cur = ggml_add(ctx0,
+                    ggml_mul(ctx0, cur, layer.attn_ln_0_w),
+                    layer.attn_ln_0_b);
+        }
+
+        // self-attention
+        {
+            struct ggml_tensor * Qcur = ggml_mul_mat(ctx0,
+                    layer.attn_q_w,
+                    cur);
+
+            Qcur = ggml_add(ctx0, Qcur, layer.attn_q_b);
+
+            // note: no bias for Key
+            struct ggml_tensor * Kcur = ggml_mul_mat(ctx0,
+                    layer.attn_k_w,
+                    cur);
+
+            struct ggml_tensor * Vcur = ggml_mul_mat(ctx0,
+                    layer.attn_v_w,
+                    cur);
+
+            Vcur = ggml_add(ctx0, Vcur, layer.attn_v_b);
+
+            // store key and value of the new frames
+            {
+                Vcur = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcur, n_state, n_new));
+
+                struct ggml_tensor * k = ggml_view_1d(ctx0, kv_enc.k, n_new*n_state, (ggml_element_size(kv_enc.k)*n_state)*(il*n_kv_ctx + n_past));
+                struct ggml_tensor * v = ggml_view_2d(ctx0, kv_enc.v, n_new, n_state,
+                        (   n_kv_ctx)*ggml_element_size(kv_enc.v),
+                        (il*n_kv_ctx)*ggml_element_size(kv_enc.v)*n_state + n_past*ggml_element_size(kv_enc.v));
+
+                ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcur, k));
+                ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcur, v));
+            }
+
+            struct ggml_tensor * Q =
+                ggml_permute(ctx0,
+                        ggml_reshape_3d(ctx0, Qcur, n_state/n_head, n_head, n_new),
+                        0, 2, 1, 3);
+
+            struct ggml_tensor * K =
+                ggml_view_3d(ctx0, kv_enc.k,
+                        n_state/n_head, n_ctx, n_head,
+                        ggml_element_size(kv_enc.k)*n_state,
+                        ggml_element_size(kv_enc.k)*n_state/n_head,
+                        ggml_element_size(kv_enc.k)*n_state*n_kv_ctx*il);
+
+            // K * Q
+            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+
+            struct ggml_tensor * KQ_scaled = ggml_scale(ctx0, KQ, KQscale);
+
+            struct ggml_tensor * KQ_masked = ggml_add(ctx0, KQ_scaled, KQ_mask);
+
+            struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ_masked);
+
+            struct ggml_tensor * V =
+                ggml_view_3d(ctx0, kv_enc.v,
+                        n_ctx, n_state/n_head, n_head,
+                        n_kv_ctx*ggml_element_size(kv_enc.v),
+                        n_kv_ctx*ggml_element_size(kv_enc.v)*n_state/n_head,
+                        n_kv_ctx*ggml_element_size(kv_enc.v)*n_state*il);
+
+            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+
+            struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+
+            cur = ggml_cpy(ctx0,
+                    KQV_merged,
+                    ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_new));
+        }
+
+        // projection
+        {
+            cur = ggml_mul_mat(ctx0,
+                    layer.attn_ln_1_w,
+                    cur);
+
+            cur = ggml_add(ctx0, cur, layer.attn_ln_1_b);
+        }
+
+        // add the input
+        cur = ggml_add(ctx0, cur, inpL);
+
+        struct ggml_tensor * inpFF = cur;
+
+        // feed-forward network
+        {
+            // norm
+            {
+                cur = ggml_norm(ctx0, inpFF, hparams.eps);
+
+                // cur = mlp_ln_w*cur + mlp_ln_b
+                cur = ggml_add(ctx0,
+                        ggml_mul(ctx0, cur, layer.mlp_ln_w),
+                        layer.mlp_ln_b);
+            }
+
+            // fully connected
+            cur = ggml_mul_mat(ctx0,
+                    layer.mlp_0_w,
+                    cur);
+
+            cur = ggml_add(ctx0, cur, layer.mlp_0_b);
+
+            // GELU activation
+            cur = ggml_gelu(ctx0, cur);
+
+            // projection
+            cur = ggml_mul_mat(ctx0,
+                    layer.mlp_1_w,
+                    cur);
+
+            cur = ggml_add(ctx0, cur, layer.mlp_1_b);
+        }
+
+        inpL = ggml_add(ctx0, cur, inpFF);
+    }
+
+    cur = inpL;
+
+    // norm
+    {
+        cur = ggml_norm(ctx0, cur, hparams.eps);
+
+        // cur = ln_f_g*cur + ln_f_b
+        cur = ggml_add(ctx0,
+                ggml_mul(ctx0, cur, model.e_ln_w),
+                model.e_ln_b);
+    }
+
+    // cross-attention memory of the new frames, then the memory of all frames is copied to kv_cross with the
+    // layout of a window of n_ctx frames
+    const float Kscale = pow(float(n_state) / n_head, -0.25);
+
+    for (int il = 0; il < hparams.n_text_layer; ++il) {
+        auto & layer = model.layers_decoder[il];
+
+        struct ggml_tensor * Kcross = ggml_mul_mat(ctx0,
+                layer.cross_attn_k_w,
+                cur);
+
+        Kcross = ggml_scale(ctx0, Kcross, Kscale);
+
+        struct ggml_tensor * Vcross = ggml_mul_mat(ctx0,
+                layer.cross_attn_v_w,
+                cur);
+
+        Vcross = ggml_add(ctx0,
+                    Vcross,
+                    layer.cross_attn_v_b);
+
+        Vcross = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcross, n_state, n_new));
+
+        {
+            struct ggml_tensor * k = ggml_view_1d(ctx0, kv_enc_cross.k, n_new*n_state, (ggml_element_size(kv_enc_cross.k)*n_state)*(il*n_kv_ctx + n_past));
+            struct ggml_tensor * v = ggml_view_2d(ctx0, kv_enc_cross.v, n_new, n_state,
+                    (   n_kv_ctx)*ggml_element_size(kv_enc_cross.v),
+                    (il*n_kv_ctx)*ggml_element_size(kv_enc_cross.v)*n_state + n_past*ggml_element_size(kv_enc_cross.v));
+
+            ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcross, k));
+            ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcross, v));
+        }
+
+        {
+            struct ggml_tensor * k_src = ggml_view_2d(ctx0, kv_enc_cross.k, n_state, n_ctx,
+                    ggml_element_size(kv_enc_cross.k)*n_state,
+                    ggml_element_size(kv_enc_cross.k)*n_state*(il*n_kv_ctx));
+            struct ggml_tensor * v_src = ggml_view_2d(ctx0, kv_enc_cross.v, n_ctx, n_state,
+                    (   n_kv_ctx)*ggml_element_size(kv_enc_cross.v),
+                    (il*n_kv_ctx)*ggml_element_size(kv_enc_cross.v)*n_state);
+
+            whisper_build_cross_store(ctx0, gf, wstate.kv_cross, k_src, v_src, il, n_ctx);
+        }
+    }
+
+    ggml_free(ctx0);
+
+    return gf;
+}
+
+static uint64_t whisper_encoder_cache_hash(const std::vector<float> & mel, int n_ctx) {
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ull ^ uint64_t(n_ctx);
+
+    const uint8_t * data = (const uint8_t *) mel.data();
+    const size_t    n    = mel.size()*sizeof(float);
+
+    for (size_t i = 0; i < n; ++i) {
+        hash = (hash ^ data[i]) * 1099511628211ull;
+    }
+
+    return hash;
+}
+
+static size_t whisper_encoder_cache_kv_size(const whisper_context & wctx, const ggml_tensor * t, int n_ctx) {
+    const auto & hparams = wctx.model.hparams;
+
+    return ggml_row_size(t->type, n_ctx*hparams.n_text_state)*hparams.n_text_layer;
+}
+
+// evicts the least recently used windows until max_size more bytes fit in the cache
+static void whisper_encoder_cache_evict(whisper_encoder_cache & cache, size_t size) {
+    while (!cache.entries.empty() && cache.size + size > cache.max_size) {
+        cache.size -= cache.entries.back().size();
+        cache.entries.pop_back();
+    }
+}
+
+// looks up the window of the mel spectrogram at mel_offset in the encoder cache of the context
+// on a hit the cross-attention memory is copied into the state and true is returned
+// the window is left in wstate.inp_mel for whisper_encoder_cache_store()
+static bool whisper_encoder_cache_load(whisper_context & wctx, whisper_state & wstate, int mel_offset) {
+    auto & cache = wctx.encoder_cache;
+
+    {
+        std::lock_guard<std::mutex> lock(cache.mutex);
+
+        if (cache.max_size == 0) {
+            return false;
+        }
+    }
+
+    const int n_ctx = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : wctx.model.hparams.n_audio_ctx;
+
+    whisper_get_mel_window(wstate.mel, mel_offset, 2*n_ctx, wstate.inp_mel);
+
+    const uint64_t hash = whisper_encoder_cache_hash(wstate.inp_mel, n_ctx);
+
+    std::lock_guard<std::mutex> lock(cache.mutex);
+
+    for (auto it = cache.entries.begin(); it != cache.entries.end(); ++it) {
+        if (it->hash != hash || it->n_ctx != n_ctx || it->mel != wstate.inp_mel) {
+            continue;
+        }
+
+        cache.entries.splice(cache.entries.begin(), cache.entries, it);
+
+        ggml_backend_tensor_set(wstate.kv_cross.k, it->k.data(), 0, it->k.size());
+        ggml_backend_tensor_set(wstate.kv_cross.v, it->v.data(), 0, it->v.size());
+
+        wstate.n_encoder_cache_hit++;
+
+        return true;
+    }
+
+    wstate.n_encoder_cache_miss++;
+
+    return false;
+}
+
+// adds the cross-attention memory just computed for the window in wstate.inp_mel to the encoder cache
+static void whisper_encoder_cache_store(whisper_context & wctx, whisper_state & wstate) {
+    auto & cache = wctx.encoder_cache;
+
+    {
+        std::lock_guard<std::mutex> lock(cache.mutex);
+
+        if (cache.max_size == 0) {
+            return;
+        }
+    }
+
+    const int n_ctx = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : wctx.model.hparams.n_audio_ctx;
+
+    whisper_encoder_cache::entry entry;
+
+    entry.n_ctx = n_ctx;
+    entry.mel   = wstate.inp_mel;
+    entry.hash  = whisper_encoder_cache_hash(entry.mel, n_ctx);
+
+    entry.k.resize(whisper_encoder_cache_kv_size(wctx, wstate.kv_cross.k, n_ctx));
+    entry.v.resize(whisper_encoder_cache_kv_size(wctx, wstate.kv_cross.v, whisper_kv_cross_v_stride(wstate.kv_cross.v, n_ctx)));
+
+    ggml_backend_tensor_get(wstate.kv_cross.k, entry.k.data(), 0, entry.k.size());
+    ggml_backend_tensor_get(wstate.kv_cross.v, entry.v.data(), 0, entry.v.size());
+
+    std::lock_guard<std::mutex> lock(cache.mutex);
+
+    if (entry.size() > cache.max_size) {
+        return;
+    }
+
+    whisper_encoder_cache_evict(cache, entry.size());
+
+    cache.size += entry.size();
+    cache.entries.push_front(std::move(entry));
+}
+
+// [EXPERIMENTAL] encodes the window at offset 0 with whisper_build_graph_encoder_incremental(), only the frames
+// after the last complete chunk of final mel frames encoded before are computed
+static bool whisper_encode_incremental(
+        whisper_context & wctx,
+          whisper_state & wstate,
+              const int   n_threads) {
+    const int n_ctx   = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : wctx.model.hparams.n_audio_ctx;
+    const int n_chunk = wstate.enc_chunk;
+
+    if (wstate.mel_clamp != wstate.enc_mel_clamp) {
+        wstate.n_enc_past = 0;
+    }
+
+    // at least one frame is computed, a partial chunk at the end is always computed again
+    const int n_past = std::min(wstate.n_enc_past, ((n_ctx - 1)/n_chunk)*n_chunk);
+
+    {
+        auto & alloc = wstate.alloc_enc_inc.alloc;
+
+        ggml_allocr_reset(alloc);
+
+        ggml_cgraph * gf = whisper_build_graph_encoder_incremental(wctx, wstate, n_past, n_ctx);
+
+        ggml_allocr_alloc_graph(alloc, gf);
+
+        if (!ggml_graph_compute_helper(wstate.backend, gf, n_threads)) {
+            wstate.n_enc_past = 0;
+            return false;
+        }
+    }
+
+    // encoder frame i is computed from the mel frames up to 2*i + 2, it is final once they are.
+    // the frames of complete chunks of final frames are kept for the next call
+    const int n_final = std::min(n_ctx, std::max(0, (wstate.n_mel_final - 1)/2));
+
+    wstate.n_enc_past    = (n_final/n_chunk)*n_chunk;
+    wstate.enc_mel_clamp = wstate.mel_clamp;
+
+    return true;
+}
+
+// grows the compute buffers of the conv, encoder and cross graphs to the tier of n_ctx frames.
+// they start at the smallest tier, so short audio_ctx never allocate the buffers of a full window
+static void whisper_alloc_audio_ctx(
+        whisper_context & wctx,
+          whisper_state & wstate,
+              const int   n_ctx) {
+    const int n_tier = std::min(GGML_PAD(n_ctx, WHISPER_AUDIO_CTX_TIER), wstate.n_max_audio_ctx);
+
+    if (n_tier <= wstate.n_audio_ctx_alloc) {
+        return;
+    }
+
+    // the graphs are built for exp_n_audio_ctx
+    const int exp_n_audio_ctx = wstate.exp_n_audio_ctx;
+
+    wstate.exp_n_audio_ctx = n_tier;
+
+    whisper_allocr_free(wstate.alloc_conv);
+    whisper_allocr_free(wstate.alloc_encode);
+    whisper_allocr_free(wstate.alloc_cross);
+
+    whisper_allocr_graph_init(wstate.alloc_conv, wctx.backend,
+            [&]() {
+                return whisper_build_graph_conv(wctx, wstate, 0);
+            });
+
+    if (!whisper_encode_external(wstate)) {
+        whisper_allocr_graph_init(wstate.alloc_encode, wctx.backend,
+                [&]() {
+                    return whisper_build_graph_encoder(wctx, wstate);
+                });
+    }
+
+    whisper_allocr_graph_init(wstate.alloc_cross, wctx.backend,
+            [&]() {
+                return whisper_build_graph_cross(wctx, wstate);
+            });
+
+    WHISPER_LOG_INFO("%s: compute buffers for audio_ctx = %d: conv %7.2f MB, encode %7.2f MB, cross %7.2f MB\n", __func__, n_tier,
+            whisper_allocr_size(wstate.alloc_conv) / 1e6, whisper_allocr_size(wstate.alloc_encode) / 1e6, whisper_allocr_size(wstate.alloc_cross) / 1e6);
+
+    whisper_allocr_graph_realloc(wstate.alloc_conv,   wctx.backend);
+    whisper_allocr_graph_realloc(wstate.alloc_encode, wctx.backend);
+    whisper_allocr_graph_realloc(wstate.alloc_cross,  wctx.backend);
+
+    wstate.exp_n_audio_ctx   = exp_n_audio_ctx;
+    wstate.n_audio_ctx_alloc = n_tier;
+}
+
+// evaluate the encoder with the given state
+//
+// given audio recording (more specifically, its log mel spectrogram), runs forward pass of the encoder
+// part of the transformer model and returns the encoded features
+//
+//   - wctx:      the model
+//   - wstate:     the state of the encoder
+//   - n_threads:  number of threads to use
+//   - mel_offset: offset in the mel spectrogram (i.e. audio offset)
+//
+static bool whisper_encode_internal(
+        whisper_context & wctx,
+          whisper_state & wstate,
+              const int   mel_offset,
+              const int   n_threads,
+ whisper_abort_callback   abort_callback,
+                   void * abort_callback_data) {
+    const int64_t t_start_us = ggml_time_us();
+
+    wstate.encoded_seek = -1;
+    wstate.prompt_kv.clear();
+
+    {
+        const int n_ctx = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : wctx.model.hparams.n_audio_ctx;
+
+        if (n_ctx > wstate.n_max_audio_ctx) {
+            WHISPER_LOG_ERROR("%s: audio_ctx is larger than the state was created for (%d > %d)\n", __func__, n_ctx, wstate.n_max_audio_ctx);
+            return false;
+        }
+    }
+
+    // only for spectrograms of whisper_pcm_to_mel_append_with_state(), other ones do not grow
+    if (wstate.enc_chunk > 0 && wstate.n_mel_final > 0 && mel_offset == 0) {
+        if (!whisper_encode_incremental(wctx, wstate, n_threads)) {
+            return false;
+        }
+
+        wstate.t_encode_us += ggml_time_us() - t_start_us;
+        wstate.n_encode++;
+
+        return !(abort_callback && abort_callback(abort_callback_data));
+    }
+
+    // the same window was encoded before, its cross-attention memory is copied from the cache
+    if (whisper_encoder_cache_load(wctx, wstate, mel_offset)) {
+        return !(abort_callback && abort_callback(abort_callback_data));
+    }
+
+    whisper_alloc_audio_ctx(wctx, wstate, wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : wctx.model.hparams.n_audio_ctx);
+
+    // conv
+    {
+        auto & alloc = wstate.alloc_conv.alloc;
+
+        ggml_allocr_reset(alloc);
+
+        ggml_cgraph * gf = whisper_build_graph_conv(wctx, wstate, mel_offset);
+
+        ggml_allocr_alloc_graph(alloc, gf);
+
+        if (!whisper_encode_external(wstate)) {
+            if (!ggml_graph_compute_helper(wstate.backend, gf, n_threads)) {
+                return false;
+            }
+        }
+    }
+
+    // encoder
+    if (!whisper_encode_external(wstate)) {
+        auto & alloc = wstate.alloc_encode.alloc;
+
+        ggml_allocr_reset(alloc);
+
+        ggml_cgraph * gf = whisper_build_graph_encoder(wctx, wstate);
+
+        ggml_allocr_alloc_graph(alloc, gf);
+
+        if (!ggml_graph_compute_helper(wstate.backend, gf, n_threads)) {
+            return false;
+        }
+    }
+
+    // cross
+    {
+        auto & alloc = wstate.alloc_cross.alloc;
+
+        ggml_allocr_reset(alloc);
+
+        ggml_cgraph * gf = whisper_build_graph_cross(wctx, wstate);
+
+        ggml_allocr_alloc_graph(alloc, gf);
+
+        if (!ggml_graph_compute_helper(wstate.backend, gf, n_threads)) {
+            return false;
+        }
+    }
+
+    whisper_encoder_cache_store(wctx, wstate);
+
+    wstate.t_encode_us += ggml_time_us() - t_start_us;
+    wstate.n_encode++;
+
+    return !(abort_callback && abort_callback(abort_callback_data));
+}
+
+// evaluate the encoder for a batch of states
+//
+// every state gets the cross-attention memory of the window of its mel spectrogram at mel_offsets[i], the same as
+// whisper_encode_internal() on each of them, but the matrix multiplications of all windows are done together
+//
+//   - wstates:     the states, all with the same exp_n_audio_ctx
+//   - mel_offsets: offset in the mel spectrogram of each state
+//   - n_batch:     number of states, at most WHISPER_MAX_ENCODE_BATCH
+//   - n_threads:   number of threads to use
+//
+static bool whisper_encode_batch_internal(
+        whisper_context & wctx,
+          whisper_state ** wstates,
+              const int * mel_offsets,
+              const int   n_batch,
+              const int   n_threads) {
+    const int64_t t_start_us = ggml_time_us();
+
+    whisper_state & wstate0 = *wstates[0];
+
+    const int n_ctx = wstate0.exp_n_audio_ctx > 0 ? wstate0.exp_n_audio_ctx : wctx.model.hparams.n_audio_ctx;
+
+    for (int b = 0; b < n_batch; ++b) {
+        wstates[b]->encoded_seek = -1;
+        wstates[b]->prompt_kv.clear();
+    }
+
+    // the compute buffer depends on the shape of the batch, it is kept as long as the shape does not change
+    if (wstate0.alloc_batch.alloc == nullptr || wstate0.n_batch_alloc != n_batch || wstate0.n_ctx_batch_alloc != n_ctx) {
+        whisper_allocr_free(wstate0.alloc_batch);
+
+        whisper_allocr_graph_init(wstate0.alloc_batch, wctx.backend,
+                [&]() {
+                    return whisper_build_graph_encoder_batch(wctx, wstates, mel_offsets, n_batch);
+                });
+
+        WHISPER_LOG_INFO("%s: compute buffer (batch of %d) = %7.2f MB\n", __func__, n_batch, whisper_allocr_size(wstate0.alloc_batch) / 1e6);
+
+        whisper_allocr_graph_realloc(wstate0.alloc_batch, wctx.backend);
+
+        wstate0.n_batch_alloc     = n_batch;
+        wstate0.n_ctx_batch_alloc = n_ctx;
+    }
+
+    {
+        auto & alloc = wstate0.alloc_batch.alloc;
+
+        ggml_allocr_reset(alloc);
+
+        ggml_cgraph * gf = whisper_build_graph_encoder_batch(wctx, wstates, mel_offsets, n_batch);
+
+        ggml_allocr_alloc_graph(alloc, gf);
+
+        if (!ggml_graph_compute_helper(wstate0.backend, gf, n_threads)) {
+            return false;
+        }
+    }
+
+    const int64_t t_batch_us = ggml_time_us() - t_start_us;
+
+    for (int b = 0; b < n_batch; ++b) {
+        wstates[b]->t_encode_us += t_batch_us/n_batch;
+        wstates[b]->n_encode++;
+
+        wstates[b]->encoded_seek  = mel_offsets[b];
+        wstates[b]->encoded_n_ctx = n_ctx;
+    }
+
+    return true;
+}
+
+// view of the columns [offset, offset + n) of a [n_state, n_tokens] tensor, the tokens of one batch
+static struct ggml_tensor * whisper_view_tokens(
+        struct ggml_context * ctx0,
+         struct ggml_tensor * cur,
+                  const int   offset,
+                  const int   n) {
+    if (offset == 0 && n == cur->ne[1]) {
+        return cur;
+    }
+
+    return ggml_view_2d(ctx0, cur, cur->ne[0], n, cur->nb[1], offset*cur->nb[1]);
+}
+
+// build the decoder graph for the batches of several states
+//
+// the tokens of all batches are concatenated, so the linear layers multiply the weights once with all of them.
+// the self-attention of the tokens of batches[i] uses the KV cache of wstates[i] and their cross-attention the
+// memory of the audio encoded in wstates[i]. the logits are in the same order as the tokens
+//
+//   - wstates:  the states, all different
+//   - batches:  batches[i] is decoded with wstates[i]
+//   - n_states: number of states
+//   - allocr:   allocator of the graph, sized for at most WHISPER_MAX_NODES*n_states nodes
+//
+static struct ggml_cgraph * whisper_build_graph_decoder(
+          whisper_context & wctx,
+           whisper_state ** wstates,
+    const whisper_batch  ** batches,
+                const int   n_states,
+           whisper_allocr & allocr) {
+    const auto & model   = wctx.model;
+    const auto & hparams = model.hparams;
+
+    ggml_allocr * alloc = allocr.alloc;
+
+    const int n_state = hparams.n_text_state;
+    const int n_head  = hparams.n_text_head;
+    const int n_layer = hparams.n_text_layer;
+
+    // position of the tokens of each batch in the graph and the part of the caches of its state they attend to
+    std::vector<int32_t> offsets(n_states);
+    std::vector<int32_t> n_kvs(n_states);
+    std::vector<int32_t> kv_heads(n_states);
+    std::vector<int32_t> n_audio_ctxs(n_states);
+
+    int n_tokens = 0;
+
+    for (int s = 0; s < n_states; ++s) {
+        const auto & kv_self = wstates[s]->kv_self;
+
+        WHISPER_ASSERT(!!kv_self.ctx);
+
+        const int n_ctx = kv_self.size;
+
+        offsets[s] = n_tokens;
+        n_tokens  += batches[s]->n_tokens;
+
+        n_kvs[s]    = ggml_allocr_is_measure(alloc) ? n_ctx                          : kv_self.n;
+        kv_heads[s] = ggml_allocr_is_measure(alloc) ? n_ctx - batches[s]->n_tokens : kv_self.head;
+
+        // measure with the largest context, the buffer is then large enough for any audio_ctx set later
+        n_audio_ctxs[s] = ggml_allocr_is_measure(alloc) ? wstates[s]->n_max_audio_ctx : wstates[s]->exp_n_audio_ctx > 0 ? wstates[s]->exp_n_audio_ctx : hparams.n_audio_ctx;
+    }
+
+    //WHISPER_LOG_DEBUG("%s: n_past = %d, n_tokens = %d, n_audio_ctx = %d, n_ctx = %d\n", __func__, n_past, n_tokens, n_audio_ctx, n_ctx);
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ allocr.meta.size(),
+        /*.mem_buffer =*/ allocr.meta.data(),
+        /*.no_alloc   =*/ true,
+    };
+
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    ggml_cgraph * gf = ggml_new_graph_custom(ctx0, WHISPER_MAX_NODES*n_states, false);
+
+    struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
     ggml_allocr_alloc(alloc, embd);
 
     if (!ggml_allocr_is_measure(alloc)) {
-        ggml_backend_tensor_set(embd, batch.token, 0, n_tokens*ggml_element_size(embd));
+        for (int s = 0; s < n_states; ++s) {
+            ggml_backend_tensor_set(embd, batches[s]->token, offsets[s]*ggml_element_size(embd), batches[s]->n_tokens*ggml_element_size(embd));
+        }
     }
 
     struct ggml_tensor * position = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
     ggml_allocr_alloc(alloc, position);
 
     if (!ggml_allocr_is_measure(alloc)) {
-        for (int i = 0; i < n_tokens; ++i) {
-            const int32_t val = batch.pos[i];
-            ggml_backend_tensor_set(position, &val, i*sizeof(int32_t), sizeof(int32_t));
+        for (int s = 0; s < n_states; ++s) {
+            for (int i = 0; i < batches[s]->n_tokens; ++i) {
+                const int32_t val = batches[s]->pos[i];
+                ggml_backend_tensor_set(position, &val, (offsets[s] + i)*sizeof(int32_t), sizeof(int32_t));
+            }
         }
     }
 
     const float KQscale = pow(float(n_state)/n_head, -0.25);
 
-    struct ggml_tensor * KQ_mask = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_kv, n_tokens, 1);
-    ggml_allocr_alloc(alloc, KQ_mask);
+    std::vector<struct ggml_tensor *> KQ_masks(n_states);
 
-    if (!ggml_allocr_is_measure(alloc)) {
-        wstate.inp_mask.resize(n_kv*n_tokens);
+    for (int s = 0; s < n_states; ++s) {
+        auto & wstate  = *wstates[s];
+        auto & kv_self = wstate.kv_self;
 
-        float * data = wstate.inp_mask.data();
-        memset(data, 0, ggml_nbytes(KQ_mask));
+        const auto & batch = *batches[s];
 
-        for (int h = 0; h < 1; ++h) {
-            for (int j = 0; j < n_tokens; ++j) {
-                const whisper_pos    pos    = batch.pos[j];
-                const whisper_seq_id seq_id = batch.seq_id[j][0];
+        const int n_kv        = n_kvs[s];
+        const int n_tokens_kv = batch.n_tokens;
 
-                for (int i = 0; i < n_kv; ++i) {
-                    if (!kv_self.cells[i].has_seq_id(seq_id) || kv_self.cells[i].pos > pos) {
-                        data[h*(n_kv*n_tokens) + j*n_kv + i] = -INFINITY;
+        struct ggml_tensor * KQ_mask = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_kv, n_tokens_kv, 1);
+        ggml_allocr_alloc(alloc, KQ_mask);
+
+        if (!ggml_allocr_is_measure(alloc)) {
+            wstate.inp_mask.resize(n_kv*n_tokens_kv);
+
+            float * data = wstate.inp_mask.data();
+            memset(data, 0, ggml_nbytes(KQ_mask));
+
+            for (int h = 0; h < 1; ++h) {
+                for (int j = 0; j < n_tokens_kv; ++j) {
+                    const whisper_pos    pos    = batch.pos[j];
+                    const whisper_seq_id seq_id = batch.seq_id[j][0];
+
+                    for (int i = 0; i < n_kv; ++i) {
+                        if (!kv_self.cells[i].has_seq_id(seq_id) || kv_self.cells[i].pos > pos) {
+                            data[h*(n_kv*n_tokens_kv) + j*n_kv + i] = -INFINITY;
+                        }
                     }
                 }
             }
+
+            ggml_backend_tensor_set(KQ_mask, wstate.inp_mask.data(), 0, ggml_nelements(KQ_mask)*sizeof(float));
         }
 
-        ggml_backend_tensor_set(KQ_mask, wstate.inp_mask.data(), 0, ggml_nelements(KQ_mask)*sizeof(float));
+        KQ_masks[s] = KQ_mask;
+    }
+
+    // a quantized cache holds the values of a token in one row like the keys, they are dequantized with
+    // ggml_get_rows() and transposed when they are read
+    const bool kv_self_v_trans = !ggml_is_quantized(wstates[0]->kv_self.v->type);
+
+    std::vector<struct ggml_tensor *> KV_rows(n_states);
+
+    if (!kv_self_v_trans) {
+        for (int s = 0; s < n_states; ++s) {
+            const int n_kv = n_kvs[s];
+
+            struct ggml_tensor * rows = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_kv);
+            ggml_allocr_alloc(alloc, rows);
+
+            if (!ggml_allocr_is_measure(alloc)) {
+                std::vector<int32_t> data(n_kv);
+                for (int i = 0; i < n_kv; ++i) {
+                    data[i] = i;
+                }
+
+                ggml_backend_tensor_set(rows, data.data(), 0, ggml_nbytes(rows));
+            }
+
+            KV_rows[s] = rows;
+        }
     }
 
     // token encoding + position encoding
@@ -2250,82 +3317,127 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
 
         // self-attention
         {
-            struct ggml_tensor * Qcur = ggml_mul_mat(ctx0,
+            struct ggml_tensor * Qcur_all = ggml_mul_mat(ctx0,
                     layer.attn_q_w,
                     cur);
 
-            Qcur = ggml_add(ctx0,
-                        Qcur,
+            Qcur_all = ggml_add(ctx0,
+                        Qcur_all,
                         layer.attn_q_b);
 
-            Qcur = ggml_scale(ctx0, Qcur, KQscale);
+            Qcur_all = ggml_scale(ctx0, Qcur_all, KQscale);
 
             // note: no bias for Key
-            struct ggml_tensor * Kcur = ggml_mul_mat(ctx0,
+            struct ggml_tensor * Kcur_all = ggml_mul_mat(ctx0,
                     layer.attn_k_w,
                     cur);
 
-            Kcur = ggml_scale(ctx0, Kcur, KQscale);
+            Kcur_all = ggml_scale(ctx0, Kcur_all, KQscale);
 
-            // store key and value to memory
-            {
-                struct ggml_tensor * Vcur = ggml_mul_mat(ctx0,
-                        layer.attn_v_w,
-                        cur);
+            struct ggml_tensor * Vcur_all = ggml_mul_mat(ctx0,
+                    layer.attn_v_w,
+                    cur);
 
-                Vcur = ggml_add(ctx0,
-                            Vcur,
-                            layer.attn_v_b);
+            Vcur_all = ggml_add(ctx0,
+                        Vcur_all,
+                        layer.attn_v_b);
 
-                Vcur = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcur, n_state, n_tokens));
+            // the outputs of the batches are written into their columns of one tensor
+            if (n_states > 1) {
+                cur = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_tokens);
+            }
 
-                struct ggml_tensor * k = ggml_view_1d(ctx0, kv_self.k, n_tokens*n_state, (ggml_element_size(kv_self.k)*n_state)*(il*n_ctx + kv_head));
-                struct ggml_tensor * v = ggml_view_2d(ctx0, kv_self.v, n_tokens, n_state,
-                        (   n_ctx)*ggml_element_size(kv_self.v),
-                        (il*n_ctx)*ggml_element_size(kv_self.v)*n_state + kv_head*ggml_element_size(kv_self.v));
+            for (int s = 0; s < n_states; ++s) {
+                auto & kv_self = wstates[s]->kv_self;
 
-                ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcur, k));
-                ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcur, v));
-            }
+                const int n_ctx      = kv_self.size;
+                const int n_tokens_s = batches[s]->n_tokens;
+                const int n_kv       = n_kvs[s];
+                const int kv_head    = kv_heads[s];
 
-            // ------
+                struct ggml_tensor * Qcur = whisper_view_tokens(ctx0, Qcur_all, offsets[s], n_tokens_s);
+                struct ggml_tensor * Kcur = whisper_view_tokens(ctx0, Kcur_all, offsets[s], n_tokens_s);
 
-            struct ggml_tensor * Q =
-                ggml_permute(ctx0,
-                        ggml_reshape_3d(ctx0, Qcur, n_state/n_head, n_head, n_tokens),
-                        0, 2, 1, 3);
+                // store key and value to memory
+                {
+                    struct ggml_tensor * Vcur = whisper_view_tokens(ctx0, Vcur_all, offsets[s], n_tokens_s);
 
-            struct ggml_tensor * K =
-                ggml_view_3d(ctx0, kv_self.k,
-                        n_state/n_head, n_kv, n_head,
-                        ggml_element_size(kv_self.k)*n_state,
-                        ggml_element_size(kv_self.k)*n_state/n_head,
-                        ggml_element_size(kv_self.k)*n_state*n_ctx*il);
+                    struct ggml_tensor * k = ggml_view_1d(ctx0, kv_self.k, n_tokens_s*n_state, ggml_row_size(kv_self.k->type, n_state)*(il*n_ctx + kv_head));
+                    struct ggml_tensor * v = nullptr;
 
-            // K * Q
-            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+                    if (kv_self_v_trans) {
+                        Vcur = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcur, n_state, n_tokens_s));
+
+                        v = ggml_view_2d(ctx0, kv_self.v, n_tokens_s, n_state,
+                                (   n_ctx)*ggml_element_size(kv_self.v),
+                                (il*n_ctx)*ggml_element_size(kv_self.v)*n_state + kv_head*ggml_element_size(kv_self.v));
+                    } else {
+                        v = ggml_view_1d(ctx0, kv_self.v, n_tokens_s*n_state, ggml_row_size(kv_self.v->type, n_state)*(il*n_ctx + kv_head));
+                    }
 
-            //struct ggml_tensor * KQ_scaled = ggml_scale(ctx0, KQ, KQ_scale);
+                    ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcur, k));
+                    ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcur, v));
+                }
 
-            //struct ggml_tensor * KQ_masked = ggml_diag_mask_inf(ctx0, KQ, n_past);
-            struct ggml_tensor * KQ_masked = ggml_add(ctx0, KQ, KQ_mask);
+                // ------
 
-            struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ_masked);
+                struct ggml_tensor * Q =
+                    ggml_permute(ctx0,
+                            ggml_reshape_3d(ctx0, Qcur, n_state/n_head, n_head, n_tokens_s),
+                            0, 2, 1, 3);
 
-            struct ggml_tensor * V =
-                ggml_view_3d(ctx0, kv_self.v,
-                        n_kv, n_state/n_head, n_head,
-                        n_ctx*ggml_element_size(kv_self.v),
-                        n_ctx*ggml_element_size(kv_self.v)*n_state/n_head,
-                        n_ctx*ggml_element_size(kv_self.v)*n_state*il);
+                struct ggml_tensor * K =
+                    ggml_view_3d(ctx0, kv_self.k,
+                            n_state/n_head, n_kv, n_head,
+                            ggml_row_size(kv_self.k->type, n_state),
+                            ggml_row_size(kv_self.k->type, n_state/n_head),
+                            ggml_row_size(kv_self.k->type, n_state)*n_ctx*il);
 
-            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+                // K * Q
+                struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
 
-            struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+                //struct ggml_tensor * KQ_scaled = ggml_scale(ctx0, KQ, KQ_scale);
 
-            cur = ggml_cpy(ctx0,
-                    KQV_merged,
-                    ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_tokens));
+                //struct ggml_tensor * KQ_masked = ggml_diag_mask_inf(ctx0, KQ, n_past);
+                struct ggml_tensor * KQ_masked = ggml_add(ctx0, KQ, KQ_masks[s]);
+
+                struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ_masked);
+
+                struct ggml_tensor * V = nullptr;
+
+                if (kv_self_v_trans) {
+                    V = ggml_view_3d(ctx0, kv_self.v,
+                            n_kv, n_state/n_head, n_head,
+                            n_ctx*ggml_element_size(kv_self.v),
+                            n_ctx*ggml_element_size(kv_self.v)*n_state/n_head,
+                            n_ctx*ggml_element_size(kv_self.v)*n_state*il);
+                } else {
+                    V = ggml_view_2d(ctx0, kv_self.v,
+                            n_state, n_ctx,
+                            ggml_row_size(kv_self.v->type, n_state),
+                            ggml_row_size(kv_self.v->type, n_state)*n_ctx*il);
+
+                    V = ggml_get_rows(ctx0, V, KV_rows[s]);
+
+                    V = ggml_cont(ctx0,
+                            ggml_permute(ctx0,
+                                ggml_reshape_3d(ctx0, V, n_state/n_head, n_head, n_kv),
+                                1, 2, 0, 3));
+                }
+
+                struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+
+                struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+
+                if (n_states == 1) {
+                    cur = ggml_cpy(ctx0,
+                            KQV_merged,
+                            ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_tokens));
+                } else {
+                    cur = ggml_set_inplace(ctx0, cur, KQV_merged,
+                            ggml_element_size(cur)*n_state/n_head, cur->nb[1], cur->nb[2], offsets[s]*cur->nb[1]);
+                }
+            }
         }
 
         // projection
@@ -2356,70 +3468,95 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
 
         // cross-attention
         {
-            struct ggml_tensor * Qcur = ggml_mul_mat(ctx0,
+            struct ggml_tensor * Qcur_all = ggml_mul_mat(ctx0,
                     layer.cross_attn_q_w,
                     cur);
 
-            Qcur = ggml_add(ctx0,
-                        Qcur,
+            Qcur_all = ggml_add(ctx0,
+                        Qcur_all,
                         layer.cross_attn_q_b);
 
-            Qcur = ggml_scale(ctx0, Qcur, KQscale);
+            Qcur_all = ggml_scale(ctx0, Qcur_all, KQscale);
 
-            // Kcross is already scaled
-            struct ggml_tensor * Kcross =
-                ggml_view_3d(ctx0, wstate.kv_cross.k,
-                        n_state/n_head, n_audio_ctx, n_head,
-                        ggml_element_size(wstate.kv_cross.k)*n_state,
-                        ggml_element_size(wstate.kv_cross.k)*n_state/n_head,
-                        ggml_element_size(wstate.kv_cross.k)*n_state*n_audio_ctx*il);
+            if (n_states > 1) {
+                cur = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_tokens);
+            }
 
-            //struct ggml_tensor * Vcross =
-            //    ggml_reshape_3d(ctx0,
-            //            ggml_view_1d(ctx0, wstate.kv_cross.v, n_audio_ctx*n_state, il*n_audio_ctx*ggml_element_size(wstate.kv_cross.v)*n_state),
-            //            n_state/n_head, n_head, n_audio_ctx);
+            for (int s = 0; s < n_states; ++s) {
+                auto & kv_cross = wstates[s]->kv_cross;
 
-            //struct ggml_tensor * V_trans =
-            //    ggml_cpy(ctx0,
-            //            ggml_permute(ctx0, Vcross, 1, 2, 0, 3),
-            //            ggml_new_tensor_3d(ctx0, Vcross->type, n_audio_ctx, n_state/n_head, n_head));
+                const int n_tokens_s  = batches[s]->n_tokens;
+                const int n_audio_ctx = n_audio_ctxs[s];
 
-            struct ggml_tensor * V =
-                ggml_view_3d(ctx0, wstate.kv_cross.v,
-                        n_audio_ctx, n_state/n_head, n_head,
-                        n_audio_ctx*ggml_element_size(wstate.kv_cross.v),
-                        n_audio_ctx*ggml_element_size(wstate.kv_cross.v)*n_state/n_head,
-                        n_audio_ctx*ggml_element_size(wstate.kv_cross.v)*n_state*il);
+                struct ggml_tensor * Qcur = whisper_view_tokens(ctx0, Qcur_all, offsets[s], n_tokens_s);
 
-            // ------
+                // Kcross is already scaled
+                struct ggml_tensor * Kcross =
+                    ggml_view_3d(ctx0, kv_cross.k,
+                            n_state/n_head, n_audio_ctx, n_head,
+                            ggml_row_size(kv_cross.k->type, n_state),
+                            ggml_row_size(kv_cross.k->type, n_state/n_head),
+                            ggml_row_size(kv_cross.k->type, n_state)*n_audio_ctx*il);
 
-            struct ggml_tensor * Q =
-                ggml_permute(ctx0,
-                        ggml_reshape_3d(ctx0, Qcur, n_state/n_head, n_head, n_tokens),
-                        0, 2, 1, 3);
+                //struct ggml_tensor * Vcross =
+                //    ggml_reshape_3d(ctx0,
+                //            ggml_view_1d(ctx0, kv_cross.v, n_audio_ctx*n_state, il*n_audio_ctx*ggml_element_size(kv_cross.v)*n_state),
+                //            n_state/n_head, n_head, n_audio_ctx);
 
-            // K * Q
-            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, Kcross, Q);
+                //struct ggml_tensor * V_trans =
+                //    ggml_cpy(ctx0,
+                //            ggml_permute(ctx0, Vcross, 1, 2, 0, 3),
+                //            ggml_new_tensor_3d(ctx0, Vcross->type, n_audio_ctx, n_state/n_head, n_head));
 
-            //struct ggml_tensor * KQ_scaled =
-            //    ggml_scale(ctx0,
-            //            KQ,
-            //            ggml_new_f32(ctx0, 1.0f/sqrt(float(n_state)/n_head))
-            //            );
+                const int n_audio_ctx_v = whisper_kv_cross_v_stride(kv_cross.v, n_audio_ctx);
 
-            // no masking for cross-attention
-            //struct ggml_tensor * KQ_masked = ggml_diag_mask_inf(ctx0, KQ_scaled, n_past);
+                struct ggml_tensor * V =
+                    ggml_view_3d(ctx0, kv_cross.v,
+                            n_audio_ctx_v, n_state/n_head, n_head,
+                            ggml_row_size(kv_cross.v->type, n_audio_ctx_v),
+                            ggml_row_size(kv_cross.v->type, n_audio_ctx_v)*n_state/n_head,
+                            ggml_row_size(kv_cross.v->type, n_audio_ctx_v)*n_state*il);
 
-            struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ);
+                // ------
 
-            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+                struct ggml_tensor * Q =
+                    ggml_permute(ctx0,
+                            ggml_reshape_3d(ctx0, Qcur, n_state/n_head, n_head, n_tokens_s),
+                            0, 2, 1, 3);
 
-            struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+                // K * Q
+                struct ggml_tensor * KQ = ggml_mul_mat(ctx0, Kcross, Q);
 
-            // cur = KQV_merged.contiguous().view(n_state, n_tokens)
-            cur = ggml_cpy(ctx0,
-                    KQV_merged,
-                    ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_tokens));
+                //struct ggml_tensor * KQ_scaled =
+                //    ggml_scale(ctx0,
+                //            KQ,
+                //            ggml_new_f32(ctx0, 1.0f/sqrt(float(n_state)/n_head))
+                //            );
+
+                // no masking for cross-attention
+                //struct ggml_tensor * KQ_masked = ggml_diag_mask_inf(ctx0, KQ_scaled, n_past);
+
+                struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ);
+
+                // the padding of the quantized values gets zero weight
+                if (n_audio_ctx_v != n_audio_ctx) {
+                    KQ_soft_max = ggml_pad(ctx0, KQ_soft_max, n_audio_ctx_v - n_audio_ctx, 0, 0, 0);
+                }
+
+                struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+
+                struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+
+                // cur = KQV_merged.contiguous().view(n_state, n_tokens)
+                if (n_states == 1) {
+                    cur = ggml_cpy(ctx0,
+                            KQV_merged,
+                            ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_tokens));
+                } else {
+                    cur = ggml_set_inplace(ctx0, cur, KQV_merged,
+                            ggml_element_size(cur)*n_state/n_head, cur->nb[1], cur->nb[2], offsets[s]*cur->nb[1]);
+                }
+            }
         }
 
         // projection
@@ -2490,10 +3627,38 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
                 model.d_ln_b);
     }
 
-    // compute logits only for the last token
-    // comment this line to compute logits for all n_tokens
-    // might be useful in the future
-    //cur = ggml_view_2d(ctx0, cur, cur->ne[0], 1, cur->nb[1], (cur->ne[1] - 1)*cur->nb[1]);
+    // compute logits only for the tokens of the batches that ask for them, at most one per decoder.
+    // the prompt asks for its last token, so the buffer does not grow with its length
+    {
+        std::vector<int32_t> out_ids;
+
+        for (int s = 0; s < n_states; ++s) {
+            const auto & batch = *batches[s];
+
+            if (ggml_allocr_is_measure(alloc)) {
+                for (int i = 0; i < std::min(batch.n_tokens, wstates[s]->n_max_decoders); ++i) {
+                    out_ids.push_back(offsets[s] + i);
+                }
+            } else {
+                for (int i = 0; i < batch.n_tokens; ++i) {
+                    if (batch.logits[i]) {
+                        out_ids.push_back(offsets[s] + i);
+                    }
+                }
+            }
+        }
+
+        if ((int) out_ids.size() < n_tokens) {
+            struct ggml_tensor * inp_out_ids = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, out_ids.size());
+            ggml_allocr_alloc(alloc, inp_out_ids);
+
+            if (!ggml_allocr_is_measure(alloc)) {
+                ggml_backend_tensor_set(inp_out_ids, out_ids.data(), 0, ggml_nbytes(inp_out_ids));
+            }
+
+            cur = ggml_get_rows(ctx0, cur, inp_out_ids);
+        }
+    }
 
     struct ggml_tensor * logits = ggml_mul_mat(ctx0, model.d_te, cur);
 
@@ -2504,6 +3669,16 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
     return gf;
 }
 
+static struct ggml_cgraph * whisper_build_graph_decoder(
+         whisper_context & wctx,
+         whisper_state   & wstate,
+     const whisper_batch & batch) {
+    whisper_state       * wstates[1] = { &wstate };
+    const whisper_batch * batches[1] = { &batch  };
+
+    return whisper_build_graph_decoder(wctx, wstates, batches, 1, wstate.alloc_decode);
+}
+
 // evaluate the decoder
 //
 // given text prompt + audio features -> computes the logits for the next token
@@ -2563,12 +3738,13 @@ static bool whisper_decode_internal(
         }
     }
 
+    // the rows of the logits tensor are the tokens with batch.logits set
     logits_out.resize(n_tokens*n_vocab);
-    for (int i = 0; i < n_tokens; i++) {
+    for (int i = 0, j = 0; i < n_tokens; i++) {
         if (batch.logits[i] == 0) {
             continue;
         }
-        ggml_backend_tensor_get(logits, logits_out.data() + (n_vocab*i), sizeof(float)*(n_vocab*i), sizeof(float)*n_vocab);
+        ggml_backend_tensor_get(logits, logits_out.data() + (n_vocab*i), sizeof(float)*(n_vocab*j++), sizeof(float)*n_vocab);
     }
 
     if (batch.n_tokens > 1) {
@@ -2580,18 +3756,135 @@ static bool whisper_decode_internal(
         //        wstate.get_buf_max_mem(3)/1e6);
     }
 
-    if (batch.n_tokens == 1) {
-        wstate.t_decode_us += ggml_time_us() - t_start_us;
-        wstate.n_decode++;
-    } else if (batch.n_tokens < 16) {
-        wstate.t_batchd_us += ggml_time_us() - t_start_us;
-        wstate.n_batchd += n_tokens;
-    } else {
-        wstate.t_prompt_us += ggml_time_us() - t_start_us;
-        wstate.n_prompt += n_tokens;
+    if (batch.n_tokens == 1) {
+        wstate.t_decode_us += ggml_time_us() - t_start_us;
+        wstate.n_decode++;
+    } else if (batch.n_tokens < 16) {
+        wstate.t_batchd_us += ggml_time_us() - t_start_us;
+        wstate.n_batchd += n_tokens;
+    } else {
+        wstate.t_prompt_us += ggml_time_us() - t_start_us;
+        wstate.n_prompt += n_tokens;
+    }
+
+    return !(abort_callback && abort_callback(abort_callback_data));
+}
+
+// evaluate the decoder for the batches of several states
+//
+// computes the same logits as whisper_decode_internal() on each of them, but the matrix multiplications of all
+// tokens are done together, so the weights are read once per step instead of once per state
+//
+//   - wstates:   the states, all different, at most WHISPER_MAX_DECODE_BATCH
+//   - batches:   batches[i] is decoded with wstates[i]
+//   - n_states:  number of states
+//   - n_threads: number of threads to use
+//
+static bool whisper_decode_batch_internal(
+        whisper_context & wctx,
+          whisper_state ** wstates,
+   const whisper_batch ** batches,
+              const int   n_states,
+              const int   n_threads) {
+    const int64_t t_start_us = ggml_time_us();
+
+    const auto & model   = wctx.model;
+    const auto & hparams = model.hparams;
+
+    const int n_vocab = hparams.n_vocab;
+
+    whisper_state & wstate0 = *wstates[0];
+
+    int n_tokens_max = 0;
+
+    // find KV slot for the batch of each state
+    for (int s = 0; s < n_states; ++s) {
+        auto & kv_self = wstates[s]->kv_self;
+
+        if (!whisper_kv_cache_find_slot(kv_self, *batches[s])) {
+            return false;
+        }
+
+        kv_self.n = whisper_kv_cache_cell_max(kv_self);
+
+        n_tokens_max = std::max(n_tokens_max, batches[s]->n_tokens);
+    }
+
+    // the compute buffer is measured with n_tokens_max tokens in every batch and kept while the batches are not larger
+    if (wstate0.alloc_decode_batch.alloc == nullptr || wstate0.n_decode_batch_alloc != n_states || wstate0.n_tokens_decode_batch_alloc < n_tokens_max) {
+        whisper_allocr_free(wstate0.alloc_decode_batch);
+
+        whisper_allocr_graph_init(wstate0.alloc_decode_batch, wctx.backend,
+                [&]() {
+                    std::vector<whisper_batch>         measure(n_states);
+                    std::vector<const whisper_batch *> measure_ptrs(n_states);
+
+                    for (int s = 0; s < n_states; ++s) {
+                        measure[s] = *batches[s];
+                        measure[s].n_tokens = n_tokens_max;
+                        measure_ptrs[s] = &measure[s];
+                    }
+
+                    return whisper_build_graph_decoder(wctx, wstates, measure_ptrs.data(), n_states, wstate0.alloc_decode_batch);
+                }, WHISPER_MAX_NODES*n_states);
+
+        WHISPER_LOG_INFO("%s: compute buffer (batch of %d) = %7.2f MB\n", __func__, n_states, whisper_allocr_size(wstate0.alloc_decode_batch) / 1e6);
+
+        whisper_allocr_graph_realloc(wstate0.alloc_decode_batch, wctx.backend);
+
+        wstate0.n_decode_batch_alloc        = n_states;
+        wstate0.n_tokens_decode_batch_alloc = n_tokens_max;
+    }
+
+    struct ggml_tensor * logits;
+
+    // decoder
+    {
+        auto & alloc = wstate0.alloc_decode_batch.alloc;
+
+        ggml_allocr_reset(alloc);
+
+        ggml_cgraph * gf = whisper_build_graph_decoder(wctx, wstates, batches, n_states, wstate0.alloc_decode_batch);
+
+        ggml_allocr_alloc_graph(alloc, gf);
+
+        logits = gf->nodes[gf->n_nodes - 1];
+
+        if (!ggml_graph_compute_helper(wstate0.backend, gf, n_threads)) {
+            return false;
+        }
+    }
+
+    const int64_t t_batch_us = ggml_time_us() - t_start_us;
+
+    for (int s = 0, j = 0; s < n_states; ++s) {
+        auto & wstate = *wstates[s];
+
+        const auto & batch = *batches[s];
+
+        const int n_tokens = batch.n_tokens;
+
+        wstate.logits.resize(n_tokens*n_vocab);
+        for (int i = 0; i < n_tokens; i++) {
+            if (batch.logits[i] == 0) {
+                continue;
+            }
+            ggml_backend_tensor_get(logits, wstate.logits.data() + (n_vocab*i), sizeof(float)*(n_vocab*j++), sizeof(float)*n_vocab);
+        }
+
+        if (n_tokens == 1) {
+            wstate.t_decode_us += t_batch_us/n_states;
+            wstate.n_decode++;
+        } else if (n_tokens < 16) {
+            wstate.t_batchd_us += t_batch_us/n_states;
+            wstate.n_batchd += n_tokens;
+        } else {
+            wstate.t_prompt_us += t_batch_us/n_states;
+            wstate.n_prompt += n_tokens;
+        }
     }
 
-    return !(abort_callback && abort_callback(abort_callback_data));
+    return true;
 }
 
 //  500 -> 00:05.000
@@ -2709,6 +4002,366 @@ static void fft(const std::vector<float> & in, std::vector<float> & out) {
     }
 }
 
+// SIMD lanes used by the planned FFT butterflies
+struct whisper_f32x1 {
+    static constexpr int width = 1;
+
+    float v;
+
+    whisper_f32x1() = default;
+    whisper_f32x1(float x) : v(x) {}
+
+    static whisper_f32x1 load(const float * p) { return whisper_f32x1(*p); }
+    void store(float * p) const { *p = v; }
+
+    whisper_f32x1 operator+(whisper_f32x1 b) const { return v + b.v; }
+    whisper_f32x1 operator-(whisper_f32x1 b) const { return v - b.v; }
+    whisper_f32x1 operator*(whisper_f32x1 b) const { return v * b.v; }
+
+    // a*b + c
+    static whisper_f32x1 fmadd(whisper_f32x1 a, whisper_f32x1 b, whisper_f32x1 c) { return a.v*b.v + c.v; }
+
+    float reduce() const { return v; }
+};
+
+#if defined(__SSE2__) || defined(_M_X64)
+static inline float whisper_reduce_f32x4(__m128 v) {
+    v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+    v = _mm_add_ss(v, _mm_shuffle_ps(v, v, 1));
+    return _mm_cvtss_f32(v);
+}
+#endif
+
+#if defined(__AVX__)
+struct whisper_f32xn {
+    static constexpr int width = 8;
+
+    __m256 v;
+
+    whisper_f32xn() = default;
+    whisper_f32xn(__m256 x) : v(x) {}
+    whisper_f32xn(float x) : v(_mm256_set1_ps(x)) {}
+
+    static whisper_f32xn load(const float * p) { return _mm256_loadu_ps(p); }
+    void store(float * p) const { _mm256_storeu_ps(p, v); }
+
+    whisper_f32xn operator+(whisper_f32xn b) const { return _mm256_add_ps(v, b.v); }
+    whisper_f32xn operator-(whisper_f32xn b) const { return _mm256_sub_ps(v, b.v); }
+    whisper_f32xn operator*(whisper_f32xn b) const { return _mm256_mul_ps(v, b.v); }
+
+    static whisper_f32xn fmadd(whisper_f32xn a, whisper_f32xn b, whisper_f32xn c) {
+#if defined(__FMA__)
+        return _mm256_fmadd_ps(a.v, b.v, c.v);
+#else
+        return _mm256_add_ps(_mm256_mul_ps(a.v, b.v), c.v);
+#endif
+    }
+
+    float reduce() const { return whisper_reduce_f32x4(_mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1))); }
+};
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+struct whisper_f32xn {
+    static constexpr int width = 4;
+
+    float32x4_t v;
+
+    whisper_f32xn() = default;
+    whisper_f32xn(float32x4_t x) : v(x) {}
+    whisper_f32xn(float x) : v(vdupq_n_f32(x)) {}
+
+    static whisper_f32xn load(const float * p) { return vld1q_f32(p); }
+    void store(float * p) const { vst1q_f32(p, v); }
+
+    whisper_f32xn operator+(whisper_f32xn b) const { return vaddq_f32(v, b.v); }
+    whisper_f32xn operator-(whisper_f32xn b) const { return vsubq_f32(v, b.v); }
+    whisper_f32xn operator*(whisper_f32xn b) const { return vmulq_f32(v, b.v); }
+
+    static whisper_f32xn fmadd(whisper_f32xn a, whisper_f32xn b, whisper_f32xn c) {
+#if defined(__aarch64__) || defined(_M_ARM64)
+        return vfmaq_f32(c.v, a.v, b.v);
+#else
+        return vmlaq_f32(c.v, a.v, b.v);
+#endif
+    }
+
+    float reduce() const {
+#if defined(__aarch64__) || defined(_M_ARM64)
+        return vaddvq_f32(v);
+#else
+        const float32x2_t s = vadd_f32(vget_low_f32(v), vget_high_f32(v));
+        return vget_lane_f32(vpadd_f32(s, s), 0);
+#endif
+    }
+};
+#elif defined(__SSE2__) || defined(_M_X64)
+struct whisper_f32xn {
+    static constexpr int width = 4;
+
+    __m128 v;
+
+    whisper_f32xn() = default;
+    whisper_f32xn(__m128 x) : v(x) {}
+    whisper_f32xn(float x) : v(_mm_set1_ps(x)) {}
+
+    static whisper_f32xn load(const float * p) { return _mm_loadu_ps(p); }
+    void store(float * p) const { _mm_storeu_ps(p, v); }
+
+    whisper_f32xn operator+(whisper_f32xn b) const { return _mm_add_ps(v, b.v); }
+    whisper_f32xn operator-(whisper_f32xn b) const { return _mm_sub_ps(v, b.v); }
+    whisper_f32xn operator*(whisper_f32xn b) const { return _mm_mul_ps(v, b.v); }
+
+    static whisper_f32xn fmadd(whisper_f32xn a, whisper_f32xn b, whisper_f32xn c) { return _mm_add_ps(_mm_mul_ps(a.v, b.v), c.v); }
+
+    float reduce() const { return whisper_reduce_f32x4(v); }
+};
+#else
+using whisper_f32xn = whisper_f32x1;
+#endif
+
+static inline float whisper_dot_f32(const float * x, const float * y, int n) {
+    whisper_f32xn acc(0.0f);
+
+    int k = 0;
+    for (; k + whisper_f32xn::width <= n; k += whisper_f32xn::width) {
+        acc = whisper_f32xn::fmadd(whisper_f32xn::load(x + k), whisper_f32xn::load(y + k), acc);
+    }
+
+    float sum = acc.reduce();
+    for (; k < n; k++) {
+        sum += x[k]*y[k];
+    }
+
+    return sum;
+}
+
+// in-place forward DFT of R complex values (R = 2, 3, 4 or 5)
+template <int R, typename V>
+static inline void fft_butterfly(V * re, V * im) {
+    switch (R) {
+        case 2:
+            {
+                const V r0 = re[0], i0 = im[0];
+                re[0] = r0 + re[1]; im[0] = i0 + im[1];
+                re[1] = r0 - re[1]; im[1] = i0 - im[1];
+            } break;
+        case 3:
+            {
+                const V c = -0.5f;
+                const V s = 0.86602540378f; // sin(2*pi/3)
+                const V t1r = re[1] + re[2], t1i = im[1] + im[2];
+                const V t2r = (re[1] - re[2])*s, t2i = (im[1] - im[2])*s;
+                const V mr = re[0] + t1r*c, mi = im[0] + t1i*c;
+                re[0] = re[0] + t1r; im[0] = im[0] + t1i;
+                re[1] = mr + t2i; im[1] = mi - t2r;
+                re[2] = mr - t2i; im[2] = mi + t2r;
+            } break;
+        case 4:
+            {
+                const V t0r = re[0] + re[2], t0i = im[0] + im[2];
+                const V t1r = re[0] - re[2], t1i = im[0] - im[2];
+                const V t2r = re[1] + re[3], t2i = im[1] + im[3];
+                const V t3r = re[1] - re[3], t3i = im[1] - im[3];
+                re[0] = t0r + t2r; im[0] = t0i + t2i;
+                re[2] = t0r - t2r; im[2] = t0i - t2i;
+                re[1] = t1r + t3i; im[1] = t1i - t3r;
+                re[3] = t1r - t3i; im[3] = t1i + t3r;
+            } break;
+        case 5:
+            {
+                const V c1 =  0.30901699437f; // cos(2*pi/5)
+                const V c2 = -0.80901699437f; // cos(4*pi/5)
+                const V s1 =  0.95105651630f; // sin(2*pi/5)
+                const V s2 =  0.58778525229f; // sin(4*pi/5)
+                const V t1r = re[1] + re[4], t1i = im[1] + im[4];
+                const V t2r = re[2] + re[3], t2i = im[2] + im[3];
+                const V t3r = re[1] - re[4], t3i = im[1] - im[4];
+                const V t4r = re[2] - re[3], t4i = im[2] - im[3];
+                const V m1r = re[0] + t1r*c1 + t2r*c2, m1i = im[0] + t1i*c1 + t2i*c2;
+                const V m2r = re[0] + t1r*c2 + t2r*c1, m2i = im[0] + t1i*c2 + t2i*c1;
+                const V n1r = t3r*s1 + t4r*s2, n1i = t3i*s1 + t4i*s2;
+                const V n2r = t3r*s2 - t4r*s1, n2i = t3i*s2 - t4i*s1;
+                re[0] = re[0] + t1r + t2r; im[0] = im[0] + t1i + t2i;
+                re[1] = m1r + n1i; im[1] = m1i - n1r;
+                re[4] = m1r - n1i; im[4] = m1i + n1r;
+                re[2] = m2r + n2i; im[2] = m2i - n2r;
+                re[3] = m2r - n2i; im[3] = m2i + n2r;
+            } break;
+    }
+}
+
+// butterflies of one decimation-in-frequency Stockham stage for lanes q .. q + V::width
+template <int R, typename V>
+static inline void fft_stage_block(int m, int s, int p, int q, const float * tw_re, const float * tw_im,
+                                   const float * xr, const float * xi, float * yr, float * yi) {
+    const int r = R;
+
+    V re[R];
+    V im[R];
+    for (int k = 0; k < r; k++) {
+        re[k] = V::load(xr + q + s*(p + k*m));
+        im[k] = V::load(xi + q + s*(p + k*m));
+    }
+
+    fft_butterfly<R>(re, im);
+
+    re[0].store(yr + q + s*r*p);
+    im[0].store(yi + q + s*r*p);
+    for (int j = 1; j < r; j++) {
+        const V wr = tw_re[j - 1];
+        const V wi = tw_im[j - 1];
+        (re[j]*wr - im[j]*wi).store(yr + q + s*(r*p + j));
+        (re[j]*wi + im[j]*wr).store(yi + q + s*(r*p + j));
+    }
+}
+
+// one Stockham stage of radix R, x and y hold m*R*s complex values
+template <int R>
+static void fft_stage(int m, int s, const float * tw_re, const float * tw_im,
+                      const float * xr, const float * xi, float * yr, float * yi) {
+    for (int p = 0; p < m; p++) {
+        int q = 0;
+        for (; q + whisper_f32xn::width <= s; q += whisper_f32xn::width) {
+            fft_stage_block<R, whisper_f32xn>(m, s, p, q, tw_re, tw_im, xr, xi, yr, yi);
+        }
+        for (; q < s; q++) {
+            fft_stage_block<R, whisper_f32x1>(m, s, p, q, tw_re, tw_im, xr, xi, yr, yi);
+        }
+        tw_re += R - 1;
+        tw_im += R - 1;
+    }
+}
+
+// FFT plan for a real frame of size n, computed as a complex FFT of size n/2
+// the complex FFT is a mixed radix (2, 3, 4, 5) Stockham transform on split real/imaginary buffers
+struct whisper_fft_plan {
+    int n = 0;
+    int m = 0; // 0 if n/2 has other prime factors
+
+    std::vector<int> radix;
+
+    // twiddles of every stage, [p][j - 1] for p < m/r
+    std::vector<float> tw_re;
+    std::vector<float> tw_im;
+
+    // exp(-2*pi*i*k/n) for k <= n/2, used to split the half size transform
+    std::vector<float> post_re;
+    std::vector<float> post_im;
+
+    explicit whisper_fft_plan(int n_fft) : n(n_fft) {
+        if (n % 2 != 0) {
+            return;
+        }
+
+        int rest = n/2;
+        for (int r : { 4, 2, 3, 5 }) {
+            while (rest % r == 0) {
+                radix.push_back(r);
+                rest /= r;
+            }
+        }
+        if (rest != 1) {
+            return;
+        }
+
+        m = n/2;
+
+        int len = m;
+        for (int r : radix) {
+            for (int p = 0; p < len/r; p++) {
+                for (int j = 1; j < r; j++) {
+                    const double theta = 2*M_PI*j*p/len;
+                    tw_re.push_back(cos(theta));
+                    tw_im.push_back(-sin(theta));
+                }
+            }
+            len /= r;
+        }
+
+        for (int k = 0; k <= m; k++) {
+            const double theta = 2*M_PI*k/n;
+            post_re.push_back(cos(theta));
+            post_im.push_back(-sin(theta));
+        }
+    }
+};
+
+static const whisper_fft_plan * whisper_fft_get_plan(int n) {
+    // the frame sizes of the regular and the phase vocoder mel spectrogram
+    static const whisper_fft_plan plan_1x(WHISPER_N_FFT);
+    static const whisper_fft_plan plan_2x(2*WHISPER_N_FFT);
+
+    if (n == plan_1x.n && plan_1x.m > 0) {
+        return &plan_1x;
+    }
+    if (n == plan_2x.n && plan_2x.m > 0) {
+        return &plan_2x;
+    }
+
+    return nullptr;
+}
+
+// per thread buffers, so that no allocations happen per frame
+struct whisper_fft_scratch {
+    std::vector<float> in;   // windowed frame
+    std::vector<float> out;  // power spectrum (complex output of fft() without a plan)
+    std::vector<float> work; // 2 complex buffers of n/2 values
+
+    explicit whisper_fft_scratch(int n) : in(n, 0.0f), out(2*n, 0.0f), work(2*n, 0.0f) {}
+};
+
+// power spectrum |X[k]|^2, k <= n/2, of the real frame in scratch.in
+static void fft_power(const whisper_fft_plan & plan, whisper_fft_scratch & scratch) {
+    const int m = plan.m;
+
+    float * xr = scratch.work.data();
+    float * xi = xr + m;
+    float * yr = xi + m;
+    float * yi = yr + m;
+
+    // pack the even and odd samples as one complex signal of half the size
+    for (int k = 0; k < m; k++) {
+        xr[k] = scratch.in[2*k + 0];
+        xi[k] = scratch.in[2*k + 1];
+    }
+
+    const float * tw_re = plan.tw_re.data();
+    const float * tw_im = plan.tw_im.data();
+
+    int len = m;
+    int s   = 1;
+    for (int r : plan.radix) {
+        const int mr = len/r;
+        switch (r) {
+            case 2: fft_stage<2>(mr, s, tw_re, tw_im, xr, xi, yr, yi); break;
+            case 3: fft_stage<3>(mr, s, tw_re, tw_im, xr, xi, yr, yi); break;
+            case 4: fft_stage<4>(mr, s, tw_re, tw_im, xr, xi, yr, yi); break;
+            case 5: fft_stage<5>(mr, s, tw_re, tw_im, xr, xi, yr, yi); break;
+        }
+        tw_re += mr*(r - 1);
+        tw_im += mr*(r - 1);
+        std::swap(xr, yr);
+        std::swap(xi, yi);
+        len = mr;
+        s  *= r;
+    }
+
+    // X[k] = (Z[k] + conj(Z[m - k]))/2 - i/2*exp(-2*pi*i*k/n)*(Z[k] - conj(Z[m - k]))
+    for (int k = 0; k <= m; k++) {
+        const int k0 = k % m;
+        const int k1 = (m - k) % m;
+
+        const float er = 0.5f*(xr[k0] + xr[k1]);
+        const float ei = 0.5f*(xi[k0] - xi[k1]);
+        const float or_ = 0.5f*(xi[k0] + xi[k1]);
+        const float oi = -0.5f*(xr[k0] - xr[k1]);
+
+        const float re = er + plan.post_re[k]*or_ - plan.post_im[k]*oi;
+        const float im = ei + plan.post_re[k]*oi + plan.post_im[k]*or_;
+
+        scratch.out[k] = re*re + im*im;
+    }
+}
+
 static bool hann_window(int length, bool periodic, std::vector<float> & output) {
     if (output.size() < static_cast<size_t>(length)) {
         output.resize(length);
@@ -2724,28 +4377,26 @@ static bool hann_window(int length, bool periodic, std::vector<float> & output)
     return true;
 }
 
-static void log_mel_spectrogram_worker_thread(int ith, const std::vector<float> & hann, const std::vector<float> & samples,
-                                              int n_samples, int frame_size, int frame_step, int n_threads,
-                                              const whisper_filters & filters, whisper_mel & mel) {
-    std::vector<float> fft_in(frame_size, 0.0);
-    std::vector<float> fft_out(2 * frame_step);
-    // make sure n_fft == 1 + (WHISPER_N_FFT / 2), bin_0 to bin_nyquist
-    int n_fft = 1 + (frame_size / 2);
-    int i = ith;
-
-    // calculate FFT only when fft_in are not all zero
-    for (; i < std::min(n_samples / frame_step + 1, mel.n_len); i += n_threads) {
-        const int offset = i * frame_step;
+// log10 mel power of a single frame, samples past n_valid are treated as zeros
+// returns the largest value written to out
+static float log_mel_spectrogram_frame(const std::vector<float> & hann, const float * frame, int n_valid, int frame_size,
+                                      const whisper_filters & filters, int n_mel, const whisper_fft_plan * plan,
+                                      whisper_fft_scratch & scratch, float * out, int out_stride) {
+    std::vector<float> & fft_in  = scratch.in;
+    std::vector<float> & fft_out = scratch.out;
 
-        // apply Hanning window (~10% faster)
-        for (int j = 0; j < std::min(frame_size, n_samples - offset); j++) {
-            fft_in[j] = hann[j] * samples[offset + j];
-        }
-        // fill the rest with zeros
-        if (n_samples - offset < frame_size) {
-            std::fill(fft_in.begin() + (n_samples - offset), fft_in.end(), 0.0);
-        }
+    // apply Hanning window (~10% faster)
+    for (int j = 0; j < std::min(frame_size, n_valid); j++) {
+        fft_in[j] = hann[j] * frame[j];
+    }
+    // fill the rest with zeros
+    if (n_valid < frame_size) {
+        std::fill(fft_in.begin() + n_valid, fft_in.end(), 0.0);
+    }
 
+    if (plan) {
+        fft_power(*plan, scratch);
+    } else {
         // FFT
         fft(fft_in, fft_out);
 
@@ -2754,34 +4405,47 @@ static void log_mel_spectrogram_worker_thread(int ith, const std::vector<float>
         for (int j = 0; j < frame_size; j++) {
             fft_out[j] = (fft_out[2 * j + 0] * fft_out[2 * j + 0] + fft_out[2 * j + 1] * fft_out[2 * j + 1]);
         }
+    }
 
-        // mel spectrogram
-        for (int j = 0; j < mel.n_mel; j++) {
-            double sum = 0.0;
-
-            // unroll loop (suggested by GH user @lunixbochs)
-            int k = 0;
-            for (k = 0; k < n_fft - 3; k += 4) {
-                sum +=
-                        fft_out[k + 0] * filters.data[j * n_fft + k + 0] +
-                        fft_out[k + 1] * filters.data[j * n_fft + k + 1] +
-                        fft_out[k + 2] * filters.data[j * n_fft + k + 2] +
-                        fft_out[k + 3] * filters.data[j * n_fft + k + 3];
-            }
+    // mel spectrogram, only over the non-zero weights of each filter
+    float mmax = -1e20f;
+    for (int j = 0; j < n_mel; j++) {
+        const int k0 = filters.start[j];
+        const int k1 = filters.end[j];
 
-            // handle n_fft remainder
-            for (; k < n_fft; k++) {
-                sum += fft_out[k] * filters.data[j * n_fft + k];
-            }
+        const float sum = whisper_dot_f32(fft_out.data() + k0, filters.data.data() + j * filters.n_fft + k0, k1 - k0);
+        const float value = log10f(std::max(sum, 1e-10f));
 
-            sum = log10(std::max(sum, 1e-10));
+        out[j * out_stride] = value;
+        mmax = std::max(mmax, value);
+    }
 
-            mel.data[j * mel.n_len + i] = sum;
-        }
+    return mmax;
+}
+
+static void log_mel_spectrogram_worker_thread(int ith, const std::vector<float> & hann, const std::vector<float> & samples,
+                                              int n_samples, int frame_size, int frame_step, int n_threads,
+                                              const whisper_filters & filters, const whisper_fft_plan * plan, whisper_mel & mel,
+                                              float & mmax) {
+    whisper_fft_scratch scratch(frame_size);
+    int i = ith;
+
+    // track the maximum while the frames are computed, so the normalization needs a single pass
+    mmax = -1e20f;
+
+    // calculate FFT only when fft_in are not all zero
+    for (; i < std::min(n_samples / frame_step + 1, mel.n_len); i += n_threads) {
+        const int offset = i * frame_step;
+
+        mmax = std::max(mmax, log_mel_spectrogram_frame(hann, samples.data() + offset, n_samples - offset, frame_size,
+                                                        filters, mel.n_mel, plan, scratch, mel.data.data() + i, mel.n_len));
     }
 
     // Otherwise fft_out are all zero
-    double sum = log10(1e-10);
+    const float sum = log10f(1e-10f);
+    if (i < mel.n_len) {
+        mmax = std::max(mmax, sum);
+    }
     for (; i < mel.n_len; i += n_threads) {
         for (int j = 0; j < mel.n_mel; j++) {
             mel.data[j * mel.n_len + i] = sum;
@@ -2804,6 +4468,11 @@ static bool log_mel_spectrogram(
               whisper_mel & mel) {
     const int64_t t_start_us = ggml_time_us();
 
+    // the cross-attention memory no longer matches the spectrogram
+    wstate.encoded_seek = -1;
+    wstate.n_enc_past   = 0;
+    wstate.n_mel_final  = 0;
+
     // Hanning window (Use cosf to eliminate difference)
     // ref: https://pytorch.org/docs/stable/generated/torch.hann_window.html
     // ref: https://github.com/openai/whisper/blob/main/whisper/audio.py#L147
@@ -2834,40 +4503,19 @@ static bool log_mel_spectrogram(
     mel.n_len_org = 1 + (n_samples + stage_2_pad - frame_size) / frame_step;
     mel.data.resize(mel.n_mel * mel.n_len);
 
+    const whisper_fft_plan * plan = whisper_fft_get_plan(frame_size);
 
-    {
-        std::vector<std::thread> workers(n_threads - 1);
-        for (int iw = 0; iw < n_threads - 1; ++iw) {
-            workers[iw] = std::thread(
-                    log_mel_spectrogram_worker_thread, iw + 1, std::cref(hann), samples_padded,
-                    n_samples + stage_2_pad, frame_size, frame_step, n_threads,
-                    std::cref(filters), std::ref(mel));
-        }
-
-        // main thread
-        log_mel_spectrogram_worker_thread(0, hann, samples_padded, n_samples + stage_2_pad, frame_size, frame_step, n_threads, filters, mel);
+    std::vector<float> mmax_thread(n_threads);
 
-        for (int iw = 0; iw < n_threads - 1; ++iw) {
-            workers[iw].join();
-        }
-    }
+    whisper_parallel_for(n_threads, [&](int ith) {
+        log_mel_spectrogram_worker_thread(ith, hann, samples_padded, n_samples + stage_2_pad, frame_size, frame_step, n_threads, filters, plan, mel, mmax_thread[ith]);
+    });
 
     // clamping and normalization
-    double mmax = -1e20;
-    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
-        if (mel.data[i] > mmax) {
-            mmax = mel.data[i];
-        }
-    }
-
-    mmax -= 8.0;
+    const float mmax = *std::max_element(mmax_thread.begin(), mmax_thread.end()) - 8.0f;
 
     for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
-        if (mel.data[i] < mmax) {
-            mel.data[i] = mmax;
-        }
-
-        mel.data[i] = (mel.data[i] + 4.0)/4.0;
+        mel.data[i] = (std::max(mel.data[i], mmax) + 4.0f)/4.0f;
     }
 
     wstate.t_mel_us += ggml_time_us() - t_start_us;
@@ -2886,6 +4534,134 @@ static bool log_mel_spectrogram(
     return true;
 }
 
+static void log_mel_spectrogram_cache_worker_thread(int ith, whisper_mel_cache & cache, int i0, int i1, int n_threads,
+                                                    const whisper_filters & filters, float & mmax_final, float & mmax_tail) {
+    const int frame_size = WHISPER_N_FFT;
+    const int frame_step = WHISPER_HOP_LENGTH;
+    const int n_samples  = cache.samples.size();
+    const int n_final    = cache.n_frames;
+
+    const whisper_fft_plan * plan = whisper_fft_get_plan(frame_size);
+
+    std::vector<float> frame(frame_size);
+    whisper_fft_scratch scratch(frame_size);
+
+    mmax_final = -1e20f;
+    mmax_tail  = -1e20f;
+
+    for (int i = i0 + ith; i < i1; i += n_threads) {
+        // gather the frame from the reflect padded signal, zeros after the last sample
+        for (int j = 0; j < frame_size; j++) {
+            const int k = i * frame_step + j - frame_size / 2;
+            if (k < 0) {
+                frame[j] = -k < n_samples ? cache.samples[-k] : 0.0f;
+            } else {
+                frame[j] = k < n_samples ? cache.samples[k] : 0.0f;
+            }
+        }
+
+        if (i < n_final) {
+            float * out = cache.data.data() + i * cache.n_mel;
+            mmax_final = std::max(mmax_final, log_mel_spectrogram_frame(cache.hann, frame.data(), frame_size, frame_size, filters, cache.n_mel, plan, scratch, out, 1));
+        } else {
+            float * out = cache.tail.data() + (i - n_final) * cache.n_mel;
+            mmax_tail = std::max(mmax_tail, log_mel_spectrogram_frame(cache.hann, frame.data(), frame_size, frame_size, filters, cache.n_mel, plan, scratch, out, 1));
+        }
+    }
+}
+
+// same result as log_mel_spectrogram() on all cached samples, but only computes the frames that are not final yet
+static bool log_mel_spectrogram_append(
+              whisper_state & wstate,
+              const float * samples,
+              const int   n_samples,
+              const int   n_threads,
+              const whisper_filters & filters,
+              whisper_mel_cache & cache,
+              whisper_mel & mel) {
+    const int64_t t_start_us = ggml_time_us();
+
+    // the cross-attention memory no longer matches the spectrogram
+    wstate.encoded_seek = -1;
+
+    const int frame_size = WHISPER_N_FFT;
+    const int frame_step = WHISPER_HOP_LENGTH;
+    const int n_mel      = filters.n_mel;
+
+    if (cache.n_mel != n_mel || cache.hann.empty()) {
+        wstate.n_enc_past = 0;
+
+        cache.n_mel    = n_mel;
+        cache.n_frames = 0;
+        cache.mmax     = -1e20f;
+        cache.data.clear();
+        hann_window(frame_size, true, cache.hann);
+    }
+
+    cache.samples.insert(cache.samples.end(), samples, samples + n_samples);
+
+    const int n_total = cache.samples.size();
+
+    // frames that overlap the audio, the ones after it are all zero
+    const int n_audio = (n_total + frame_size / 2) / frame_step + 1;
+
+    // frames that do not overlap the zero padding anymore
+    const int n_final = n_total > frame_size / 2 ? std::min((n_total - frame_size / 2) / frame_step + 1, n_audio) : 0;
+
+    const int i0 = cache.n_frames;
+
+    cache.n_frames = n_final;
+
+    // the frames before n_final keep their values, up to the clamping to the largest value
+    wstate.n_mel_final = n_final;
+    cache.data.resize(n_final * n_mel);
+    cache.tail.resize((n_audio - n_final) * n_mel);
+
+    std::vector<float> mmax_final(n_threads);
+    std::vector<float> mmax_tail(n_threads);
+
+    whisper_parallel_for(n_threads, [&](int ith) {
+        log_mel_spectrogram_cache_worker_thread(ith, cache, i0, n_audio, n_threads, filters, mmax_final[ith], mmax_tail[ith]);
+    });
+
+    cache.mmax = std::max(cache.mmax, *std::max_element(mmax_final.begin(), mmax_final.end()));
+
+    mel.n_mel     = n_mel;
+    mel.n_len     = (n_total + WHISPER_SAMPLE_RATE * WHISPER_CHUNK_SIZE) / frame_step;
+    mel.n_len_org = 1 + (n_total + frame_size / 2 - frame_size) / frame_step;
+    mel.data.resize(mel.n_mel * mel.n_len);
+
+    const int n_len_audio = std::min(n_audio, mel.n_len);
+    const float zero_frame = log10f(1e-10f);
+
+    // clamping and normalization
+    float mmax = std::max(cache.mmax, *std::max_element(mmax_tail.begin(), mmax_tail.end()));
+    if (n_len_audio < mel.n_len) {
+        mmax = std::max(mmax, zero_frame);
+    }
+
+    mmax -= 8.0f;
+
+    wstate.mel_clamp = mmax;
+
+    for (int j = 0; j < n_mel; j++) {
+        float * dst = mel.data.data() + j * mel.n_len;
+
+        int i = 0;
+        for (; i < std::min(n_final, n_len_audio); i++) {
+            dst[i] = (std::max(cache.data[i * n_mel + j], mmax) + 4.0f)/4.0f;
+        }
+        for (; i < n_len_audio; i++) {
+            dst[i] = (std::max(cache.tail[(i - n_final) * n_mel + j], mmax) + 4.0f)/4.0f;
+        }
+        std::fill(dst + i, dst + mel.n_len, (std::max(zero_frame, mmax) + 4.0f)/4.0f);
+    }
+
+    wstate.t_mel_us += ggml_time_us() - t_start_us;
+
+    return true;
+}
+
 // split text into tokens
 //
 // ref: https://github.com/openai/gpt-2/blob/a74da5d99abaaba920de8131d64da2862a8f213b/src/encoder.py#L53
@@ -2998,18 +4774,29 @@ static std::string whisper_openvino_get_path_cache(std::string path_bin) {
 }
 #endif
 
-struct whisper_state * whisper_init_state(whisper_context * ctx) {
+struct whisper_state * whisper_init_state_with_params(whisper_context * ctx, struct whisper_state_params params) {
     fill_sin_cos_table();
 
+    const auto & hparams = ctx->model.hparams;
+
+    if (params.n_max_decoders > WHISPER_MAX_DECODERS) {
+        WHISPER_LOG_ERROR("%s: too many decoders requested (%d), max = %d\n", __func__, params.n_max_decoders, WHISPER_MAX_DECODERS);
+        return nullptr;
+    }
+
     whisper_state * state = new whisper_state;
 
+    state->n_max_decoders  = params.n_max_decoders  > 0 ? params.n_max_decoders                             : WHISPER_MAX_DECODERS;
+    state->n_max_text_ctx  = params.n_max_text_ctx  > 0 ? std::min(params.n_max_text_ctx,  hparams.n_text_ctx)  : hparams.n_text_ctx;
+    state->n_max_audio_ctx = params.n_max_audio_ctx > 0 ? std::min(params.n_max_audio_ctx, hparams.n_audio_ctx) : hparams.n_audio_ctx;
+
     state->backend = whisper_backend_init(ctx->params);
 
-    // at this point, we don't know yet how many decoders will be used, so we overallocate 3x ctx
-    // in theory, there can be a case where this is not enough, but in practice it should always be enough
-    const int factor = 3;
+    // the decoders share the prompt and whisper_full() lets each of them generate up to half of the text context.
+    // with many decoders this is capped at 3x the context, in practice it is always enough
+    const int n_kv_self = std::min(state->n_max_text_ctx + (state->n_max_decoders - 1)*(state->n_max_text_ctx/2), 3*state->n_max_text_ctx);
 
-    if (!kv_cache_init(ctx->model.hparams, state->kv_self, ctx->backend, ctx->itype, factor*ctx->model.hparams.n_text_ctx)) {
+    if (!kv_cache_init(ctx->model.hparams, state->kv_self, ctx->backend, ctx->kvtype, n_kv_self)) {
         WHISPER_LOG_ERROR("%s: kv_cache_init() failed for self-attention cache\n", __func__);
         delete state;
         return nullptr;
@@ -3020,7 +4807,8 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
         WHISPER_LOG_INFO("%s: kv self size  = %7.2f MB\n", __func__, memory_size / 1e6);
     }
 
-    if (!kv_cache_init(ctx->model.hparams, state->kv_cross, ctx->backend, ctx->itype, ctx->model.hparams.n_audio_ctx)) {
+    // the transposed values of a quantized cache are stored in rows of whole blocks
+    if (!kv_cache_init(ctx->model.hparams, state->kv_cross, ctx->backend, ctx->kvtype, GGML_PAD(state->n_max_audio_ctx, ggml_blck_size(ctx->kvtype)))) {
         WHISPER_LOG_ERROR("%s: kv_cache_init() failed for cross-attention cache\n", __func__);
         delete state;
         return nullptr;
@@ -3049,58 +4837,29 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
     }
 #endif
 
-    state->logits.reserve(ctx->vocab.n_vocab * ctx->model.hparams.n_text_ctx);
+    state->logits.reserve(ctx->vocab.n_vocab * state->n_max_text_ctx);
 
-    state->batch = whisper_batch_init(ctx->model.hparams.n_text_ctx, WHISPER_MAX_DECODERS);
+    state->batch = whisper_batch_init(std::max(state->n_max_text_ctx, state->n_max_decoders), state->n_max_decoders);
 
     // TAGS: WHISPER_DECODER_INIT
-    state->decoders[0].sequence.tokens.reserve(ctx->model.hparams.n_text_ctx);
+    state->decoders[0].sequence.tokens.reserve(state->n_max_text_ctx);
 
     state->decoders[0].probs.reserve    (ctx->vocab.n_vocab);
     state->decoders[0].logits.reserve   (ctx->vocab.n_vocab);
     state->decoders[0].logprobs.reserve (ctx->vocab.n_vocab);
     state->decoders[0].logits_id.reserve(ctx->model.hparams.n_vocab);
 
-    state->decoders[0].rng = std::mt19937(0);
-
-    // conv allocator
-    {
-        whisper_allocr_graph_init(state->alloc_conv, ctx->backend,
-                [&]() {
-                    return whisper_build_graph_conv(*ctx, *state, 0);
-                });
-
-        WHISPER_LOG_INFO("%s: compute buffer (conv)   = %7.2f MB\n", __func__, whisper_allocr_size(state->alloc_conv) / 1e6);
-    }
-
-    // encoder allocator
-    if (!whisper_encode_external(*state)) {
-        whisper_allocr_graph_init(state->alloc_encode, ctx->backend,
-                [&]() {
-                    return whisper_build_graph_encoder(*ctx, *state);
-                });
-
-        WHISPER_LOG_INFO("%s: compute buffer (encode) = %7.2f MB\n", __func__, whisper_allocr_size(state->alloc_encode) / 1e6);
-    }
-
-    // cross allocator
-    {
-        whisper_allocr_graph_init(state->alloc_cross, ctx->backend,
-                [&]() {
-                    return whisper_build_graph_cross(*ctx, *state);
-                });
+    state->decoders[0].rng = std::mt19937(0);
 
-        WHISPER_LOG_INFO("%s: compute buffer (cross)  = %7.2f MB\n", __func__, whisper_allocr_size(state->alloc_cross) / 1e6);
-    }
+    // the conv, encoder and cross allocators start at the smallest tier and grow with the audio_ctx encoded
+    whisper_alloc_audio_ctx(*ctx, *state, 1);
 
     // decoder allocator
     {
         whisper_allocr_graph_init(state->alloc_decode, ctx->backend,
                 [&]() {
-                    const auto & hparams = ctx->model.hparams;
-
                     // TODO: make sure this is the worst-case scenario
-                    const int n_tokens = hparams.n_text_ctx;
+                    const int n_tokens = state->n_max_text_ctx;
                     const int n_past   = 0;
 
                     whisper_batch_prep_legacy(state->batch, nullptr, n_tokens, n_past, 0);
@@ -3111,14 +4870,15 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
         WHISPER_LOG_INFO("%s: compute buffer (decode) = %7.2f MB\n", __func__, whisper_allocr_size(state->alloc_decode) / 1e6);
     }
 
-    whisper_allocr_graph_realloc(state->alloc_conv,   ctx->backend);
-    whisper_allocr_graph_realloc(state->alloc_encode, ctx->backend);
-    whisper_allocr_graph_realloc(state->alloc_cross,  ctx->backend);
     whisper_allocr_graph_realloc(state->alloc_decode, ctx->backend);
 
     return state;
 }
 
+struct whisper_state * whisper_init_state(whisper_context * ctx) {
+    return whisper_init_state_with_params(ctx, whisper_state_default_params());
+}
+
 int whisper_ctx_init_openvino_encoder(
         struct whisper_context * ctx,
                     const char * model_path,
@@ -3171,13 +4931,198 @@ int whisper_ctx_init_openvino_encoder(
 struct whisper_context_params whisper_context_default_params() {
     struct whisper_context_params result = {
         /*.use_gpu    =*/ true,
+        /*.use_mmap   =*/ false,
+        /*.type_kv    =*/ GGML_TYPE_F16,
+    };
+    return result;
+}
+
+struct whisper_state_params whisper_state_default_params() {
+    struct whisper_state_params result = {
+        /*.n_max_decoders  =*/ WHISPER_MAX_DECODERS,
+        /*.n_max_text_ctx  =*/ 0,
+        /*.n_max_audio_ctx =*/ 0,
     };
     return result;
 }
 
+// read-only mapping of a model file
+// the loader copies the weights out of it, so the pages that were already consumed can be dropped
+// from the resident set and the peak memory stays at about one copy of the model
+struct whisper_mmap {
+    uint8_t * addr = nullptr;
+    size_t    size = 0;
+
+#if defined(_WIN32)
+    HANDLE hfile = INVALID_HANDLE_VALUE;
+    HANDLE hmap  = NULL;
+#endif
+
+    bool open(const char * path) {
+#if defined(_WIN32)
+        const int n_wide = MultiByteToWideChar(CP_UTF8, 0, path, -1, nullptr, 0);
+        std::vector<wchar_t> wpath(std::max(n_wide, 1));
+        MultiByteToWideChar(CP_UTF8, 0, path, -1, wpath.data(), n_wide);
+
+        hfile = CreateFileW(wpath.data(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (hfile == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+
+        LARGE_INTEGER file_size;
+        if (!GetFileSizeEx(hfile, &file_size) || file_size.QuadPart == 0) {
+            close();
+            return false;
+        }
+        size = (size_t) file_size.QuadPart;
+
+        hmap = CreateFileMappingW(hfile, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (hmap == NULL) {
+            close();
+            return false;
+        }
+
+        addr = (uint8_t *) MapViewOfFile(hmap, FILE_MAP_READ, 0, 0, 0);
+        if (addr == nullptr) {
+            close();
+            return false;
+        }
+#else
+        const int fd = ::open(path, O_RDONLY);
+        if (fd == -1) {
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            ::close(fd);
+            return false;
+        }
+        size = (size_t) st.st_size;
+
+        void * ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (ptr == MAP_FAILED) {
+            size = 0;
+            return false;
+        }
+        addr = (uint8_t *) ptr;
+
+#ifdef MADV_SEQUENTIAL
+        madvise(addr, size, MADV_SEQUENTIAL);
+#endif
+#endif
+        return true;
+    }
+
+    // the bytes before offset will not be read again
+    void release(size_t offset) {
+#if !defined(_WIN32) && defined(MADV_DONTNEED)
+        const size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+        const size_t n_release = offset - offset % page_size;
+        if (n_release > 0) {
+            madvise(addr, n_release, MADV_DONTNEED);
+        }
+#else
+        (void) offset;
+#endif
+    }
+
+    void close() {
+#if defined(_WIN32)
+        if (addr) {
+            UnmapViewOfFile(addr);
+        }
+        if (hmap != NULL) {
+            CloseHandle(hmap);
+        }
+        if (hfile != INVALID_HANDLE_VALUE) {
+            CloseHandle(hfile);
+        }
+        hmap  = NULL;
+        hfile = INVALID_HANDLE_VALUE;
+#else
+        if (addr) {
+            munmap(addr, size);
+        }
+#endif
+        addr = nullptr;
+        size = 0;
+    }
+};
+
+// mapped is set when the file could be mapped, a nullptr result is then an invalid model and not an I/O error
+static struct whisper_context * whisper_init_from_mmap_no_state(const char * path_model, struct whisper_context_params params, bool & mapped) {
+    struct mmap_context {
+        whisper_mmap mapping;
+        size_t current_offset;
+        size_t released_offset;
+    };
+
+    mmap_context ctx = {};
+
+    mapped = ctx.mapping.open(path_model);
+    if (!mapped) {
+        return nullptr;
+    }
+
+    whisper_model_loader loader = {};
+
+    loader.context = &ctx;
+
+    loader.read = [](void * ctx, void * output, size_t read_size) {
+        mmap_context * mm = reinterpret_cast<mmap_context *>(ctx);
+
+        const size_t size_to_copy = std::min(read_size, mm->mapping.size - mm->current_offset);
+
+        memcpy(output, mm->mapping.addr + mm->current_offset, size_to_copy);
+        mm->current_offset += size_to_copy;
+
+        // drop the copied pages every 4 MB
+        if (mm->current_offset - mm->released_offset >= 4*1024*1024) {
+            mm->mapping.release(mm->current_offset);
+            mm->released_offset = mm->current_offset;
+        }
+
+        return size_to_copy;
+    };
+
+    loader.eof = [](void * ctx) {
+        mmap_context * mm = reinterpret_cast<mmap_context *>(ctx);
+
+        return mm->current_offset >= mm->mapping.size;
+    };
+
+    loader.close = [](void * /*ctx*/) { };
+
+    auto wctx = whisper_init_with_params_no_state(&loader, params);
+
+    ctx.mapping.close();
+
+    return wctx;
+}
+
 struct whisper_context * whisper_init_from_file_with_params_no_state(const char * path_model, struct whisper_context_params params) {
     WHISPER_LOG_INFO("%s: loading model from '%s'\n", __func__, path_model);
 
+    if (params.use_mmap) {
+        bool mapped = false;
+        auto ctx = whisper_init_from_mmap_no_state(path_model, params, mapped);
+
+        if (ctx) {
+            ctx->path_model = path_model;
+            return ctx;
+        }
+
+        // reading the same bytes would fail the same way
+        if (mapped) {
+            WHISPER_LOG_ERROR("%s: failed to load '%s'\n", __func__, path_model);
+            return nullptr;
+        }
+
+        WHISPER_LOG_WARN("%s: failed to map '%s', reading it instead\n", __func__, path_model);
+    }
+
     auto fin = std::ifstream(path_model, std::ios::binary);
     if (!fin) {
         WHISPER_LOG_ERROR("%s: failed to open '%s'\n", __func__, path_model);
@@ -3265,6 +5210,22 @@ struct whisper_context * whisper_init_with_params_no_state(struct whisper_model_
 
     loader->close(loader->context);
 
+    switch (params.type_kv) {
+        case GGML_TYPE_F16:
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_Q4_0:
+            ctx->kvtype = params.type_kv;
+            break;
+        default:
+            if (params.type_kv >= 0 && params.type_kv < GGML_TYPE_COUNT) {
+                WHISPER_LOG_WARN("%s: unsupported KV cache type %s, using %s\n", __func__, ggml_type_name(params.type_kv), ggml_type_name(ctx->itype));
+            } else {
+                WHISPER_LOG_WARN("%s: invalid KV cache type %d, using %s\n", __func__, (int) params.type_kv, ggml_type_name(ctx->itype));
+            }
+            ctx->kvtype = ctx->itype;
+            break;
+    }
+
     return ctx;
 }
 
@@ -3342,6 +5303,8 @@ void whisper_free_state(struct whisper_state * state)
     if (state) {
         kv_cache_free(state->kv_self);
         kv_cache_free(state->kv_cross);
+        kv_cache_free(state->kv_enc);
+        kv_cache_free(state->kv_enc_cross);
 
 #ifdef WHISPER_USE_COREML
         if (state->ctx_coreml != nullptr) {
@@ -3363,6 +5326,9 @@ void whisper_free_state(struct whisper_state * state)
         whisper_allocr_free(state->alloc_encode);
         whisper_allocr_free(state->alloc_cross);
         whisper_allocr_free(state->alloc_decode);
+        whisper_allocr_free(state->alloc_batch);
+        whisper_allocr_free(state->alloc_decode_batch);
+        whisper_allocr_free(state->alloc_enc_inc);
 
         ggml_backend_free(state->backend);
 
@@ -3413,6 +5379,34 @@ int whisper_pcm_to_mel(struct whisper_context * ctx, const float * samples, int
     return whisper_pcm_to_mel_with_state(ctx, ctx->state, samples, n_samples, n_threads);
 }
 
+int whisper_pcm_to_mel_append_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
+    if (!log_mel_spectrogram_append(*state, samples, n_samples, n_threads, ctx->model.filters, state->mel_cache, state->mel)) {
+        WHISPER_LOG_ERROR("%s: failed to compute mel spectrogram\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+int whisper_pcm_to_mel_append(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads) {
+    return whisper_pcm_to_mel_append_with_state(ctx, ctx->state, samples, n_samples, n_threads);
+}
+
+void whisper_mel_cache_reset_with_state(struct whisper_state * state) {
+    state->n_enc_past  = 0;
+    state->n_mel_final = 0;
+
+    state->mel_cache.n_frames = 0;
+    state->mel_cache.mmax     = -1e20f;
+    state->mel_cache.samples.clear();
+    state->mel_cache.data.clear();
+    state->mel_cache.tail.clear();
+}
+
+void whisper_mel_cache_reset(struct whisper_context * ctx) {
+    whisper_mel_cache_reset_with_state(ctx->state);
+}
+
 // same as whisper_pcm_to_mel, but applies a Phase Vocoder to speed up the audio x2 (PV without phase lock is not good)
 int whisper_pcm_to_mel_phase_vocoder_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
     if (!log_mel_spectrogram(*state, samples, n_samples, WHISPER_SAMPLE_RATE, 2 * WHISPER_N_FFT, 2 * WHISPER_HOP_LENGTH, ctx->model.filters.n_mel, n_threads, ctx->model.filters, false, state->mel)) {
@@ -3428,8 +5422,78 @@ int whisper_pcm_to_mel_phase_vocoder(struct whisper_context * ctx, const float *
     return whisper_pcm_to_mel_phase_vocoder_with_state(ctx, ctx->state, samples, n_samples, n_threads);
 }
 
-// same as whisper_pcm_to_mel, but applies WSOLA to speed up the audio x2
-// TODO
+// WSOLA: waveform similarity overlap-add, compresses the audio x2 in time without changing the pitch
+// frames of WHISPER_WSOLA_FRAME samples are overlap-added every WHISPER_WSOLA_FRAME/2 output samples while the input
+// advances twice as fast. every frame is shifted by up to +/- WHISPER_WSOLA_TOLERANCE samples so that it lines up
+// with the natural continuation of the previous frame, which avoids the phasiness of a plain overlap-add
+#define WHISPER_WSOLA_FRAME     512 // 32 ms
+#define WHISPER_WSOLA_TOLERANCE 128 //  8 ms
+
+static void wsola_speed_up_2x(const float * samples, int n_samples, std::vector<float> & out) {
+    const int n_frame = WHISPER_WSOLA_FRAME;
+    const int hop_out = n_frame/2;
+    const int hop_in  = 2*hop_out;
+    const int n_tol   = WHISPER_WSOLA_TOLERANCE;
+
+    // zero padding so that every frame and search window stays inside the input
+    std::vector<float> x(n_samples + 2*n_frame + 2*n_tol + hop_in, 0.0f);
+    std::copy(samples, samples + n_samples, x.begin());
+
+    // periodic hann, the windows of frames hop_out apart sum to 1
+    std::vector<float> window;
+    hann_window(n_frame, true, window);
+
+    const int n_out = n_samples/2;
+    out.assign(n_out + n_frame, 0.0f);
+
+    int pos = 0;
+    for (int k = 0; k*hop_out < n_out; ++k) {
+        if (k > 0) {
+            // the samples that would follow the previous frame if the input was not compressed
+            const float * natural = x.data() + pos + hop_out;
+
+            const int nominal = k*hop_in;
+            const int d_min = std::max(-n_tol, -nominal);
+
+            float best_score = -std::numeric_limits<float>::infinity();
+            int   best_d     = 0;
+
+            for (int d = d_min; d <= n_tol; ++d) {
+                const float score = whisper_dot_f32(natural, x.data() + nominal + d, n_frame);
+                if (score > best_score) {
+                    best_score = score;
+                    best_d     = d;
+                }
+            }
+
+            pos = nominal + best_d;
+        }
+
+        float * dst = out.data() + k*hop_out;
+        const float * src = x.data() + pos;
+        for (int i = 0; i < n_frame; ++i) {
+            dst[i] += window[i]*src[i];
+        }
+    }
+
+    out.resize(n_out);
+}
+
+int whisper_pcm_to_mel_wsola_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
+    std::vector<float> compressed;
+    wsola_speed_up_2x(samples, n_samples, compressed);
+
+    if (!log_mel_spectrogram(*state, compressed.data(), compressed.size(), WHISPER_SAMPLE_RATE, WHISPER_N_FFT, WHISPER_HOP_LENGTH, ctx->model.filters.n_mel, n_threads, ctx->model.filters, false, state->mel)) {
+        WHISPER_LOG_ERROR("%s: failed to compute mel spectrogram\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+int whisper_pcm_to_mel_wsola(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads) {
+    return whisper_pcm_to_mel_wsola_with_state(ctx, ctx->state, samples, n_samples, n_threads);
+}
 
 // same as whisper_pcm_to_mel, but applies HPTSM to speed up the audio x2
 // TODO
@@ -3452,6 +5516,10 @@ int whisper_set_mel_with_state(
     state->mel.n_len_org = n_len;
     state->mel.n_mel     = n_mel;
 
+    state->encoded_seek = -1;
+    state->n_enc_past   = 0;
+    state->n_mel_final  = 0;
+
     state->mel.data.resize(n_len*n_mel);
     memcpy(state->mel.data.data(), data, n_len*n_mel*sizeof(float));
 
@@ -3484,7 +5552,60 @@ int whisper_encode(struct whisper_context * ctx, int offset, int n_threads) {
     return 0;
 }
 
+int whisper_encode_batch_with_states(struct whisper_context * ctx, struct whisper_state ** states, const int * offsets, int n_states, int audio_ctx, int n_threads) {
+    if (n_states <= 0) {
+        return 0;
+    }
+
+    if (audio_ctx > whisper_n_audio_ctx(ctx)) {
+        WHISPER_LOG_ERROR("%s: audio_ctx is larger than the maximum allowed (%d > %d)\n", __func__, audio_ctx, whisper_n_audio_ctx(ctx));
+        return -1;
+    }
+
+    // the batch is computed with the backend of the first state and writes the KV caches of the others,
+    // which only works when they are all in host memory. external encoders have no batched graph
+    bool can_batch = true;
+    for (int i = 0; i < n_states; ++i) {
+        if ((audio_ctx > 0 ? audio_ctx : whisper_n_audio_ctx(ctx)) > states[i]->n_max_audio_ctx) {
+            WHISPER_LOG_ERROR("%s: audio_ctx is larger than state %d was created for (%d > %d)\n", __func__, i, audio_ctx > 0 ? audio_ctx : whisper_n_audio_ctx(ctx), states[i]->n_max_audio_ctx);
+            return -1;
+        }
+
+        states[i]->exp_n_audio_ctx = audio_ctx;
+        can_batch = can_batch && ggml_backend_is_cpu(states[i]->backend) && !whisper_encode_external(*states[i]);
+    }
+
+    if (!can_batch) {
+        for (int i = 0; i < n_states; ++i) {
+            if (!whisper_encode_internal(*ctx, *states[i], offsets[i], n_threads, nullptr, nullptr)) {
+                WHISPER_LOG_ERROR("%s: failed to eval\n", __func__);
+                return -2;
+            }
+            states[i]->encoded_seek  = offsets[i];
+            states[i]->encoded_n_ctx = audio_ctx > 0 ? audio_ctx : whisper_n_audio_ctx(ctx);
+        }
+        return 0;
+    }
+
+    for (int i = 0; i < n_states; i += WHISPER_MAX_ENCODE_BATCH) {
+        const int n_batch = std::min(n_states - i, WHISPER_MAX_ENCODE_BATCH);
+        if (!whisper_encode_batch_internal(*ctx, states + i, offsets + i, n_batch, n_threads)) {
+            WHISPER_LOG_ERROR("%s: failed to eval\n", __func__);
+            return -2;
+        }
+    }
+
+    return 0;
+}
+
 int whisper_decode_with_state(struct whisper_context * ctx, struct whisper_state * state, const whisper_token * tokens, int n_tokens, int n_past, int n_threads) {
+    if (n_tokens > state->n_max_text_ctx) {
+        WHISPER_LOG_ERROR("%s: too many tokens for the state (%d > %d)\n", __func__, n_tokens, state->n_max_text_ctx);
+        return 1;
+    }
+
+    state->prompt_kv.clear();
+
     whisper_batch_prep_legacy(state->batch, tokens, n_tokens, n_past, 0);
 
     whisper_kv_cache_seq_rm(state->kv_self, 0, n_past, -1);
@@ -3497,6 +5618,56 @@ int whisper_decode_with_state(struct whisper_context * ctx, struct whisper_state
     return 0;
 }
 
+int whisper_decode_batch_with_states(struct whisper_context * ctx, struct whisper_state ** states, const whisper_token ** tokens, const int * n_tokens, const int * n_past, int n_states, int n_threads) {
+    if (n_states <= 0) {
+        return 0;
+    }
+
+    // the batch is computed with the backend of the first state and writes the KV caches of the others,
+    // which only works when they are all in host memory
+    bool can_batch = true;
+    for (int i = 0; i < n_states; ++i) {
+        if (n_tokens[i] > states[i]->n_max_text_ctx) {
+            WHISPER_LOG_ERROR("%s: too many tokens for state %d (%d > %d)\n", __func__, i, n_tokens[i], states[i]->n_max_text_ctx);
+            return 1;
+        }
+
+        states[i]->prompt_kv.clear();
+
+        whisper_batch_prep_legacy(states[i]->batch, tokens[i], n_tokens[i], n_past[i], 0);
+
+        whisper_kv_cache_seq_rm(states[i]->kv_self, 0, n_past[i], -1);
+
+        can_batch = can_batch && ggml_backend_is_cpu(states[i]->backend);
+    }
+
+    if (!can_batch || n_states == 1) {
+        for (int i = 0; i < n_states; ++i) {
+            if (!whisper_decode_internal(*ctx, *states[i], states[i]->batch, n_threads, nullptr, nullptr)) {
+                WHISPER_LOG_ERROR("%s: failed to eval\n", __func__);
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    for (int i = 0; i < n_states; i += WHISPER_MAX_DECODE_BATCH) {
+        const int n_batch = std::min(n_states - i, WHISPER_MAX_DECODE_BATCH);
+
+        const whisper_batch * batches[WHISPER_MAX_DECODE_BATCH];
+        for (int b = 0; b < n_batch; ++b) {
+            batches[b] = &states[i + b]->batch;
+        }
+
+        if (!whisper_decode_batch_internal(*ctx, states + i, batches, n_batch, n_threads)) {
+            WHISPER_LOG_ERROR("%s: failed to eval\n", __func__);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
 int whisper_decode(struct whisper_context * ctx, const whisper_token * tokens, int n_tokens, int n_past, int n_threads) {
     if (ctx->state == nullptr) {
         WHISPER_LOG_ERROR("%s: ERROR state was not loaded.\n", __func__);
@@ -3746,6 +5917,100 @@ float * whisper_get_logits_from_state(struct whisper_state * state) {
     return state->logits.data();
 }
 
+int whisper_n_prompt_reused_from_state(struct whisper_state * state) {
+    return state->n_prompt_reused;
+}
+
+int whisper_n_prompt_computed_from_state(struct whisper_state * state) {
+    return state->n_prompt_computed;
+}
+
+void whisper_set_encoder_cache_size(struct whisper_context * ctx, size_t max_size) {
+    auto & cache = ctx->encoder_cache;
+
+    std::lock_guard<std::mutex> lock(cache.mutex);
+
+    cache.max_size = max_size;
+
+    whisper_encoder_cache_evict(cache, 0);
+}
+
+int whisper_n_encoder_cache_hit_from_state(struct whisper_state * state) {
+    return state->n_encoder_cache_hit;
+}
+
+int whisper_n_encoder_cache_miss_from_state(struct whisper_state * state) {
+    return state->n_encoder_cache_miss;
+}
+
+int whisper_n_audio_ctx_alloc_from_state(struct whisper_state * state) {
+    return state->n_audio_ctx_alloc;
+}
+
+int whisper_set_incremental_encoder_with_state(struct whisper_context * ctx, struct whisper_state * state, int n_chunk) {
+    const auto & hparams = ctx->model.hparams;
+
+    n_chunk = std::max(n_chunk, 0);
+
+    if (n_chunk == state->enc_chunk) {
+        return 0;
+    }
+
+    state->n_enc_past = 0;
+
+    if (n_chunk == 0) {
+        state->enc_chunk = 0;
+
+        whisper_allocr_free(state->alloc_enc_inc);
+
+        kv_cache_free(state->kv_enc);
+        kv_cache_free(state->kv_enc_cross);
+
+        return 0;
+    }
+
+    if (whisper_encode_external(*state) || !ggml_backend_is_cpu(state->backend)) {
+        WHISPER_LOG_ERROR("%s: the incremental encoder is only supported by the CPU backend\n", __func__);
+        return -1;
+    }
+
+    if (hparams.n_audio_state != hparams.n_text_state || hparams.n_audio_layer != hparams.n_text_layer) {
+        WHISPER_LOG_ERROR("%s: the incremental encoder needs the same number of layers and states in the encoder and the decoder\n", __func__);
+        return -1;
+    }
+
+    state->enc_chunk = n_chunk;
+
+    if (state->kv_enc.ctx) {
+        return 0;
+    }
+
+    if (!kv_cache_init(hparams, state->kv_enc,       ctx->backend, ctx->itype, state->n_max_audio_ctx) ||
+        !kv_cache_init(hparams, state->kv_enc_cross, ctx->backend, ctx->itype, state->n_max_audio_ctx)) {
+        WHISPER_LOG_ERROR("%s: kv_cache_init() failed for the incremental encoder\n", __func__);
+        whisper_set_incremental_encoder_with_state(ctx, state, 0);
+        return -1;
+    }
+
+    // measured for a whole window without frames to reuse
+    whisper_allocr_graph_init(state->alloc_enc_inc, ctx->backend,
+            [&]() {
+                return whisper_build_graph_encoder_incremental(*ctx, *state, 0, state->n_max_audio_ctx);
+            });
+
+    whisper_allocr_graph_realloc(state->alloc_enc_inc, ctx->backend);
+
+    {
+        const size_t memory_size = ggml_nbytes(state->kv_enc.k) + ggml_nbytes(state->kv_enc.v) +
+                                   ggml_nbytes(state->kv_enc_cross.k) + ggml_nbytes(state->kv_enc_cross.v);
+
+        WHISPER_LOG_INFO("%s: kv size = %7.2f MB, compute buffer = %7.2f MB\n", __func__,
+                memory_size / 1e6, whisper_allocr_size(state->alloc_enc_inc) / 1e6);
+    }
+
+    return 0;
+}
+
 const char * whisper_token_to_str(struct whisper_context * ctx, whisper_token token) {
     return ctx->vocab.id_to_token.at(token).c_str();
 }
@@ -3804,6 +6069,8 @@ void whisper_print_timings(struct whisper_context * ctx) {
         const int32_t n_prompt = std::max(1, ctx->state->n_prompt);
 
         WHISPER_LOG_INFO("%s:     fallbacks = %3d p / %3d h\n", __func__, ctx->state->n_fail_p, ctx->state->n_fail_h);
+        WHISPER_LOG_INFO("%s:  prompt cache = %5d reused / %5d computed tokens\n", __func__, ctx->state->n_prompt_reused, ctx->state->n_prompt_computed);
+        WHISPER_LOG_INFO("%s: encoder cache = %5d hit / %5d miss\n", __func__, ctx->state->n_encoder_cache_hit, ctx->state->n_encoder_cache_miss);
         WHISPER_LOG_INFO("%s:      mel time = %8.2f ms\n", __func__, ctx->state->t_mel_us / 1000.0f);
         WHISPER_LOG_INFO("%s:   sample time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_sample_us, n_sample, 1e-3f * ctx->state->t_sample_us / n_sample);
         WHISPER_LOG_INFO("%s:   encode time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_encode_us, n_encode, 1e-3f * ctx->state->t_encode_us / n_encode);
@@ -3828,6 +6095,10 @@ void whisper_reset_timings(struct whisper_context * ctx) {
         ctx->state->n_decode = 0;
         ctx->state->n_batchd = 0;
         ctx->state->n_prompt = 0;
+        ctx->state->n_prompt_reused = 0;
+        ctx->state->n_prompt_computed = 0;
+        ctx->state->n_encoder_cache_hit = 0;
+        ctx->state->n_encoder_cache_miss = 0;
     }
 }
 
@@ -4971,9 +7242,10 @@ int whisper_full_with_state(
     if (n_samples > 0) {
         // compute log mel spectrogram
         if (params.speed_up) {
-            // TODO: Replace PV with more advanced algorithm
-            WHISPER_LOG_ERROR("%s: failed to compute log mel spectrogram\n", __func__);
-            return -1;
+            if (whisper_pcm_to_mel_wsola_with_state(ctx, state, samples, n_samples, params.n_threads) != 0) {
+                WHISPER_LOG_ERROR("%s: failed to compute log mel spectrogram\n", __func__);
+                return -1;
+            }
         } else {
             if (whisper_pcm_to_mel_with_state(ctx, state, samples, n_samples, params.n_threads) != 0) {
                 WHISPER_LOG_ERROR("%s: failed to compute log mel spectrogram\n", __func__);
@@ -5006,6 +7278,8 @@ int whisper_full_with_state(
         state->tid_last = 0;
         if (n_samples > 0) {
             state->energy = get_signal_energy(samples, n_samples, 32);
+        } else if (!state->mel_cache.samples.empty()) {
+            state->energy = get_signal_energy(state->mel_cache.samples.data(), state->mel_cache.samples.size(), 32);
         }
     }
 
@@ -5047,8 +7321,8 @@ int whisper_full_with_state(
 
     n_decoders = std::max(1, n_decoders);
 
-    if (n_decoders > WHISPER_MAX_DECODERS) {
-        WHISPER_LOG_ERROR("%s: too many decoders requested (%d), max = %d\n", __func__, n_decoders, WHISPER_MAX_DECODERS);
+    if (n_decoders > state->n_max_decoders) {
+        WHISPER_LOG_ERROR("%s: too many decoders requested (%d), max = %d\n", __func__, n_decoders, state->n_max_decoders);
         return -4;
     }
 
@@ -5101,6 +7375,19 @@ int whisper_full_with_state(
     }
     state->exp_n_audio_ctx = params.audio_ctx;
 
+    // the compressed audio of a clip of up to 30 s fits in the first half of the window, so the encoder only
+    // needs half of the context. longer audio keeps the context, the seek logic assumes full windows
+    if (params.speed_up && seek_end - seek_start <= 50*WHISPER_CHUNK_SIZE) {
+        const int n_audio_ctx = params.audio_ctx > 0 ? params.audio_ctx : whisper_n_audio_ctx(ctx);
+        state->exp_n_audio_ctx = std::max(1, n_audio_ctx/2);
+    }
+
+    if ((state->exp_n_audio_ctx > 0 ? state->exp_n_audio_ctx : whisper_n_audio_ctx(ctx)) > state->n_max_audio_ctx) {
+        WHISPER_LOG_ERROR("%s: audio_ctx is larger than the state was created for (%d > %d)\n", __func__,
+                state->exp_n_audio_ctx > 0 ? state->exp_n_audio_ctx : whisper_n_audio_ctx(ctx), state->n_max_audio_ctx);
+        return -5;
+    }
+
     // these tokens determine the task that will be performed
     std::vector<whisper_token> prompt_init = { whisper_token_sot(ctx), };
 
@@ -5131,7 +7418,7 @@ int whisper_full_with_state(
     int seek = seek_start;
 
     std::vector<whisper_token> prompt;
-    prompt.reserve(whisper_n_text_ctx(ctx));
+    prompt.reserve(state->n_max_text_ctx);
 
     struct beam_candidate {
         int decoder_idx;
@@ -5167,8 +7454,11 @@ int whisper_full_with_state(
             }
         }
 
-        // encode audio features starting at offset seek
-        if (!whisper_encode_internal(*ctx, *state, seek, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
+        // encode audio features starting at offset seek, unless whisper_encode_batch_with_states() already did
+        const int n_audio_ctx_cur = state->exp_n_audio_ctx > 0 ? state->exp_n_audio_ctx : whisper_n_audio_ctx(ctx);
+        if (state->encoded_seek == seek && state->encoded_n_ctx == n_audio_ctx_cur) {
+            state->encoded_seek = -1;
+        } else if (!whisper_encode_internal(*ctx, *state, seek, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
             WHISPER_LOG_ERROR("%s: failed to encode\n", __func__);
             return -6;
         }
@@ -5233,13 +7523,12 @@ int whisper_full_with_state(
             }
 
             // init prompt and kv cache for the current iteration
-            // TODO: do not recompute the prompt if it is the same as previous time
             {
                 prompt.clear();
 
                 // if we have already generated some text, use it as a prompt to condition the next generation
                 if (!prompt_past.empty() && t_cur < 0.5f && params.n_max_text_ctx > 0) {
-                    int n_take = std::min(std::min(params.n_max_text_ctx, whisper_n_text_ctx(ctx)/2), int(prompt_past.size()));
+                    int n_take = std::min(std::min(params.n_max_text_ctx, state->n_max_text_ctx/2), int(prompt_past.size()));
 
                     prompt = { whisper_token_prev(ctx) };
                     prompt.insert(prompt.begin() + 1, prompt_past.end() - n_take, prompt_past.end());
@@ -5253,21 +7542,45 @@ int whisper_full_with_state(
                 for (int i = 0; i < (int) prompt.size(); i++) {
                     WHISPER_LOG_DEBUG("%s: prompt[%d] = %s\n", __func__, i, ctx->vocab.id_to_token.at(prompt[i]).c_str());
                 }
-                WHISPER_LOG_DEBUG("\n\n");
+                WHISPER_LOG_DEBUG("\n\n");
+
+                // the KV cells of the longest common prefix with the previous prompt are kept, they are still valid
+                // when the audio was not encoded again in between, e.g. for the next temperature of the same window
+                // the last token is always decoded again, its logits are needed for the first sample
+                int n_reuse = 0;
+                {
+                    const int n_max = std::min(int(prompt.size()) - 1, int(state->prompt_kv.size()));
+
+                    while (n_reuse < n_max && prompt[n_reuse] == state->prompt_kv[n_reuse]) {
+                        n_reuse++;
+                    }
+                }
+
+                if (n_reuse > 0) {
+                    whisper_kv_cache_seq_keep(state->kv_self, 0);
+                    whisper_kv_cache_seq_rm(state->kv_self, 0, n_reuse, -1);
+                } else {
+                    whisper_kv_cache_clear(state->kv_self);
+                }
 
-                whisper_kv_cache_clear(state->kv_self);
+                state->prompt_kv.clear();
 
-                whisper_batch_prep_legacy(state->batch, prompt.data(), prompt.size(), 0, 0);
+                whisper_batch_prep_legacy(state->batch, prompt.data() + n_reuse, prompt.size() - n_reuse, n_reuse, 0);
 
                 if (!whisper_decode_internal(*ctx, *state, state->batch, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
                     WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
                     return -7;
                 }
 
+                state->prompt_kv = prompt;
+
+                state->n_prompt_reused   += n_reuse;
+                state->n_prompt_computed += prompt.size() - n_reuse;
+
                 {
                     const int64_t t_start_sample_us = ggml_time_us();
 
-                    state->decoders[0].i_batch = prompt.size() - 1;
+                    state->decoders[0].i_batch = prompt.size() - n_reuse - 1;
 
                     whisper_process_logits(*ctx, *state, state->decoders[0], params, t_cur);
 
@@ -5285,7 +7598,7 @@ int whisper_full_with_state(
                 }
             }
 
-            for (int i = 0, n_max = whisper_n_text_ctx(ctx)/2 - 4; i < n_max; ++i) {
+            for (int i = 0, n_max = state->n_max_text_ctx/2 - 4; i < n_max; ++i) {
                 const int64_t t_start_sample_us = ggml_time_us();
 
                 if (params.strategy == whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH) {
@@ -5340,21 +7653,7 @@ int whisper_full_with_state(
 
                     const int n_threads = std::min(params.n_threads, n_decoders_cur);
 
-                    if (n_threads == 1) {
-                        process();
-                    } else {
-                        std::vector<std::thread> threads(n_threads - 1);
-
-                        for (int t = 0; t < n_threads - 1; ++t) {
-                            threads[t] = std::thread(process);
-                        }
-
-                        process();
-
-                        for (int t = 0; t < n_threads - 1; ++t) {
-                            threads[t].join();
-                        }
-                    }
+                    whisper_parallel_for(n_threads, [&](int /*ith*/) { process(); });
                 }
 
                 beam_candidates.clear();
@@ -5587,21 +7886,7 @@ int whisper_full_with_state(
 
                         const int n_threads = std::min(params.n_threads, n_decoders_cur);
 
-                        if (n_threads == 1) {
-                            process();
-                        } else {
-                            std::vector<std::thread> threads(n_threads - 1);
-
-                            for (int t = 0; t < n_threads - 1; ++t) {
-                                threads[t] = std::thread(process);
-                            }
-
-                            process();
-
-                            for (int t = 0; t < n_threads - 1; ++t) {
-                                threads[t].join();
-                            }
-                        }
+                        whisper_parallel_for(n_threads, [&](int /*ith*/) { process(); });
                     }
 
                     state->t_sample_us += ggml_time_us() - t_start_sample_us;
@@ -6295,8 +8580,491 @@ WHISPER_API const char * whisper_bench_ggml_mul_mat_str(int n_threads) {
     return s.c_str();
 }
 
+WHISPER_API int whisper_bench_mel(int n_threads) {
+    fputs(whisper_bench_mel_str(n_threads), stderr);
+    return 0;
+}
+
+WHISPER_API const char * whisper_bench_mel_str(int n_threads) {
+    static std::string s;
+    s = "";
+    char strbuf[256];
+
+    ggml_time_init();
+    fill_sin_cos_table();
+
+    const int frame_size = WHISPER_N_FFT;
+    const int frame_step = WHISPER_HOP_LENGTH;
+    const int n_fft      = 1 + frame_size/2;
+
+    // 30 s of noise, without the trailing padding so that every frame runs the FFT
+    const int n_samples = WHISPER_SAMPLE_RATE*WHISPER_CHUNK_SIZE;
+
+    std::vector<float> samples(n_samples + frame_size);
+    {
+        std::mt19937 rng(0);
+        std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+        for (auto & v : samples) {
+            v = dist(rng);
+        }
+    }
+
+    std::vector<float> hann;
+    hann_window(frame_size, true, hann);
+
+    // triangular filters with a few non-zero weights each, like the model filterbank
+    whisper_filters filters;
+    filters.n_mel = 80;
+    filters.n_fft = n_fft;
+    filters.data.assign(filters.n_mel*n_fft, 0.0f);
+    for (int j = 0; j < filters.n_mel; j++) {
+        const int c = 1 + 2*j;
+        for (int k = std::max(0, c - 3); k < std::min(n_fft, c + 4); k++) {
+            filters.data[j*n_fft + k] = 1.0f - std::abs(k - c)/4.0f;
+        }
+    }
+    whisper_filters_init_ranges(filters);
+
+    whisper_mel mel[2];
+
+    for (int i = 0; i < 2; i++) {
+        const whisper_fft_plan * plan = i == 0 ? nullptr : whisper_fft_get_plan(frame_size);
+
+        mel[i].n_mel = filters.n_mel;
+        mel[i].n_len = n_samples/frame_step;
+        mel[i].data.resize(mel[i].n_mel*mel[i].n_len);
+
+        double tsum = 0.0;
+        int n = 0;
+
+        while (tsum < 1.0 || n < 3) {
+            const int64_t t0 = ggml_time_us();
+
+            std::vector<float> mmax(n_threads);
+            whisper_parallel_for(n_threads, [&](int ith) {
+                log_mel_spectrogram_worker_thread(ith, hann, samples, n_samples, frame_size, frame_step, n_threads, filters, plan, mel[i], mmax[ith]);
+            });
+
+            tsum += (ggml_time_us() - t0)*1e-6;
+            n++;
+        }
+
+        snprintf(strbuf, sizeof(strbuf), "log mel 30 s, %-16s: %8.2f ms (%3d runs)\n",
+                i == 0 ? "recursive fft" : "planned fft", 1e3*tsum/n, n);
+        s += strbuf;
+    }
+
+    float max_diff = 0.0f;
+    for (size_t i = 0; i < mel[0].data.size(); i++) {
+        max_diff = std::max(max_diff, std::abs(mel[0].data[i] - mel[1].data[i]));
+    }
+
+    snprintf(strbuf, sizeof(strbuf), "log mel 30 s, max abs difference of the log10 power: %g\n", max_diff);
+    s += strbuf;
+
+    return s.c_str();
+}
+
 // =================================================================================================
 
+//
+// Neural voice activity detection (Silero VAD v5, 16 kHz)
+//
+// The model is tiny (~300k parameters) and runs once every 512 samples, so it is evaluated with plain
+// dot products instead of a ggml graph - building and scheduling a graph would cost more than the math.
+//
+
+#define WHISPER_VAD_CONTEXT 64
+#define WHISPER_VAD_N_FFT   256
+#define WHISPER_VAD_HOP     128
+#define WHISPER_VAD_N_BINS  (WHISPER_VAD_N_FFT/2 + 1)
+#define WHISPER_VAD_N_STATE 128
+
+struct whisper_vad_conv {
+    int n_in   = 0;
+    int n_out  = 0;
+    int stride = 1;
+
+    std::vector<float> w; // [n_out][n_in*3]
+    std::vector<float> b; // [n_out]
+};
+
+struct whisper_vad_context {
+    // STFT basis, real part in the first WHISPER_VAD_N_BINS rows, imaginary part in the rest
+    std::vector<float> stft_basis; // [2*WHISPER_VAD_N_BINS][WHISPER_VAD_N_FFT]
+
+    whisper_vad_conv enc[4];
+
+    // LSTM cell, gates in the order i, f, g, o
+    std::vector<float> w_ih; // [4*WHISPER_VAD_N_STATE][WHISPER_VAD_N_STATE]
+    std::vector<float> w_hh; // [4*WHISPER_VAD_N_STATE][WHISPER_VAD_N_STATE]
+    std::vector<float> b_ih;
+    std::vector<float> b_hh;
+
+    std::vector<float> out_w; // [WHISPER_VAD_N_STATE]
+    float              out_b = 0.0f;
+
+    // recurrent state
+    std::vector<float> h;
+    std::vector<float> c;
+    std::vector<float> context; // last WHISPER_VAD_CONTEXT samples of the previous window
+    std::vector<float> pending; // samples that do not fill a window yet
+
+    // probabilities produced by the last whisper_vad_push()
+    std::vector<float> probs;
+
+    // scratch buffers
+    std::vector<float> x;
+    std::vector<float> y;
+    std::vector<float> col;
+    std::vector<float> gates;
+};
+
+static bool whisper_vad_load(struct whisper_model_loader * loader, whisper_vad_context & vctx) {
+    {
+        uint32_t magic;
+        read_safe(loader, magic);
+        if (magic != GGML_FILE_MAGIC) {
+            WHISPER_LOG_ERROR("%s: invalid VAD model data (bad magic)\n", __func__);
+            return false;
+        }
+    }
+
+    const int strides[4] = { 1, 2, 2, 1 };
+
+    std::map<std::string, std::vector<float> *> tensors;
+    tensors["_model.stft.forward_basis_buffer"] = &vctx.stft_basis;
+    for (int i = 0; i < 4; ++i) {
+        tensors["_model.encoder." + std::to_string(i) + ".reparam_conv.weight"] = &vctx.enc[i].w;
+        tensors["_model.encoder." + std::to_string(i) + ".reparam_conv.bias"]   = &vctx.enc[i].b;
+    }
+    tensors["_model.decoder.rnn.weight_ih"] = &vctx.w_ih;
+    tensors["_model.decoder.rnn.weight_hh"] = &vctx.w_hh;
+    tensors["_model.decoder.rnn.bias_ih"]   = &vctx.b_ih;
+    tensors["_model.decoder.rnn.bias_hh"]   = &vctx.b_hh;
+    tensors["_model.decoder.decoder.2.weight"] = &vctx.out_w;
+
+    std::vector<float> out_b;
+    tensors["_model.decoder.decoder.2.bias"] = &out_b;
+
+    std::vector<ggml_fp16_t> tmp;
+
+    size_t n_loaded = 0;
+
+    while (true) {
+        int32_t n_dims;
+        int32_t length;
+        int32_t ttype;
+
+        read_safe(loader, n_dims);
+        read_safe(loader, length);
+        read_safe(loader, ttype);
+
+        if (loader->eof(loader->context)) {
+            break;
+        }
+
+        if (n_dims < 1 || n_dims > 4 || length <= 0 || (ttype != GGML_TYPE_F32 && ttype != GGML_TYPE_F16)) {
+            WHISPER_LOG_ERROR("%s: invalid tensor header in VAD model (n_dims = %d, type = %d)\n", __func__, n_dims, ttype);
+            return false;
+        }
+
+        int32_t ne[4] = { 1, 1, 1, 1 };
+        int64_t nelements = 1;
+        for (int i = 0; i < n_dims; ++i) {
+            read_safe(loader, ne[i]);
+            nelements *= ne[i];
+        }
+
+        std::string name(length, 0);
+        loader->read(loader->context, &name[0], length);
+
+        if (tensors.find(name) == tensors.end()) {
+            WHISPER_LOG_ERROR("%s: unknown tensor '%s' in VAD model\n", __func__, name.c_str());
+            return false;
+        }
+
+        std::vector<float> & dst = *tensors[name];
+        dst.resize(nelements);
+
+        if (ttype == GGML_TYPE_F32) {
+            loader->read(loader->context, dst.data(), nelements*sizeof(float));
+        } else {
+            tmp.resize(nelements);
+            loader->read(loader->context, tmp.data(), nelements*sizeof(ggml_fp16_t));
+            for (int64_t i = 0; i < nelements; ++i) {
+                dst[i] = ggml_fp16_to_fp32(tmp[i]);
+            }
+        }
+
+        for (int i = 0; i < 4; ++i) {
+            if (&dst == &vctx.enc[i].w) {
+                if (n_dims != 3 || ne[0] != 3) {
+                    WHISPER_LOG_ERROR("%s: tensor '%s' has wrong shape in VAD model\n", __func__, name.c_str());
+                    return false;
+                }
+                vctx.enc[i].n_in   = ne[1];
+                vctx.enc[i].n_out  = ne[2];
+                vctx.enc[i].stride = strides[i];
+            }
+        }
+
+        n_loaded++;
+    }
+
+    if (n_loaded != tensors.size()) {
+        WHISPER_LOG_ERROR("%s: not all tensors loaded from VAD model - expected %zu, got %zu\n", __func__, tensors.size(), n_loaded);
+        return false;
+    }
+
+    // the layers have to chain: STFT magnitude -> 4 x conv -> LSTM -> linear
+    bool ok = vctx.stft_basis.size() == size_t(2*WHISPER_VAD_N_BINS*WHISPER_VAD_N_FFT) && vctx.enc[0].n_in == WHISPER_VAD_N_BINS;
+    for (int i = 0; i < 4; ++i) {
+        ok = ok && vctx.enc[i].b.size() == size_t(vctx.enc[i].n_out);
+        ok = ok && (i == 0 || vctx.enc[i].n_in == vctx.enc[i - 1].n_out);
+    }
+    ok = ok && vctx.enc[3].n_out == WHISPER_VAD_N_STATE;
+    ok = ok && vctx.w_ih.size() == size_t(4*WHISPER_VAD_N_STATE*WHISPER_VAD_N_STATE) && vctx.w_hh.size() == vctx.w_ih.size();
+    ok = ok && vctx.b_ih.size() == size_t(4*WHISPER_VAD_N_STATE) && vctx.b_hh.size() == vctx.b_ih.size();
+    ok = ok && vctx.out_w.size() == size_t(WHISPER_VAD_N_STATE) && out_b.size() == 1;
+
+    if (!ok) {
+        WHISPER_LOG_ERROR("%s: VAD model has unexpected tensor shapes, is it a Silero VAD v5 model?\n", __func__);
+        return false;
+    }
+
+    vctx.out_b = out_b[0];
+
+    whisper_vad_reset_state(&vctx);
+
+    return true;
+}
+
+static struct whisper_vad_context * whisper_vad_init(struct whisper_model_loader * loader) {
+    whisper_vad_context * vctx = new whisper_vad_context;
+
+    if (!whisper_vad_load(loader, *vctx)) {
+        loader->close(loader->context);
+        WHISPER_LOG_ERROR("%s: failed to load VAD model\n", __func__);
+        delete vctx;
+        return nullptr;
+    }
+
+    loader->close(loader->context);
+
+    return vctx;
+}
+
+struct whisper_vad_context * whisper_vad_init_from_file(const char * path_model) {
+    WHISPER_LOG_INFO("%s: loading VAD model from '%s'\n", __func__, path_model);
+
+    auto fin = std::ifstream(path_model, std::ios::binary);
+    if (!fin) {
+        WHISPER_LOG_ERROR("%s: failed to open '%s'\n", __func__, path_model);
+        return nullptr;
+    }
+
+    whisper_model_loader loader = {};
+
+    loader.context = &fin;
+
+    loader.read = [](void * ctx, void * output, size_t read_size) {
+        std::ifstream * fin = (std::ifstream*)ctx;
+        fin->read((char *)output, read_size);
+        return read_size;
+    };
+
+    loader.eof = [](void * ctx) {
+        std::ifstream * fin = (std::ifstream*)ctx;
+        return fin->eof();
+    };
+
+    loader.close = [](void * ctx) {
+        std::ifstream * fin = (std::ifstream*)ctx;
+        fin->close();
+    };
+
+    return whisper_vad_init(&loader);
+}
+
+struct whisper_vad_context * whisper_vad_init_from_buffer(void * buffer, size_t buffer_size) {
+    struct buf_context {
+        uint8_t* buffer;
+        size_t size;
+        size_t current_offset;
+    };
+
+    buf_context ctx = { reinterpret_cast<uint8_t*>(buffer), buffer_size, 0 };
+
+    whisper_model_loader loader = {};
+
+    loader.context = &ctx;
+
+    loader.read = [](void * ctx, void * output, size_t read_size) {
+        buf_context * buf = reinterpret_cast<buf_context *>(ctx);
+
+        size_t size_to_copy = buf->current_offset + read_size < buf->size ? read_size : buf->size - buf->current_offset;
+
+        memcpy(output, buf->buffer + buf->current_offset, size_to_copy);
+        buf->current_offset += size_to_copy;
+
+        return size_to_copy;
+    };
+
+    loader.eof = [](void * ctx) {
+        buf_context * buf = reinterpret_cast<buf_context *>(ctx);
+
+        return buf->current_offset >= buf->size;
+    };
+
+    loader.close = [](void * /*ctx*/) { };
+
+    return whisper_vad_init(&loader);
+}
+
+void whisper_vad_free(struct whisper_vad_context * vctx) {
+    delete vctx;
+}
+
+void whisper_vad_reset_state(struct whisper_vad_context * vctx) {
+    vctx->h.assign(WHISPER_VAD_N_STATE, 0.0f);
+    vctx->c.assign(WHISPER_VAD_N_STATE, 0.0f);
+    vctx->context.assign(WHISPER_VAD_CONTEXT, 0.0f);
+    vctx->pending.clear();
+    vctx->probs.clear();
+}
+
+static inline float whisper_vad_sigmoid(float x) {
+    return 1.0f/(1.0f + expf(-x));
+}
+
+// conv1d with kernel 3 and padding 1, followed by ReLU
+// x is [n_in][n_x], y is [n_out][n_y]
+static int whisper_vad_conv_relu(const whisper_vad_conv & conv, const float * x, int n_x, float * y, std::vector<float> & col) {
+    const int n_y = (n_x - 1)/conv.stride + 1;
+    const int n_k = 3*conv.n_in;
+
+    col.resize(n_k);
+
+    for (int t = 0; t < n_y; ++t) {
+        for (int i = 0; i < conv.n_in; ++i) {
+            for (int k = 0; k < 3; ++k) {
+                const int j = t*conv.stride + k - 1;
+                col[3*i + k] = j >= 0 && j < n_x ? x[i*n_x + j] : 0.0f;
+            }
+        }
+
+        for (int o = 0; o < conv.n_out; ++o) {
+            y[o*n_y + t] = std::max(0.0f, conv.b[o] + whisper_dot_f32(conv.w.data() + o*n_k, col.data(), n_k));
+        }
+    }
+
+    return n_y;
+}
+
+// speech probability of one WHISPER_VAD_WINDOW window
+static float whisper_vad_eval(whisper_vad_context & vctx, const float * samples) {
+    const int n_input = WHISPER_VAD_CONTEXT + WHISPER_VAD_WINDOW;
+    const int n_padded = n_input + WHISPER_VAD_CONTEXT;
+    const int n_frames = (n_padded - WHISPER_VAD_N_FFT)/WHISPER_VAD_HOP + 1;
+
+    // the window is prefixed with the tail of the previous one and reflect-padded on the right
+    float input[n_padded];
+    std::copy(vctx.context.begin(), vctx.context.end(), input);
+    std::copy(samples, samples + WHISPER_VAD_WINDOW, input + WHISPER_VAD_CONTEXT);
+    for (int i = 0; i < WHISPER_VAD_CONTEXT; ++i) {
+        input[n_input + i] = input[n_input - 2 - i];
+    }
+
+    std::copy(samples + WHISPER_VAD_WINDOW - WHISPER_VAD_CONTEXT, samples + WHISPER_VAD_WINDOW, vctx.context.begin());
+
+    // STFT magnitude, [WHISPER_VAD_N_BINS][n_frames]
+    int n_channels = WHISPER_VAD_N_BINS;
+    for (int i = 0; i < 4; ++i) {
+        n_channels = std::max(n_channels, vctx.enc[i].n_out);
+    }
+
+    vctx.x.resize(n_channels*n_frames);
+    vctx.y.resize(n_channels*n_frames);
+
+    for (int f = 0; f < WHISPER_VAD_N_BINS; ++f) {
+        const float * basis_re = vctx.stft_basis.data() + f*WHISPER_VAD_N_FFT;
+        const float * basis_im = vctx.stft_basis.data() + (f + WHISPER_VAD_N_BINS)*WHISPER_VAD_N_FFT;
+        for (int t = 0; t < n_frames; ++t) {
+            const float re = whisper_dot_f32(basis_re, input + t*WHISPER_VAD_HOP, WHISPER_VAD_N_FFT);
+            const float im = whisper_dot_f32(basis_im, input + t*WHISPER_VAD_HOP, WHISPER_VAD_N_FFT);
+            vctx.x[f*n_frames + t] = sqrtf(re*re + im*im);
+        }
+    }
+
+    // encoder
+    int n_x = n_frames;
+    for (int i = 0; i < 4; ++i) {
+        n_x = whisper_vad_conv_relu(vctx.enc[i], vctx.x.data(), n_x, vctx.y.data(), vctx.col);
+        std::swap(vctx.x, vctx.y);
+    }
+
+    // the encoder reduces the window to a single frame
+    WHISPER_ASSERT(n_x == 1);
+
+    // LSTM cell
+    const int n_state = WHISPER_VAD_N_STATE;
+
+    vctx.gates.resize(4*n_state);
+    for (int i = 0; i < 4*n_state; ++i) {
+        vctx.gates[i] = vctx.b_ih[i] + vctx.b_hh[i]
+            + whisper_dot_f32(vctx.w_ih.data() + i*n_state, vctx.x.data(), n_state)
+            + whisper_dot_f32(vctx.w_hh.data() + i*n_state, vctx.h.data(), n_state);
+    }
+
+    float logit = vctx.out_b;
+    for (int i = 0; i < n_state; ++i) {
+        const float gi = whisper_vad_sigmoid(vctx.gates[0*n_state + i]);
+        const float gf = whisper_vad_sigmoid(vctx.gates[1*n_state + i]);
+        const float gg = tanhf(vctx.gates[2*n_state + i]);
+        const float go = whisper_vad_sigmoid(vctx.gates[3*n_state + i]);
+
+        vctx.c[i] = gf*vctx.c[i] + gi*gg;
+        vctx.h[i] = go*tanhf(vctx.c[i]);
+
+        logit += vctx.out_w[i]*std::max(0.0f, vctx.h[i]);
+    }
+
+    return whisper_vad_sigmoid(logit);
+}
+
+int whisper_vad_push(struct whisper_vad_context * vctx, const float * samples, int n_samples) {
+    vctx->probs.clear();
+
+    int i = 0;
+
+    // complete the window started by the previous call
+    if (!vctx->pending.empty()) {
+        const int n_take = std::min(n_samples, WHISPER_VAD_WINDOW - (int) vctx->pending.size());
+        vctx->pending.insert(vctx->pending.end(), samples, samples + n_take);
+        i = n_take;
+
+        if ((int) vctx->pending.size() < WHISPER_VAD_WINDOW) {
+            return 0;
+        }
+
+        vctx->probs.push_back(whisper_vad_eval(*vctx, vctx->pending.data()));
+        vctx->pending.clear();
+    }
+
+    for (; i + WHISPER_VAD_WINDOW <= n_samples; i += WHISPER_VAD_WINDOW) {
+        vctx->probs.push_back(whisper_vad_eval(*vctx, samples + i));
+    }
+
+    vctx->pending.assign(samples + i, samples + n_samples);
+
+    return vctx->probs.size();
+}
+
+const float * whisper_vad_probs(struct whisper_vad_context * vctx) {
+    return vctx->probs.data();
+}
+
 // =================================================================================================
 
 //
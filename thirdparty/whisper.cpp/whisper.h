@@ -33,6 +33,7 @@
 #define WHISPER_N_FFT       400
 #define WHISPER_HOP_LENGTH  160
 #define WHISPER_CHUNK_SIZE  30
+#define WHISPER_VAD_WINDOW  512
 
 #ifdef __cplusplus
 extern "C" {
@@ -86,6 +87,19 @@ extern "C" {
 
     struct whisper_context_params {
         bool  use_gpu;
+        bool  use_mmap; // map the model file instead of reading it, only used by whisper_init_from_file_*
+
+        // type of the self and cross-attention KV caches of the states: GGML_TYPE_F16, GGML_TYPE_Q8_0 or GGML_TYPE_Q4_0
+        // quantized caches are dequantized when they are read, they take about 1/2 (Q8_0) or 1/4 (Q4_0) of the memory
+        enum ggml_type type_kv;
+    };
+
+    // largest decoding a state is created for, its KV caches and compute buffers are sized for it
+    // 0 uses the maximum of the model
+    struct whisper_state_params {
+        int n_max_decoders;  // decoders of a whisper_full() call: greedy.best_of, or the beam size for beam search (<= 8)
+        int n_max_text_ctx;  // tokens of the text context of a decoder, prompt included
+        int n_max_audio_ctx; // largest audio_ctx, full windows need the maximum of the model
     };
 
     typedef struct whisper_token_data {
@@ -182,7 +196,8 @@ extern "C" {
         "use whisper_init_with_params_no_state instead"
     );
 
-    WHISPER_API struct whisper_state * whisper_init_state(struct whisper_context * ctx);
+    WHISPER_API struct whisper_state * whisper_init_state            (struct whisper_context * ctx);
+    WHISPER_API struct whisper_state * whisper_init_state_with_params(struct whisper_context * ctx, struct whisper_state_params params);
 
     // Given a context, enable use of OpenVINO for encode inference.
     // model_path: Optional path to OpenVINO encoder IR model. If set to nullptr,
@@ -223,6 +238,28 @@ extern "C" {
                                int   n_samples,
                                int   n_threads);
 
+    // Append RAW PCM audio to the samples cached in the state and update its log mel spectrogram.
+    // Only the frames that overlap the new samples are computed, frames of the earlier samples are reused.
+    // The result is the same as whisper_pcm_to_mel() on all samples appended since the last reset.
+    // Pass 0 samples to whisper_full() to process the resulting spectrogram.
+    // Returns 0 on success
+    WHISPER_API int whisper_pcm_to_mel_append(
+            struct whisper_context * ctx,
+                       const float * samples,
+                               int   n_samples,
+                               int   n_threads);
+
+    WHISPER_API int whisper_pcm_to_mel_append_with_state(
+            struct whisper_context * ctx,
+              struct whisper_state * state,
+                       const float * samples,
+                               int   n_samples,
+                               int   n_threads);
+
+    // Drop the samples and frames cached by whisper_pcm_to_mel_append()
+    WHISPER_API void whisper_mel_cache_reset(struct whisper_context * ctx);
+    WHISPER_API void whisper_mel_cache_reset_with_state(struct whisper_state * state);
+
     // Convert RAW PCM audio to log mel spectrogram but applies a Phase Vocoder to speed up the audio x2.
     // The resulting spectrogram is stored inside the default state of the provided whisper context.
     // Returns 0 on success
@@ -239,6 +276,23 @@ extern "C" {
                            int   n_samples,
                            int   n_threads);
 
+    // Convert RAW PCM audio to log mel spectrogram but compresses the audio x2 in time with WSOLA first.
+    // The pitch is kept, so the spectrogram looks like speech spoken twice as fast.
+    // Used by whisper_full() when params.speed_up is set.
+    // Returns 0 on success
+    WHISPER_API int whisper_pcm_to_mel_wsola(
+        struct whisper_context * ctx,
+                   const float * samples,
+                           int   n_samples,
+                           int   n_threads);
+
+    WHISPER_API int whisper_pcm_to_mel_wsola_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+                   const float * samples,
+                           int   n_samples,
+                           int   n_threads);
+
     // This can be used to set a custom log mel spectrogram inside the default state of the provided whisper context.
     // Use this instead of whisper_pcm_to_mel() if you want to provide your own log mel spectrogram.
     // n_mel must be 80
@@ -271,6 +325,21 @@ extern "C" {
                                int   offset,
                                int   n_threads);
 
+    // Run the Whisper encoder on the log mel spectrograms of several states in one batched computation.
+    // The windows are stacked into one graph, so the weights are multiplied once with the frames of all of them.
+    // Each state gets the cross-attention memory of its own window, starting at offsets[i], as if
+    // whisper_encode_with_state() had been called on it. A whisper_full_with_state() that follows with the same
+    // audio_ctx and no new samples decodes that window without encoding it again.
+    // audio_ctx is used for every state, 0 means the full context of the model.
+    // Returns 0 on success
+    WHISPER_API int whisper_encode_batch_with_states(
+            struct whisper_context * ctx,
+             struct whisper_state ** states,
+                         const int * offsets,
+                               int   n_states,
+                               int   audio_ctx,
+                               int   n_threads);
+
     // Run the Whisper decoder to obtain the logits and probabilities for the next token.
     // Make sure to call whisper_encode() first.
     // tokens + n_tokens is the provided context for the decoder.
@@ -292,6 +361,21 @@ extern "C" {
                                int   n_past,
                                int   n_threads);
 
+    // Run the Whisper decoder for several states in one batched computation, for example one per speaker.
+    // The tokens of all states go through the layers together, so the weights are read once for all of them,
+    // while each state attends to its own past tokens and to its own encoded audio.
+    // State i gets the logits of tokens[i] + n_tokens[i] after n_past[i] tokens, as if
+    // whisper_decode_with_state() had been called on it. The states must be different.
+    // Returns 0 on success
+    WHISPER_API int whisper_decode_batch_with_states(
+            struct whisper_context * ctx,
+             struct whisper_state ** states,
+              const whisper_token ** tokens,
+                         const int * n_tokens,
+                         const int * n_past,
+                               int   n_states,
+                               int   n_threads);
+
     // Convert the provided text into tokens.
     // The tokens pointer must be large enough to hold the resulting tokens.
     // Returns the number of tokens on success, no more than n_max_tokens
@@ -364,6 +448,38 @@ extern "C" {
     WHISPER_API float * whisper_get_logits           (struct whisper_context * ctx);
     WHISPER_API float * whisper_get_logits_from_state(struct whisper_state * state);
 
+    // Number of prompt tokens of whisper_full_with_state() calls on this state whose KV cells were kept from the
+    // previous decoding, and number of prompt tokens that were decoded. The cells are only kept while the
+    // cross-attention memory does not change, i.e. for the temperature fallbacks of a window and for a call on
+    // a window that was already encoded by whisper_encode_batch_with_states()
+    WHISPER_API int whisper_n_prompt_reused_from_state  (struct whisper_state * state);
+    WHISPER_API int whisper_n_prompt_computed_from_state(struct whisper_state * state);
+
+    // Keep the cross-attention memory of recently encoded windows in the context, shared by all its states,
+    // up to max_size bytes. Encoding a window with the same mel frames and audio_ctx again copies its memory
+    // from the cache instead of running the encoder, the least recently used windows are dropped first.
+    // 0 disables the cache and frees it. Windows encoded by whisper_encode_batch_with_states() are not cached.
+    WHISPER_API void whisper_set_encoder_cache_size(struct whisper_context * ctx, size_t max_size);
+
+    // Number of windows of this state found in the encoder cache, and number encoded while it was enabled
+    WHISPER_API int whisper_n_encoder_cache_hit_from_state (struct whisper_state * state);
+    WHISPER_API int whisper_n_encoder_cache_miss_from_state(struct whisper_state * state);
+
+    // audio_ctx the encoder compute buffers of the state are sized for. they start at 256 frames and grow in steps of
+    // 256 up to the n_max_audio_ctx of the state when a longer audio_ctx is encoded
+    WHISPER_API int whisper_n_audio_ctx_alloc_from_state(struct whisper_state * state);
+
+    // [EXPERIMENTAL] Encode the window at the start of a spectrogram built with whisper_pcm_to_mel_append_with_state()
+    // incrementally, for a stream that is transcribed again every time samples are appended.
+    // The frames are split in chunks of n_chunk encoder frames (20 ms each) and a frame only attends to the frames
+    // up to the end of its chunk, so the chunks that only contain final mel frames are encoded once and kept.
+    // The model was trained with attention over the whole window, the output differs from the regular encoder
+    // and the accuracy is lower, more so for small chunks. Only available on the CPU backend, the state then
+    // also holds the keys and values of the encoder.
+    // n_chunk = 0 disables it and frees its memory.
+    // Returns 0 on success
+    WHISPER_API int whisper_set_incremental_encoder_with_state(struct whisper_context * ctx, struct whisper_state * state, int n_chunk);
+
     // Token Id -> String. Uses the vocabulary in the provided context
     WHISPER_API const char * whisper_token_to_str(struct whisper_context * ctx, whisper_token token);
     WHISPER_API const char * whisper_model_type_readable(struct whisper_context * ctx);
@@ -528,6 +644,7 @@ extern "C" {
     // NOTE: this function allocates memory, and it is the responsibility of the caller to free the pointer - see whisper_free_context_params & whisper_free_params()
     WHISPER_API struct whisper_context_params * whisper_context_default_params_by_ref();
     WHISPER_API struct whisper_context_params whisper_context_default_params(void);
+    WHISPER_API struct whisper_state_params whisper_state_default_params(void);
     WHISPER_API struct whisper_full_params * whisper_full_default_params_by_ref(enum whisper_sampling_strategy strategy);
     WHISPER_API struct whisper_full_params whisper_full_default_params(enum whisper_sampling_strategy strategy);
 
@@ -607,12 +724,34 @@ extern "C" {
 
     ////////////////////////////////////////////////////////////////////////////
 
+    // Neural voice activity detection
+    // Runs a Silero VAD v5 model (see models/convert-silero-vad-to-ggml.py) on 16 kHz mono PCM.
+    // One speech probability is produced per WHISPER_VAD_WINDOW samples (32 ms).
+
+    struct whisper_vad_context;
+
+    WHISPER_API struct whisper_vad_context * whisper_vad_init_from_file  (const char * path_model);
+    WHISPER_API struct whisper_vad_context * whisper_vad_init_from_buffer(void * buffer, size_t buffer_size);
+    WHISPER_API void                         whisper_vad_free            (struct whisper_vad_context * vctx);
+
+    // Clear the recurrent state and the samples buffered by whisper_vad_push()
+    WHISPER_API void whisper_vad_reset_state(struct whisper_vad_context * vctx);
+
+    // Feed new samples. Samples that do not fill a whole window are kept for the next call.
+    // Returns the number of probabilities computed, which can be read with whisper_vad_probs()
+    WHISPER_API int           whisper_vad_push (struct whisper_vad_context * vctx, const float * samples, int n_samples);
+    WHISPER_API const float * whisper_vad_probs(struct whisper_vad_context * vctx);
+
+    ////////////////////////////////////////////////////////////////////////////
+
     // Temporary helpers needed for exposing ggml interface
 
     WHISPER_API int          whisper_bench_memcpy          (int n_threads);
     WHISPER_API const char * whisper_bench_memcpy_str      (int n_threads);
     WHISPER_API int          whisper_bench_ggml_mul_mat    (int n_threads);
     WHISPER_API const char * whisper_bench_ggml_mul_mat_str(int n_threads);
+    WHISPER_API int          whisper_bench_mel             (int n_threads);
+    WHISPER_API const char * whisper_bench_mel_str         (int n_threads);
 
     // Control logging output; default behavior is to print to stderr
 